@@ -0,0 +1,10 @@
+
+HARU_BENCH_PHP = $(PHP_EXECUTABLE) -n -d extension_dir=$(top_builddir)/modules -d extension=haru.$(SHLIB_DL_SUFFIX_NAME) -d memory_limit=-1
+
+bench: all
+	@HARU_BENCH_PHP="$(HARU_BENCH_PHP)" $(HARU_BENCH_PHP) $(top_srcdir)/bench/run.php $(BENCH_ARGS)
+
+bench-check: all
+	@HARU_BENCH_PHP="$(HARU_BENCH_PHP)" $(HARU_BENCH_PHP) $(top_srcdir)/bench/run.php --check $(BENCH_ARGS)
+
+.PHONY: bench bench-check
@@ -0,0 +1,13 @@
+<?php
+/*
+ * Upper bounds of the peak memory (in bytes, at scale 1) checked by
+ * "run.php --check" and by tests/memory_*.phpt in "make test".
+ * Raise them deliberately, never to silence a regression.
+ */
+return array(
+	"text"   => 64 * 1024 * 1024,
+	"vector" => 96 * 1024 * 1024,
+	"images" => 128 * 1024 * 1024,
+	"cjk"    => 64 * 1024 * 1024,
+	"pages"  => 256 * 1024 * 1024,
+);
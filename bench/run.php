@@ -0,0 +1,123 @@
+<?php
+/*
+ * Benchmark runner for the haru extension.
+ *
+ * php run.php [--check] [--scale=N] [--mode=save,output,saveToStream,toString] [workload ...]
+ *
+ * Reports wall time, peak memory and output size of every workload and save
+ * mode. With --check it fails when the peak memory exceeds bench/limits.php.
+ * If HARU_BENCH_PHP holds the command line of the PHP binary (as set by
+ * "make bench"), every measurement runs in its own process.
+ */
+
+require __DIR__ . "/workloads.php";
+
+$workloads = array("text", "vector", "images", "cjk", "pages");
+$modes = array("save", "output", "saveToStream", "toString");
+$scale = 1;
+$check = false;
+$child = false;
+$selected = array();
+
+foreach (array_slice($argv, 1) as $arg) {
+	if ($arg === "--check") {
+		$check = true;
+	} else if ($arg === "--child") {
+		$child = true;
+	} else if (strncmp($arg, "--scale=", 8) === 0) {
+		$scale = max(1, (int)substr($arg, 8));
+	} else if (strncmp($arg, "--mode=", 7) === 0) {
+		$modes = explode(",", substr($arg, 7));
+	} else if (in_array($arg, $workloads, true)) {
+		$selected[] = $arg;
+	} else {
+		fwrite(STDERR, "Unknown argument: $arg\n");
+		exit(2);
+	}
+}
+
+if (!extension_loaded("haru")) {
+	fwrite(STDERR, "The haru extension is not loaded\n");
+	exit(2);
+}
+
+function bench_measure($workload, $mode, $scale)
+{
+	$start = hrtime(true);
+
+	$doc = new HaruDoc();
+	$doc->setCompressionMode(HaruDoc::COMP_ALL);
+	call_user_func("bench_" . $workload, $doc, $scale);
+	$built = hrtime(true);
+
+	switch ($mode) {
+		case "save":
+			$file = tempnam(sys_get_temp_dir(), "haru");
+			$doc->save($file);
+			unlink($file);
+			break;
+		case "output":
+			ob_start(function () { return ""; }, 1 << 20);
+			$doc->output();
+			ob_end_clean();
+			break;
+		case "saveToStream":
+			$doc->saveToStream();
+			break;
+		case "toString":
+			$pdf = $doc->toString();
+			unset($pdf);
+			break;
+		default:
+			throw new InvalidArgumentException("Unknown mode $mode");
+	}
+	$end = hrtime(true);
+
+	$stats = $doc->getStats();
+
+	return array(
+		"build_ms" => ($built - $start) / 1e6,
+		"save_ms" => ($end - $built) / 1e6,
+		"peak" => memory_get_peak_usage(),
+		"haru_peak" => $stats["request_memory_peak"],
+		"pages" => $stats["pages"],
+		"output" => $stats["output_size"],
+	);
+}
+
+if ($child) {
+	echo serialize(bench_measure($selected[0], $modes[0], $scale));
+	exit(0);
+}
+
+$php = getenv("HARU_BENCH_PHP");
+$limits = require __DIR__ . "/limits.php";
+$failed = 0;
+
+printf("%-8s %-13s %7s %10s %10s %10s %10s %12s\n", "workload", "mode", "pages", "build ms", "save ms", "peak KB", "haru KB", "output KB");
+
+foreach ($selected ? $selected : $workloads as $workload) {
+	foreach ($modes as $mode) {
+		if ($php) {
+			$cmd = $php . " " . escapeshellarg(__FILE__) . " --child --scale=$scale --mode=" . escapeshellarg($mode) . " " . escapeshellarg($workload);
+			$r = unserialize(shell_exec($cmd));
+			if (!is_array($r)) {
+				fwrite(STDERR, "$workload/$mode: child process failed\n");
+				$failed++;
+				continue;
+			}
+		} else {
+			$r = bench_measure($workload, $mode, $scale);
+		}
+
+		printf("%-8s %-13s %7d %10.1f %10.1f %10d %10d %12d\n", $workload, $mode, $r["pages"], $r["build_ms"], $r["save_ms"],
+			$r["peak"] / 1024, $r["haru_peak"] / 1024, $r["output"] / 1024);
+
+		if ($check && isset($limits[$workload]) && $r["peak"] > $limits[$workload] * $scale) {
+			fwrite(STDERR, sprintf("%s/%s: peak memory %d exceeds the limit of %d bytes\n", $workload, $mode, $r["peak"], $limits[$workload] * $scale));
+			$failed++;
+		}
+	}
+}
+
+exit($failed ? 1 : 0);
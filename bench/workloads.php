@@ -0,0 +1,104 @@
+<?php
+/*
+ * Benchmark workloads for the haru extension.
+ * Every workload builds a document and returns it; $scale multiplies its size.
+ */
+
+function bench_text(HaruDoc $doc, $scale)
+{
+	$font = $doc->getFont("Helvetica");
+	$para = str_repeat("Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua. ", 6) . "\n";
+	$text = str_repeat($para, 40 * $scale);
+
+	while ($text !== "") {
+		$page = $doc->addPage();
+		$page->setSize(HaruPage::SIZE_A4, HaruPage::PORTRAIT);
+		$page->beginText();
+		$page->setFontAndSize($font, 10);
+		$res = $page->layoutText($text, array(50, 50, $page->getWidth() - 50, $page->getHeight() - 50), array("align" => HaruPage::TALIGN_JUSTIFY));
+		$page->endText();
+		$text = $res["remainder"];
+	}
+}
+
+function bench_vector(HaruDoc $doc, $scale)
+{
+	$points = 5000;
+
+	for ($p = 0; $p < 20 * $scale; $p++) {
+		$page = $doc->addPage();
+		$ops = array(HaruPage::OP_SET_LINE_WIDTH, 0.5, HaruPage::OP_SET_RGB_STROKE, 0.1, 0.2, 0.6, HaruPage::OP_MOVE_TO, 40, 400);
+		for ($i = 1; $i < $points; $i++) {
+			$ops[] = HaruPage::OP_LINE_TO;
+			$ops[] = 40 + $i * 520 / $points;
+			$ops[] = 400 + 150 * sin($i / 50 + $p);
+		}
+		$ops[] = HaruPage::OP_STROKE;
+		for ($i = 0; $i < 200; $i++) {
+			array_push($ops, HaruPage::OP_RECTANGLE, 40 + $i * 2.6, 100, 2, 20 + ($i * 7 % 200), HaruPage::OP_FILL);
+		}
+		$page->drawOps(pack("d*", ...$ops));
+	}
+}
+
+function bench_images(HaruDoc $doc, $scale)
+{
+	$w = 256;
+	$h = 256;
+	$data = "";
+	for ($y = 0; $y < $h; $y++) {
+		for ($x = 0; $x < $w; $x++) {
+			$data .= chr($x) . chr($y) . chr(($x + $y) & 0xff);
+		}
+	}
+
+	for ($p = 0; $p < 50 * $scale; $p++) {
+		$page = $doc->addPage();
+		/* a distinct image per page, like a product catalog */
+		$image = $doc->loadRawFromString(substr($data, 3 * $p) . substr($data, 0, 3 * $p), $w, $h, HaruDoc::CS_DEVICE_RGB);
+		for ($i = 0; $i < 12; $i++) {
+			$page->drawImage($image, 40 + ($i % 3) * 170, 60 + (int)($i / 3) * 170, 150, 150);
+		}
+	}
+}
+
+function bench_cjk(HaruDoc $doc, $scale)
+{
+	$doc->useJPFonts();
+	$doc->useJPEncodings();
+	$font = $doc->getFont("MS-Mincho", "90ms-RKSJ-H");
+	/* "nihongo no tesuto" in Shift_JIS */
+	$line = str_repeat("\x93\xfa\x96\x7b\x8c\xea\x82\xcc\x83\x65\x83\x58\x83\x67 ", 8);
+
+	$ttf = getenv("HARU_BENCH_TTF");
+	if ($ttf) {
+		$ttf = $doc->getFont($doc->loadTTF($ttf, true), "WinAnsiEncoding");
+	}
+
+	for ($p = 0; $p < 50 * $scale; $p++) {
+		$page = $doc->addPage();
+		$page->beginText();
+		$page->setFontAndSize($font, 9);
+		for ($i = 0; $i < 60; $i++) {
+			$page->textOut(30, 800 - $i * 12, $line);
+		}
+		if ($ttf) {
+			$page->setFontAndSize($ttf, 9);
+			$page->textOut(30, 40, "Embedded TrueType font, page " . $p);
+		}
+		$page->endText();
+	}
+}
+
+function bench_pages(HaruDoc $doc, $scale)
+{
+	$font = $doc->getFont("Courier");
+
+	for ($p = 0; $p < 10000 * $scale; $p++) {
+		$page = $doc->addPage();
+		$page->beginText();
+		$page->setFontAndSize($font, 12);
+		$page->textOut(50, 780, "Page " . ($p + 1));
+		$page->endText();
+	}
+}
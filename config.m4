@@ -80,6 +80,14 @@ if test "$PHP_HARU" != "no"; then
 
   PHP_ADD_LIBRARY_WITH_PATH(hpdf, $HARU_DIR/$PHP_LIBDIR, HARU_SHARED_LIBADD)
 
+  AC_CHECK_HEADER([pthread.h], [
+    AC_CHECK_LIB(pthread, pthread_create, [
+      PHP_ADD_LIBRARY(pthread,, HARU_SHARED_LIBADD)
+      AC_DEFINE(HAVE_HARU_THREADS, 1, [Whether to deflate streams in parallel threads])
+    ])
+  ])
+
   PHP_SUBST(HARU_SHARED_LIBADD)
   PHP_NEW_EXTENSION(haru, haru.c, $ext_shared)
+  PHP_ADD_MAKEFILE_FRAGMENT
 fi
@@ -24,22 +24,45 @@
 #include "php_ini.h"
 #include "ext/standard/info.h"
 #include "zend_exceptions.h"
+#include "zend_interfaces.h"
+#include "zend_smart_str.h"
+#include "ext/standard/md5.h"
 #include "php_haru.h"
 #include <hpdf.h>
+#include <zlib.h>
+#ifdef HAVE_HARU_THREADS
+#include <pthread.h>
+#endif
 
 #define PHP_HARU_BUF_SIZE 32768
+#define PHP_HARU_MAX_DEFLATE_THREADS 64
+
+/* stream classes with separate compression settings */
+#define PHP_HARU_STREAM_TEXT 0
+#define PHP_HARU_STREAM_IMAGE 1
+#define PHP_HARU_STREAM_METADATA 2
+#define PHP_HARU_STREAM_CLASSES 3
+
+/* graphics mode of the pages whose contents have been flushed */
+#define PHP_HARU_GMODE_FLUSHED 0
+
+/* room for the block size in front of every libharu allocation */
+#define PHP_HARU_ALLOC_HEADER ZEND_MM_ALIGNED_SIZE(sizeof(size_t))
 
+ZEND_DECLARE_MODULE_GLOBALS(haru)
 
 /* {{{ structs and static vars */
 static zend_class_entry *ce_haruexception;
 static zend_class_entry *ce_harudoc;
 static zend_class_entry *ce_harupage;
+static zend_class_entry *ce_harutemplate;
 static zend_class_entry *ce_harufont;
 static zend_class_entry *ce_haruimage;
 static zend_class_entry *ce_harudestination;
 static zend_class_entry *ce_haruannotation;
 static zend_class_entry *ce_haruencoder;
 static zend_class_entry *ce_haruoutline;
+static zend_class_entry *ce_haruzip;
 
 static zend_object_handlers php_harudoc_handlers;
 static zend_object_handlers php_harupage_handlers;
@@ -49,9 +72,25 @@ static zend_object_handlers php_harudestination_handlers;
 static zend_object_handlers php_haruannotation_handlers;
 static zend_object_handlers php_haruencoder_handlers;
 static zend_object_handlers php_haruoutline_handlers;
+static zend_object_handlers php_haruzip_handlers;
 
 typedef struct {
 	HPDF_Doc h;
+	size_t output_size;
+	HashTable *image_index;
+	zend_long image_index_hits;
+	HashTable *widths;
+	HashTable *subset;
+	HashTable *fonts;
+	HashTable *placeholders;
+	HashTable *templates;
+	zval journal;
+	zend_long deflate_level[PHP_HARU_STREAM_CLASSES];
+	zend_long deflate_strategy[PHP_HARU_STREAM_CLASSES];
+	zend_bool auto_flush;
+	zend_bool subset_fonts;
+	zend_bool forkable;
+	zend_bool set_up;
 	zend_object std;
 } php_harudoc;
 
@@ -98,6 +137,16 @@ typedef struct {
 	zend_object std;
 } php_haruoutline;
 
+typedef struct {
+	zval stream;
+	zend_bool owned;
+	zend_bool closed;
+	uint32_t count;
+	uint64_t offset;
+	smart_str central;
+	zend_object std;
+} php_haruzip;
+
 /* }}} */
 
 /* macros {{{ */
@@ -115,6 +164,7 @@ HARU_OFFSET_MACRO(harudestination)
 HARU_OFFSET_MACRO(haruannotation)
 HARU_OFFSET_MACRO(haruencoder)
 HARU_OFFSET_MACRO(haruoutline)
+HARU_OFFSET_MACRO(haruzip)
 
 #define Z_HARUDOC_OBJ_P(zv) php_harudoc_fetch_object(Z_OBJ_P(zv));
 #define Z_HARUPAGE_OBJ_P(zv) php_harupage_fetch_object(Z_OBJ_P(zv));
@@ -124,6 +174,7 @@ HARU_OFFSET_MACRO(haruoutline)
 #define Z_HARUANNOTATION_OBJ_P(zv) php_haruannotation_fetch_object(Z_OBJ_P(zv));
 #define Z_HARUENCODER_OBJ_P(zv) php_haruencoder_fetch_object(Z_OBJ_P(zv));
 #define Z_HARUOUTLINE_OBJ_P(zv) php_haruoutline_fetch_object(Z_OBJ_P(zv));
+#define Z_HARUZIP_OBJ_P(zv) php_haruzip_fetch_object(Z_OBJ_P(zv));
 
 
 #define HARU_CHECK_FILE(filename)                                           \
@@ -149,21 +200,96 @@ HARU_OFFSET_MACRO(haruoutline)
 /* constructors and destructors {{{ */
 
 
+static inline int php_haru_valid_level(zend_long level) /* {{{ */
+{
+	return level >= -1 && level <= 9;
+}
+/* }}} */
+
+static inline int php_haru_valid_strategy(zend_long strategy) /* {{{ */
+{
+	switch (strategy) {
+		case Z_DEFAULT_STRATEGY:
+		case Z_FILTERED:
+		case Z_HUFFMAN_ONLY:
+		case Z_RLE:
+		case Z_FIXED:
+			return 1;
+	}
+	return 0;
+}
+/* }}} */
+
 static void php_harudoc_dtor(zend_object *object) /* {{{ */
 {
 	php_harudoc *doc = php_harudoc_fetch_object(object);
 
+	if (doc->fonts) {
+		zval *zfont;
+
+		/* HaruFont objects still referenced elsewhere outlive the document */
+		ZEND_HASH_FOREACH_VAL(doc->fonts, zfont) {
+			php_harufont *font = Z_HARUFONT_OBJ_P(zfont);
+
+			font->h = NULL;
+			ZVAL_UNDEF(&font->doc);
+		} ZEND_HASH_FOREACH_END();
+
+		zend_hash_destroy(doc->fonts);
+		FREE_HASHTABLE(doc->fonts);
+		doc->fonts = NULL;
+	}
+
+	if (doc->templates) {
+		/* the template pages are allocated from the document */
+		zend_hash_destroy(doc->templates);
+		FREE_HASHTABLE(doc->templates);
+		doc->templates = NULL;
+	}
+
 	if (doc->h) {
 		HPDF_Free(doc->h);
 		doc->h = NULL;
 	}
 
+	if (doc->image_index) {
+		zend_hash_destroy(doc->image_index);
+		FREE_HASHTABLE(doc->image_index);
+		doc->image_index = NULL;
+	}
+
+	if (doc->widths) {
+		zend_hash_destroy(doc->widths);
+		FREE_HASHTABLE(doc->widths);
+		doc->widths = NULL;
+	}
+
+	if (doc->subset) {
+		zend_hash_destroy(doc->subset);
+		FREE_HASHTABLE(doc->subset);
+		doc->subset = NULL;
+	}
+
+	if (doc->placeholders) {
+		zend_hash_destroy(doc->placeholders);
+		FREE_HASHTABLE(doc->placeholders);
+		doc->placeholders = NULL;
+	}
+
+	zval_ptr_dtor(&doc->journal);
+
 	zend_object_std_dtor(&doc->std);
 }
 
 static zend_object *php_harudoc_new(zend_class_entry *ce) /* {{{ */
 {
 	php_harudoc *doc = ecalloc(1, sizeof(*doc) + zend_object_properties_size(ce));
+	int i;
+
+	for (i = 0; i < PHP_HARU_STREAM_CLASSES; i++) {
+		doc->deflate_level[i] = php_haru_valid_level(HARU_G(compression_level)) ? HARU_G(compression_level) : -1;
+		doc->deflate_strategy[i] = php_haru_valid_strategy(HARU_G(compression_strategy)) ? HARU_G(compression_strategy) : Z_DEFAULT_STRATEGY;
+	}
 
 	zend_object_std_init(&doc->std, ce);
 	object_properties_init(&doc->std, ce);
@@ -209,7 +335,9 @@ static void php_harufont_dtor(zend_object *object) /* {{{ */
 		font->h = NULL;
 	}
 
-	Z_DELREF_P(&font->doc);
+	if (Z_TYPE(font->doc) != IS_UNDEF) {
+		Z_DELREF_P(&font->doc);
+	}
 	zend_object_std_dtor(&font->std);
 }
 /* }}} */
@@ -374,6 +502,32 @@ static zend_object *php_haruoutline_new(zend_class_entry *ce) /* {{{ */
 }
 /* }}} */
 
+static void php_haruzip_dtor(zend_object *object) /* {{{ */
+{
+	php_haruzip *zip = php_haruzip_fetch_object(object);
+
+	/* an archive which was not closed is left without its central directory */
+	zval_ptr_dtor(&zip->stream);
+	smart_str_free(&zip->central);
+	zend_object_std_dtor(&zip->std);
+}
+/* }}} */
+
+static zend_object *php_haruzip_new(zend_class_entry *ce) /* {{{ */
+{
+	php_haruzip *zip;
+
+	zip = ecalloc(1, sizeof(*zip) + zend_object_properties_size(ce));
+
+	zend_object_std_init(&zip->std, ce);
+	object_properties_init(&zip->std, ce);
+
+	zip->std.handlers = &php_haruzip_handlers;
+
+	return &zip->std;
+}
+/* }}} */
+
 /* }}} */
 
 /* internal utilities {{{ */
@@ -689,242 +843,2995 @@ static HPDF_Rect php_haru_array_to_rect(zval *array) /* {{{ */
 }
 /* }}} */
 
-
-/* HaruDoc methods {{{ */
-
-/* {{{ proto void HaruDoc::__construct()
- Construct new HaruDoc instance */
-static PHP_METHOD(HaruDoc, __construct)
+static int php_haru_array_to_rgb(zval *array, HPDF_RGBColor *color) /* {{{ */
 {
-	zval *object = getThis();
-	php_harudoc *doc;
-
-	if (FAILURE == zend_parse_parameters_none()) {
-		return;
-	}
-
-	doc = Z_HARUDOC_OBJ_P(object);
+	double v[3];
+	int i = 0;
+	zval *element;
 
-	if (doc->h) {
-		/* called __construct() twice, bail out */
-		return;
+	if (Z_TYPE_P(array) != IS_ARRAY || zend_hash_num_elements(Z_ARRVAL_P(array)) != 3) {
+		return FAILURE;
 	}
 
-	doc->h = HPDF_New(NULL, NULL);
+	ZEND_HASH_FOREACH_VAL_IND(Z_ARRVAL_P(array), element) {
+		v[i++] = zval_get_double(element);
+	} ZEND_HASH_FOREACH_END();
 
-	PHP_HARU_NULL_CHECK(doc->h, "Cannot create HaruDoc handle");
+	color->r = (HPDF_REAL)v[0];
+	color->g = (HPDF_REAL)v[1];
+	color->b = (HPDF_REAL)v[2];
+	return SUCCESS;
 }
 /* }}} */
 
-/* {{{ proto bool HaruDoc::resetError()
- Reset error state in the document handle */
-static PHP_METHOD(HaruDoc, resetError)
+/* {{{ php_haru_zval_to_doubles
+ Convert a numeric array or a string of packed doubles (pack('d*', ...)) to
+ a C array of doubles. Throws and returns NULL on malformed input. */
+static double *php_haru_zval_to_doubles(zval *data, size_t *count)
 {
-	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	double *values;
+	zval *element;
+	size_t i = 0;
 
-	if (zend_parse_parameters_none() == FAILURE) {
-		return;
+	if (Z_TYPE_P(data) == IS_STRING) {
+		if (Z_STRLEN_P(data) % sizeof(double) != 0) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Packed data length must be a multiple of %d", (int)sizeof(double));
+			return NULL;
+		}
+		*count = Z_STRLEN_P(data) / sizeof(double);
+		values = safe_emalloc(*count, sizeof(double), sizeof(double));
+		memcpy(values, Z_STRVAL_P(data), Z_STRLEN_P(data));
+		return values;
 	}
 
-	HPDF_ResetError(doc->h);
-	RETURN_TRUE;
-}
-/* }}} */
+	if (Z_TYPE_P(data) != IS_ARRAY) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Expected array or string of packed doubles");
+		return NULL;
+	}
 
-/* {{{ proto object HaruDoc::addPage()
- Add new page to the document */
-static PHP_METHOD(HaruDoc, addPage)
-{
-	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	*count = zend_hash_num_elements(Z_ARRVAL_P(data));
+	values = safe_emalloc(*count, sizeof(double), sizeof(double));
 
-	php_harupage *page;
-	HPDF_Page p;
+	ZEND_HASH_FOREACH_VAL_IND(Z_ARRVAL_P(data), element) {
+		ZVAL_DEREF(element);
+		switch (Z_TYPE_P(element)) {
+			case IS_LONG:
+				values[i++] = (double)Z_LVAL_P(element);
+				break;
+			case IS_DOUBLE:
+				values[i++] = Z_DVAL_P(element);
+				break;
+			default:
+				zend_throw_exception_ex(ce_haruexception, 0, "Element %zu is not a number", i);
+				efree(values);
+				return NULL;
+		}
+	} ZEND_HASH_FOREACH_END();
 
-	p = HPDF_AddPage(doc->h);
+	*count = i;
+	return values;
+}
+/* }}} */
+
+/* {{{ drawing operations executed by HaruPage::drawOps() */
+
+enum {
+	PHP_HARU_OP_MOVE_TO = 1,
+	PHP_HARU_OP_LINE_TO,
+	PHP_HARU_OP_CURVE_TO,
+	PHP_HARU_OP_CURVE_TO2,
+	PHP_HARU_OP_CURVE_TO3,
+	PHP_HARU_OP_RECTANGLE,
+	PHP_HARU_OP_ARC,
+	PHP_HARU_OP_CIRCLE,
+	PHP_HARU_OP_ELLIPSE,
+	PHP_HARU_OP_CLOSE_PATH,
+	PHP_HARU_OP_STROKE,
+	PHP_HARU_OP_CLOSE_PATH_STROKE,
+	PHP_HARU_OP_FILL,
+	PHP_HARU_OP_EOFILL,
+	PHP_HARU_OP_FILL_STROKE,
+	PHP_HARU_OP_CLOSE_PATH_FILL_STROKE,
+	PHP_HARU_OP_EOFILL_STROKE,
+	PHP_HARU_OP_CLOSE_PATH_EOFILL_STROKE,
+	PHP_HARU_OP_END_PATH,
+	PHP_HARU_OP_CLIP,
+	PHP_HARU_OP_EOCLIP,
+	PHP_HARU_OP_GSAVE,
+	PHP_HARU_OP_GRESTORE,
+	PHP_HARU_OP_CONCAT,
+	PHP_HARU_OP_SET_LINE_WIDTH,
+	PHP_HARU_OP_SET_LINE_CAP,
+	PHP_HARU_OP_SET_LINE_JOIN,
+	PHP_HARU_OP_SET_GRAY_FILL,
+	PHP_HARU_OP_SET_GRAY_STROKE,
+	PHP_HARU_OP_SET_RGB_FILL,
+	PHP_HARU_OP_SET_RGB_STROKE,
+	PHP_HARU_OP_SET_CMYK_FILL,
+	PHP_HARU_OP_SET_CMYK_STROKE,
+	PHP_HARU_OP_LAST
+};
 
-	if (php_haru_check_doc_error(doc)) {
-		return;
-	}
-	PHP_HARU_NULL_CHECK(p, "Cannot create HaruPage handle");
+/* number of arguments of each operation */
+static const unsigned char php_haru_op_args[PHP_HARU_OP_LAST] = {
+	0,
+	2, 2, 6, 4, 4, 4, 5, 3, 4,	/* path construction */
+	0, 0, 0, 0, 0, 0, 0, 0, 0,	/* path painting */
+	0, 0,						/* clipping */
+	0, 0, 6,					/* graphics state */
+	1, 1, 1,					/* line style */
+	1, 1, 3, 3, 4, 4			/* colors */
+};
 
-	object_init_ex(return_value, ce_harupage);
-//	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
+static HPDF_STATUS php_haru_page_exec_op(HPDF_Page page, int op, const double *a) /* {{{ */
+{
+#define R(n) ((HPDF_REAL)a[n])
+	switch (op) {
+		case PHP_HARU_OP_MOVE_TO:
+			return HPDF_Page_MoveTo(page, R(0), R(1));
+		case PHP_HARU_OP_LINE_TO:
+			return HPDF_Page_LineTo(page, R(0), R(1));
+		case PHP_HARU_OP_CURVE_TO:
+			return HPDF_Page_CurveTo(page, R(0), R(1), R(2), R(3), R(4), R(5));
+		case PHP_HARU_OP_CURVE_TO2:
+			return HPDF_Page_CurveTo2(page, R(0), R(1), R(2), R(3));
+		case PHP_HARU_OP_CURVE_TO3:
+			return HPDF_Page_CurveTo3(page, R(0), R(1), R(2), R(3));
+		case PHP_HARU_OP_RECTANGLE:
+			return HPDF_Page_Rectangle(page, R(0), R(1), R(2), R(3));
+		case PHP_HARU_OP_ARC:
+			return HPDF_Page_Arc(page, R(0), R(1), R(2), R(3), R(4));
+		case PHP_HARU_OP_CIRCLE:
+			return HPDF_Page_Circle(page, R(0), R(1), R(2));
+		case PHP_HARU_OP_ELLIPSE:
+			return HPDF_Page_Ellipse(page, R(0), R(1), R(2), R(3));
+		case PHP_HARU_OP_CLOSE_PATH:
+			return HPDF_Page_ClosePath(page);
+		case PHP_HARU_OP_STROKE:
+			return HPDF_Page_Stroke(page);
+		case PHP_HARU_OP_CLOSE_PATH_STROKE:
+			return HPDF_Page_ClosePathStroke(page);
+		case PHP_HARU_OP_FILL:
+			return HPDF_Page_Fill(page);
+		case PHP_HARU_OP_EOFILL:
+			return HPDF_Page_Eofill(page);
+		case PHP_HARU_OP_FILL_STROKE:
+			return HPDF_Page_FillStroke(page);
+		case PHP_HARU_OP_CLOSE_PATH_FILL_STROKE:
+			return HPDF_Page_ClosePathFillStroke(page);
+		case PHP_HARU_OP_EOFILL_STROKE:
+			return HPDF_Page_EofillStroke(page);
+		case PHP_HARU_OP_CLOSE_PATH_EOFILL_STROKE:
+			return HPDF_Page_ClosePathEofillStroke(page);
+		case PHP_HARU_OP_END_PATH:
+			return HPDF_Page_EndPath(page);
+		case PHP_HARU_OP_CLIP:
+			return HPDF_Page_Clip(page);
+		case PHP_HARU_OP_EOCLIP:
+			return HPDF_Page_Eoclip(page);
+		case PHP_HARU_OP_GSAVE:
+			return HPDF_Page_GSave(page);
+		case PHP_HARU_OP_GRESTORE:
+			return HPDF_Page_GRestore(page);
+		case PHP_HARU_OP_CONCAT:
+			return HPDF_Page_Concat(page, R(0), R(1), R(2), R(3), R(4), R(5));
+		case PHP_HARU_OP_SET_LINE_WIDTH:
+			return HPDF_Page_SetLineWidth(page, R(0));
+		case PHP_HARU_OP_SET_LINE_CAP:
+			return HPDF_Page_SetLineCap(page, (HPDF_LineCap)a[0]);
+		case PHP_HARU_OP_SET_LINE_JOIN:
+			return HPDF_Page_SetLineJoin(page, (HPDF_LineJoin)a[0]);
+		case PHP_HARU_OP_SET_GRAY_FILL:
+			return HPDF_Page_SetGrayFill(page, R(0));
+		case PHP_HARU_OP_SET_GRAY_STROKE:
+			return HPDF_Page_SetGrayStroke(page, R(0));
+		case PHP_HARU_OP_SET_RGB_FILL:
+			return HPDF_Page_SetRGBFill(page, R(0), R(1), R(2));
+		case PHP_HARU_OP_SET_RGB_STROKE:
+			return HPDF_Page_SetRGBStroke(page, R(0), R(1), R(2));
+		case PHP_HARU_OP_SET_CMYK_FILL:
+			return HPDF_Page_SetCMYKFill(page, R(0), R(1), R(2), R(3));
+		case PHP_HARU_OP_SET_CMYK_STROKE:
+			return HPDF_Page_SetCMYKStroke(page, R(0), R(1), R(2), R(3));
+	}
+#undef R
+	return HPDF_INVALID_PARAMETER;
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ libharu memory allocator
+ * libharu allocates through these, so its memory is accounted by the Zend MM
+ * and counts towards memory_limit. The size of each block is kept in front
+ * of it to maintain the usage counters reported by HaruDoc::getStats(). The
+ * callbacks get no document, so the counters are kept for the request. */
+
+static void * HPDF_STDCALL php_haru_alloc(HPDF_UINT size) /* {{{ */
+{
+	char *ptr = emalloc(PHP_HARU_ALLOC_HEADER + size);
+
+	*(size_t *)ptr = size;
+
+	HARU_G(mem_usage) += size;
+	if (HARU_G(mem_usage) > HARU_G(mem_peak)) {
+		HARU_G(mem_peak) = HARU_G(mem_usage);
+	}
+	return ptr + PHP_HARU_ALLOC_HEADER;
+}
+/* }}} */
+
+static void HPDF_STDCALL php_haru_free(void *ptr) /* {{{ */
+{
+	char *block = (char *)ptr - PHP_HARU_ALLOC_HEADER;
+
+	HARU_G(mem_usage) -= *(size_t *)block;
+	efree(block);
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ persistent TrueType font cache
+ * The raw bytes of TTF/TTC files are kept in persistent memory across
+ * requests and fonts are parsed into new documents from memory, so a font
+ * file is read from disk only once per process (or after it has changed).
+ * Entries are keyed by the absolute path and validated against the mtime and
+ * size of the file; entries not in use by any document are evicted in LRU
+ * order when haru.font_cache_size is exceeded. */
+
+typedef struct _php_haru_font_entry {
+	char *path;
+	char *data;
+	size_t size;
+	time_t mtime;
+	uint32_t refcount;
+	zend_ulong last_used;
+	zend_bool cached;
+} php_haru_font_entry;
 
-	page = Z_HARUPAGE_OBJ_P(return_value);
+typedef struct {
+	php_haru_font_entry *entry;
+	size_t pos;
+} php_haru_font_stream;
+
+static HashTable php_haru_font_cache;
+static size_t php_haru_font_cache_used;
+static size_t php_haru_font_cache_max;
+static zend_ulong php_haru_font_cache_tick;
+
+#ifdef ZTS
+static MUTEX_T php_haru_font_cache_mutex;
+# define PHP_HARU_FONT_CACHE_LOCK()   tsrm_mutex_lock(php_haru_font_cache_mutex)
+# define PHP_HARU_FONT_CACHE_UNLOCK() tsrm_mutex_unlock(php_haru_font_cache_mutex)
+#else
+# define PHP_HARU_FONT_CACHE_LOCK()
+# define PHP_HARU_FONT_CACHE_UNLOCK()
+#endif
 
-	page->doc = *getThis();
-	page->h = p;
+/* fonts are parsed from the cache through private libharu structures and
+ * loaders, which are only known to match these versions; other versions load
+ * every font from disk with the public API */
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20200 && HPDF_VERSION_ID < 20500
+# define PHP_HARU_FONT_CACHE_LOAD 1
+#endif
 
-//	zend_objects_store_add_ref(getThis());
+static void php_haru_font_entry_free(php_haru_font_entry *entry) /* {{{ */
+{
+	pefree(entry->data, 1);
+	pefree(entry->path, 1);
+	pefree(entry, 1);
 }
 /* }}} */
 
-/* {{{ proto object HaruDoc::insertPage(object page)
- Insert new page just before the specified page */
-static PHP_METHOD(HaruDoc, insertPage)
+#ifdef PHP_HARU_FONT_CACHE_LOAD
+/* must be called with the cache locked */
+static void php_haru_font_cache_remove(php_haru_font_entry *entry) /* {{{ */
 {
-	zval *z_page;
-	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	zend_hash_str_del(&php_haru_font_cache, entry->path, strlen(entry->path));
+	php_haru_font_cache_used -= entry->size;
+	entry->cached = 0;
 
-	php_harupage *target, *page;
-	HPDF_Page p;
-
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "O", &z_page, ce_harupage) == FAILURE) {
-		return;
+	if (entry->refcount == 0) {
+		php_haru_font_entry_free(entry);
 	}
+}
+/* }}} */
 
-	target = Z_HARUPAGE_OBJ_P(z_page);
+/* must be called with the cache locked */
+static void php_haru_font_cache_evict(size_t needed) /* {{{ */
+{
+	while (php_haru_font_cache_used + needed > php_haru_font_cache_max) {
+		php_haru_font_entry *entry, *lru = NULL;
 
-	p = HPDF_InsertPage(doc->h, target->h);
+		ZEND_HASH_FOREACH_PTR(&php_haru_font_cache, entry) {
+			if (entry->refcount == 0 && (!lru || entry->last_used < lru->last_used)) {
+				lru = entry;
+			}
+		} ZEND_HASH_FOREACH_END();
 
-	if (php_haru_check_doc_error(doc)) {
-		return;
+		if (!lru) {
+			/* everything left is in use */
+			break;
+		}
+		php_haru_font_cache_remove(lru);
 	}
-	PHP_HARU_NULL_CHECK(p, "Cannot create HaruPage handle");
-
-	object_init_ex(return_value, ce_harupage);
-//	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
-
-	page = Z_HARUPAGE_OBJ_P(return_value);
-
-	page->doc = *getThis();
-	page->h = p;
-
-//	zend_objects_store_add_ref(getThis());
 }
 /* }}} */
 
-/* {{{ proto object HaruDoc::getCurrentPage()
- Return current page of the document */
-static PHP_METHOD(HaruDoc, getCurrentPage)
+static void php_haru_font_cache_release(php_haru_font_entry *entry) /* {{{ */
 {
-	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	PHP_HARU_FONT_CACHE_LOCK();
+	if (--entry->refcount == 0 && !entry->cached) {
+		php_haru_font_entry_free(entry);
+	}
+	PHP_HARU_FONT_CACHE_UNLOCK();
+}
+/* }}} */
 
-	php_harupage *page;
-	HPDF_Page p;
+/* returns a referenced entry or NULL if the font should be loaded from the file */
+static php_haru_font_entry *php_haru_font_cache_get(const char *filename) /* {{{ */
+{
+	php_haru_font_entry *entry;
+	php_stream *stream;
+	zend_stat_t sb;
+	char *path;
+	char *data;
+	size_t done = 0;
 
-	if (zend_parse_parameters_none() == FAILURE) {
-		return;
+	if (php_haru_font_cache_max == 0) {
+		return NULL;
 	}
 
-	p = HPDF_GetCurrentPage(doc->h);
+	path = expand_filepath(filename, NULL);
+	if (!path) {
+		return NULL;
+	}
 
-	if (php_haru_check_doc_error(doc)) {
-		return;
+	if (VCWD_STAT(path, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size <= 0 || (size_t)sb.st_size > php_haru_font_cache_max) {
+		efree(path);
+		return NULL;
 	}
 
-	if (!p) {
-		/* no current page is not an error */
-		RETURN_FALSE;
+	PHP_HARU_FONT_CACHE_LOCK();
+	entry = zend_hash_str_find_ptr(&php_haru_font_cache, path, strlen(path));
+	if (entry) {
+		if (entry->mtime == sb.st_mtime && entry->size == (size_t)sb.st_size) {
+			entry->refcount++;
+			entry->last_used = ++php_haru_font_cache_tick;
+			PHP_HARU_FONT_CACHE_UNLOCK();
+			efree(path);
+			return entry;
+		}
+		/* the file has changed */
+		php_haru_font_cache_remove(entry);
 	}
+	PHP_HARU_FONT_CACHE_UNLOCK();
 
-	object_init_ex(return_value, ce_harupage);
-//	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
+	stream = php_stream_open_wrapper(path, "rb", 0, NULL);
+	if (!stream) {
+		efree(path);
+		return NULL;
+	}
 
-	page = Z_HARUPAGE_OBJ_P(return_value);
+	data = pemalloc(sb.st_size, 1);
+	while (done < (size_t)sb.st_size) {
+		ssize_t n = php_stream_read(stream, data + done, sb.st_size - done);
 
-	page->doc = *getThis();
-	page->h = p;
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	php_stream_close(stream);
+
+	if (done != (size_t)sb.st_size) {
+		pefree(data, 1);
+		efree(path);
+		return NULL;
+	}
+
+	entry = pemalloc(sizeof(*entry), 1);
+	entry->path = pestrdup(path, 1);
+	entry->data = data;
+	entry->size = done;
+	entry->mtime = sb.st_mtime;
+	entry->refcount = 1;
+	entry->cached = 0;
+	efree(path);
+
+	PHP_HARU_FONT_CACHE_LOCK();
+	entry->last_used = ++php_haru_font_cache_tick;
+
+	/* another thread may have cached the same file meanwhile */
+	if (!zend_hash_str_exists(&php_haru_font_cache, entry->path, strlen(entry->path))) {
+		php_haru_font_cache_evict(entry->size);
+		if (php_haru_font_cache_used + entry->size <= php_haru_font_cache_max) {
+			zend_hash_str_add_ptr(&php_haru_font_cache, entry->path, strlen(entry->path), entry);
+			php_haru_font_cache_used += entry->size;
+			entry->cached = 1;
+		}
+	}
+	PHP_HARU_FONT_CACHE_UNLOCK();
 
-//	zend_objects_store_add_ref(getThis());
+	return entry;
 }
 /* }}} */
 
-/* {{{ proto object HaruDoc::getEncoder(string encoding)
- Return HaruEncoder instance with the specified encoding */
-static PHP_METHOD(HaruDoc, getEncoder)
+static HPDF_STATUS php_haru_font_stream_read(HPDF_Stream stream, HPDF_BYTE *ptr, HPDF_UINT *siz) /* {{{ */
 {
-	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
-
-	php_haruencoder *encoder;
-	HPDF_Encoder e;
-	char *enc;
-	int enc_len;
-	zend_string *zenc;
+	php_haru_font_stream *fs = (php_haru_font_stream *)stream->attr;
+	size_t left = fs->entry->size - fs->pos;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &zenc) == FAILURE) {
-		return;
+	if (*siz > left) {
+		memcpy(ptr, fs->entry->data + fs->pos, left);
+		memset(ptr + left, 0, *siz - left);
+		fs->pos += left;
+		*siz = (HPDF_UINT)left;
+		return HPDF_STREAM_EOF;
 	}
 
-	enc = ZSTR_VAL(zenc);
-	enc_len = ZSTR_LEN(zenc);
+	memcpy(ptr, fs->entry->data + fs->pos, *siz);
+	fs->pos += *siz;
+	return HPDF_OK;
+}
+/* }}} */
 
-	e = HPDF_GetEncoder(doc->h, (const char *)enc);
+static HPDF_STATUS php_haru_font_stream_seek(HPDF_Stream stream, HPDF_INT pos, HPDF_WhenceMode mode) /* {{{ */
+{
+	php_haru_font_stream *fs = (php_haru_font_stream *)stream->attr;
+	zend_long base;
 
-	if (php_haru_check_doc_error(doc)) {
-		return;
+	switch (mode) {
+		case HPDF_SEEK_CUR:
+			base = (zend_long)fs->pos;
+			break;
+		case HPDF_SEEK_END:
+			base = (zend_long)fs->entry->size;
+			break;
+		default:
+			base = 0;
+			break;
 	}
-	PHP_HARU_NULL_CHECK(e, "Cannot create HaruEncoder handle");
 
-	object_init_ex(return_value, ce_haruencoder);
+	if (base + pos < 0 || (size_t)(base + pos) > fs->entry->size) {
+		return HPDF_SetError(stream->error, HPDF_STREAM_EOF, 0);
+	}
 
-	encoder = Z_HARUENCODER_OBJ_P(return_value);
+	fs->pos = (size_t)(base + pos);
+	return HPDF_OK;
+}
+/* }}} */
 
-	encoder->doc = *getThis();
-	encoder->h = e;
+static HPDF_INT32 php_haru_font_stream_tell(HPDF_Stream stream) /* {{{ */
+{
+	return (HPDF_INT32)((php_haru_font_stream *)stream->attr)->pos;
 }
 /* }}} */
 
-/* {{{ proto object HaruDoc::getCurrentEncoder()
- Return HaruEncoder currently used in the document */
-static PHP_METHOD(HaruDoc, getCurrentEncoder)
+static HPDF_UINT32 php_haru_font_stream_size(HPDF_Stream stream) /* {{{ */
 {
-	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	return (HPDF_UINT32)((php_haru_font_stream *)stream->attr)->entry->size;
+}
+/* }}} */
 
-	php_haruencoder *encoder;
-	HPDF_Encoder e;
+static void php_haru_font_stream_free(HPDF_Stream stream) /* {{{ */
+{
+	php_haru_font_stream *fs = (php_haru_font_stream *)stream->attr;
 
-	if (zend_parse_parameters_none() == FAILURE) {
-		return;
-	}
+	php_haru_font_cache_release(fs->entry);
+	HPDF_FreeMem(stream->mmgr, fs);
+	stream->attr = NULL;
+}
+/* }}} */
 
-	e = HPDF_GetCurrentEncoder(doc->h);
+/* the stream takes over the reference to the entry */
+static HPDF_Stream php_haru_font_stream_new(HPDF_Doc h, php_haru_font_entry *entry) /* {{{ */
+{
+	HPDF_Stream stream;
+	php_haru_font_stream *fs;
 
-	if (php_haru_check_doc_error(doc)) {
-		return;
+	stream = (HPDF_Stream)HPDF_GetMem(h->mmgr, sizeof(HPDF_Stream_Rec));
+	if (!stream) {
+		php_haru_font_cache_release(entry);
+		return NULL;
 	}
 
-	if (!e) {
-		/* no encoder set */
-		RETURN_FALSE;
+	fs = (php_haru_font_stream *)HPDF_GetMem(h->mmgr, sizeof(php_haru_font_stream));
+	if (!fs) {
+		HPDF_FreeMem(h->mmgr, stream);
+		php_haru_font_cache_release(entry);
+		return NULL;
 	}
 
-	object_init_ex(return_value, ce_haruencoder);
-//	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
-
-	encoder = Z_HARUENCODER_OBJ_P(return_value);
+	fs->entry = entry;
+	fs->pos = 0;
 
-	encoder->doc = *getThis();
-	encoder->h = e;
+	memset(stream, 0, sizeof(HPDF_Stream_Rec));
+	stream->sig_bytes = HPDF_STREAM_SIG_BYTES;
+	stream->type = HPDF_STREAM_CALLBACK;
+	stream->mmgr = h->mmgr;
+	stream->error = &h->error;
+	stream->read_fn = php_haru_font_stream_read;
+	stream->seek_fn = php_haru_font_stream_seek;
+	stream->tell_fn = php_haru_font_stream_tell;
+	stream->size_fn = php_haru_font_stream_size;
+	stream->free_fn = php_haru_font_stream_free;
+	stream->attr = fs;
 
-//	zend_objects_store_add_ref(getThis());
+	return stream;
 }
 /* }}} */
 
-/* {{{ proto bool HaruDoc::setCurrentEncoder(string encoding)
- Set the current encoder for the document */
-static PHP_METHOD(HaruDoc, setCurrentEncoder)
+/* mirrors LoadTTFontFromStream() of libharu, which is not exported;
+ * index < 0 loads a plain TTF file */
+static const char *php_haru_load_cached_ttf(php_harudoc *doc, php_haru_font_entry *entry, zend_long index, HPDF_BOOL embed) /* {{{ */
 {
-	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	HPDF_Stream stream;
+	HPDF_FontDef def;
 
-	char *enc;
-	int enc_len;
-	HPDF_STATUS status;
-	zend_string *zenc;
+	stream = php_haru_font_stream_new(doc->h, entry);
+	if (!stream) {
+		return NULL;
+	}
 
-//	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &enc, &enc_len) == FAILURE) {
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &zenc) == FAILURE) {
-		return;
+	/* the font definition owns the stream from now on */
+	if (index < 0) {
+		def = HPDF_TTFontDef_Load(doc->h->mmgr, stream, embed);
+	} else {
+		def = HPDF_TTFontDef_Load2(doc->h->mmgr, stream, (HPDF_UINT)index, embed);
+	}
+	if (!def) {
+		return NULL;
 	}
 
-	enc = ZSTR_VAL(zenc);
-	status = HPDF_SetCurrentEncoder(doc->h, (const char *)enc);
+	if (HPDF_Doc_FindFontDef(doc->h, def->base_font)) {
+		HPDF_FontDef_Free(def);
+		HPDF_SetError(&doc->h->error, HPDF_FONT_EXISTS, 0);
+		return NULL;
+	}
 
-	if (php_haru_status_to_exception(status)) {
-		return;
+	if (HPDF_List_Add(doc->h->fontdef_list, def) != HPDF_OK) {
+		HPDF_FontDef_Free(def);
+		return NULL;
 	}
-	RETURN_TRUE;
-}
+
+	if (embed) {
+		if (doc->h->ttfont_tag[0] == 0) {
+			memcpy(doc->h->ttfont_tag, "HPDFAA", 6);
+		} else {
+			int i;
+
+			for (i = 5; i >= 0; i--) {
+				doc->h->ttfont_tag[i] += 1;
+				if (doc->h->ttfont_tag[i] > 'Z') {
+					doc->h->ttfont_tag[i] = 'A';
+				} else {
+					break;
+				}
+			}
+		}
+		HPDF_TTFontDef_SetTagName(def, (char *)doc->h->ttfont_tag);
+	}
+
+	return def->base_font;
+}
+/* }}} */
+#endif
+
+/* index < 0 loads a plain TTF file */
+static const char *php_haru_load_ttf(php_harudoc *doc, const char *fontfile, zend_long index, HPDF_BOOL embed) /* {{{ */
+{
+#ifdef PHP_HARU_FONT_CACHE_LOAD
+	php_haru_font_entry *entry = php_haru_font_cache_get(fontfile);
+
+	if (entry) {
+		return php_haru_load_cached_ttf(doc, entry, index, embed);
+	}
+#endif
+	if (index < 0) {
+		return HPDF_LoadTTFontFromFile(doc->h, fontfile, embed);
+	}
+	return HPDF_LoadTTFontFromFile2(doc->h, fontfile, (HPDF_UINT)index, embed);
+}
+/* }}} */
+
+/* the thread count is clamped to 1..PHP_HARU_MAX_DEFLATE_THREADS */
+static ZEND_INI_MH(OnUpdateHaruDeflateThreads) /* {{{ */
+{
+	zend_long threads = zend_atol(ZSTR_VAL(new_value), ZSTR_LEN(new_value));
+	zend_long *p;
+#ifndef ZTS
+	char *base = (char *) mh_arg2;
+#else
+	char *base = (char *) ts_resource(*((int *) mh_arg2));
+#endif
+
+	if (threads < 1) {
+		threads = 1;
+	} else if (threads > PHP_HARU_MAX_DEFLATE_THREADS) {
+		threads = PHP_HARU_MAX_DEFLATE_THREADS;
+	}
+
+	p = (zend_long *) (base + (size_t) mh_arg1);
+	*p = threads;
+	return SUCCESS;
+}
+/* }}} */
+
+static ZEND_INI_MH(OnUpdateHaruFontCacheSize) /* {{{ */
+{
+	zend_long size = zend_atol(ZSTR_VAL(new_value), ZSTR_LEN(new_value));
+
+	if (size < 0) {
+		return FAILURE;
+	}
+	php_haru_font_cache_max = (size_t)size;
+	return SUCCESS;
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ image index
+ * With image deduplication enabled, images loaded from strings are indexed by
+ * the MD5 digest of their bytes and images loaded from files by the identity
+ * of the file, together with the loader and its parameters, so loading the
+ * same image again returns the image object already embedded in the document. */
+
+static zend_string *php_haru_image_key_init(char type, const unsigned char *digest, zend_long *params, int nparams) /* {{{ */
+{
+	zend_string *key = zend_string_alloc(1 + 16 + nparams * sizeof(zend_long), 0);
+
+	ZSTR_VAL(key)[0] = type;
+	memcpy(ZSTR_VAL(key) + 1, digest, 16);
+	if (nparams) {
+		memcpy(ZSTR_VAL(key) + 1 + 16, params, nparams * sizeof(zend_long));
+	}
+	ZSTR_VAL(key)[ZSTR_LEN(key)] = '\0';
+
+	return key;
+}
+/* }}} */
+
+static zend_string *php_haru_image_key_mem(char type, const char *data, size_t len, zend_long *params, int nparams) /* {{{ */
+{
+	PHP_MD5_CTX context;
+	unsigned char digest[16];
+
+	PHP_MD5Init(&context);
+	PHP_MD5Update(&context, data, len);
+	PHP_MD5Final(digest, &context);
+
+	return php_haru_image_key_init(type, digest, params, nparams);
+}
+/* }}} */
+
+/* files are keyed by their real path, size and modification time, so they are
+ * read only once, by libharu; returns NULL if the file cannot be found,
+ * libharu reports the error then */
+static zend_string *php_haru_image_key_file(char type, const char *filename, zend_long *params, int nparams) /* {{{ */
+{
+	char resolved[MAXPATHLEN];
+	zend_stat_t sb;
+	zend_long info[4];
+	zend_string *key;
+	size_t len, pos;
+
+	if (!VCWD_REALPATH(filename, resolved) || VCWD_STAT(resolved, &sb) != 0) {
+		return NULL;
+	}
+
+	info[0] = (zend_long)sb.st_size;
+	info[1] = (zend_long)sb.st_mtime;
+	info[2] = (zend_long)sb.st_ino;
+	info[3] = (zend_long)sb.st_dev;
+
+	len = strlen(resolved);
+	key = zend_string_alloc(1 + sizeof(info) + nparams * sizeof(zend_long) + len, 0);
+
+	/* the lowercase type keeps file keys apart from the digests of the data */
+	ZSTR_VAL(key)[0] = (char)(type | 0x20);
+	memcpy(ZSTR_VAL(key) + 1, info, sizeof(info));
+	pos = 1 + sizeof(info);
+	if (nparams) {
+		memcpy(ZSTR_VAL(key) + pos, params, nparams * sizeof(zend_long));
+		pos += nparams * sizeof(zend_long);
+	}
+	memcpy(ZSTR_VAL(key) + pos, resolved, len);
+	ZSTR_VAL(key)[ZSTR_LEN(key)] = '\0';
+
+	return key;
+}
+/* }}} */
+
+static HPDF_Image php_haru_image_index_find(php_harudoc *doc, zend_string *key) /* {{{ */
+{
+	HPDF_Image i = zend_hash_find_ptr(doc->image_index, key);
+
+	if (i) {
+		doc->image_index_hits++;
+	}
+	return i;
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ width tables
+ * libharu looks the glyph widths up on every measurement, which for CID fonts
+ * means a walk over the width array of the font for each character. Here the
+ * widths are kept per font in tables indexed by character code (and by
+ * unicode for getUnicodeWidth()), filled in on first use so that libharu
+ * marks the glyphs as used exactly as it would without the tables. The tables
+ * of 16 bit codes are split in pages of 256 entries by the high byte, which
+ * are allocated for the ranges actually used. */
+
+#define PHP_HARU_WIDTH_UNSET 0x7fffffff
+#define PHP_HARU_IS_WHITE_SPACE(c) ((c) == 0x00 || (c) == 0x09 || (c) == 0x0A || (c) == 0x0C || (c) == 0x0D || (c) == 0x20)
+
+typedef struct {
+	int32_t *code_widths;    /* 256 entries by character code, single byte fonts */
+	int32_t **code_pages;    /* pages by character code, Type0 fonts */
+	int32_t **unicode_pages; /* pages by unicode */
+	int code_count;          /* single byte codes looked up so far */
+	HPDF_UINT16 **codes;     /* pages of character codes by unicode for UTF-8 text, 0 if none */
+} php_haru_widths;
+
+static void php_haru_pages_free(void **pages) /* {{{ */
+{
+	int i;
+
+	if (!pages) {
+		return;
+	}
+	for (i = 0; i < 256; i++) {
+		if (pages[i]) {
+			efree(pages[i]);
+		}
+	}
+	efree(pages);
+}
+/* }}} */
+
+static void php_haru_widths_dtor(zval *zv) /* {{{ */
+{
+	php_haru_widths *w = Z_PTR_P(zv);
+
+	if (w->code_widths) {
+		efree(w->code_widths);
+	}
+	php_haru_pages_free((void **)w->code_pages);
+	php_haru_pages_free((void **)w->unicode_pages);
+	php_haru_pages_free((void **)w->codes);
+	efree(w);
+}
+/* }}} */
+
+static int32_t *php_haru_widths_alloc(size_t n) /* {{{ */
+{
+	int32_t *table = safe_emalloc(n, sizeof(int32_t), 0);
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		table[i] = PHP_HARU_WIDTH_UNSET;
+	}
+	return table;
+}
+/* }}} */
+
+/* the page of the width table holding code, allocated on first use */
+static int32_t *php_haru_widths_page(int32_t ***pages, HPDF_UINT16 code) /* {{{ */
+{
+	if (!*pages) {
+		*pages = ecalloc(256, sizeof(int32_t *));
+	}
+	if (!(*pages)[code >> 8]) {
+		(*pages)[code >> 8] = php_haru_widths_alloc(256);
+	}
+	return (*pages)[code >> 8];
+}
+/* }}} */
+
+static php_haru_widths *php_haru_widths_get(php_harudoc *doc, HPDF_Font font) /* {{{ */
+{
+	zend_ulong key = (zend_ulong)(zend_uintptr_t)font;
+	php_haru_widths *w;
+
+	if (!doc->widths) {
+		ALLOC_HASHTABLE(doc->widths);
+		zend_hash_init(doc->widths, 8, NULL, php_haru_widths_dtor, 0);
+	}
+
+	if ((w = zend_hash_index_find_ptr(doc->widths, key)) == NULL) {
+		w = ecalloc(1, sizeof(*w));
+		zend_hash_index_update_ptr(doc->widths, key, w);
+	}
+	return w;
+}
+/* }}} */
+
+/* same as HPDF_Font_TextWidth() */
+static HPDF_TextWidth php_haru_text_width(php_harudoc *doc, HPDF_Font font, const HPDF_BYTE *text, HPDF_UINT len) /* {{{ */
+{
+	HPDF_FontAttr attr = (HPDF_FontAttr)font->attr;
+	HPDF_TextWidth tw = {0, 0, 0, 0};
+	php_haru_widths *w;
+	int32_t *table;
+	HPDF_UINT i;
+
+	if ((attr->type == HPDF_FONT_TYPE1 || attr->type == HPDF_FONT_TRUETYPE) && attr->widths) {
+		HPDF_UINT w0 = 0, w1 = 0, w2 = 0, w3 = 0, spaces = 0;
+
+		w = php_haru_widths_get(doc, font);
+		if (!w->code_widths) {
+			w->code_widths = php_haru_widths_alloc(256);
+			if (attr->type == HPDF_FONT_TYPE1) {
+				/* Type1 widths are static, TrueType glyphs get marked as used on lookup */
+				for (i = 0; i < 256; i++) {
+					w->code_widths[i] = attr->widths[i];
+				}
+				w->code_count = 256;
+			}
+		}
+		table = w->code_widths;
+
+		if (w->code_count < 256) {
+			for (i = 0; i < len; i++) {
+				if (table[text[i]] == PHP_HARU_WIDTH_UNSET) {
+					table[text[i]] = (int32_t)HPDF_Font_TextWidth(font, text + i, 1).width;
+					w->code_count++;
+				}
+			}
+		}
+
+		/* every entry is filled in now, keep the loop free of branches */
+		for (i = 0; i + 4 <= len; i += 4) {
+			w0 += table[text[i]];
+			w1 += table[text[i + 1]];
+			w2 += table[text[i + 2]];
+			w3 += table[text[i + 3]];
+			spaces += PHP_HARU_IS_WHITE_SPACE(text[i]) + PHP_HARU_IS_WHITE_SPACE(text[i + 1]) + PHP_HARU_IS_WHITE_SPACE(text[i + 2]) + PHP_HARU_IS_WHITE_SPACE(text[i + 3]);
+		}
+		for (; i < len; i++) {
+			w0 += table[text[i]];
+			spaces += PHP_HARU_IS_WHITE_SPACE(text[i]);
+		}
+
+		tw.width = w0 + w1 + w2 + w3;
+		tw.numchars = len;
+		tw.numspace = spaces;
+		tw.numwords = spaces + ((len > 0 && !PHP_HARU_IS_WHITE_SPACE(text[len - 1])) ? 1 : 0);
+		return tw;
+	}
+
+	/* the codes of the UTF-8 encoder are up to 4 bytes long, it is left to libharu */
+	if ((attr->type == HPDF_FONT_TYPE0_CID || attr->type == HPDF_FONT_TYPE0_TT) && attr->writing_mode == HPDF_WMODE_HORIZONTAL &&
+			strcmp(attr->encoder->name, "UTF-8") != 0) {
+		HPDF_Encoder encoder = attr->encoder;
+		HPDF_ParseText_Rec state;
+		HPDF_BYTE b = 0;
+
+		w = php_haru_widths_get(doc, font);
+
+		HPDF_Encoder_SetParseText(encoder, &state, text, len);
+
+		for (i = 0; i < len; i++) {
+			HPDF_ByteType btype = HPDF_Encoder_ByteType(encoder, &state);
+			HPDF_UINT16 code;
+
+			b = text[i];
+			code = b;
+			if (btype == HPDF_BYTE_TYPE_LEAD) {
+				code = (HPDF_UINT16)((code << 8) + (i + 1 < len ? text[i + 1] : 0));
+			}
+
+			if (btype != HPDF_BYTE_TYPE_TRIAL) {
+				table = php_haru_widths_page(&w->code_pages, code);
+				if (table[code & 0xff] == PHP_HARU_WIDTH_UNSET) {
+					if (attr->fontdef->type == HPDF_FONTDEF_TYPE_CID) {
+						table[code & 0xff] = HPDF_CIDFontDef_GetCIDWidth(attr->fontdef, HPDF_CMapEncoder_ToCID(encoder, code));
+					} else {
+						table[code & 0xff] = HPDF_TTFontDef_GetCharWidth(attr->fontdef, HPDF_Encoder_ToUnicode(encoder, code));
+					}
+				}
+				tw.width += table[code & 0xff];
+				tw.numchars++;
+			}
+
+			if (PHP_HARU_IS_WHITE_SPACE(code)) {
+				tw.numwords++;
+				tw.numspace++;
+			}
+		}
+
+		if (!PHP_HARU_IS_WHITE_SPACE(b)) {
+			tw.numwords++;
+		}
+		return tw;
+	}
+
+	return HPDF_Font_TextWidth(font, text, len);
+}
+/* }}} */
+
+/* same as HPDF_Font_GetUnicodeWidth() */
+static HPDF_INT php_haru_unicode_width(php_harudoc *doc, HPDF_Font font, HPDF_UNICODE code) /* {{{ */
+{
+	php_haru_widths *w = php_haru_widths_get(doc, font);
+	int32_t *table = php_haru_widths_page(&w->unicode_pages, code);
+	HPDF_INT width;
+
+	if (table[code & 0xff] == PHP_HARU_WIDTH_UNSET) {
+		width = HPDF_Font_GetUnicodeWidth(font, code);
+		if (font->error->error_no != HPDF_OK) {
+			/* let the caller report it */
+			return width;
+		}
+		table[code & 0xff] = width;
+	}
+	return table[code & 0xff];
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ UTF-8 text
+ * UTF-8 text is converted into the encoding of the current font through
+ * tables of character codes by unicode, so that text in any language can be
+ * printed without switching encoders. The table is split in pages of 256
+ * unicodes, each filled in with one pass over the encoding when a character
+ * in its range is first converted. Fonts using the UTF-8 encoder take the
+ * text as it is once it is validated. */
+
+/* fill the page of the character codes of the unicodes high << 8 to (high << 8) + 255 */
+static void php_haru_font_codes_fill(HPDF_Encoder encoder, HPDF_UINT16 *page, HPDF_UINT high) /* {{{ */
+{
+	HPDF_UNICODE u;
+	HPDF_UINT code;
+
+	/* go downwards, the lowest code wins when several map to the same character */
+	if (encoder->type == HPDF_ENCODER_TYPE_SINGLE_BYTE) {
+		for (code = 255; code > 0; code--) {
+			if ((u = HPDF_Encoder_ToUnicode(encoder, (HPDF_UINT16)code)) != 0 && (HPDF_UINT)(u >> 8) == high) {
+				page[u & 0xff] = (HPDF_UINT16)code;
+			}
+		}
+	} else if (encoder->type == HPDF_ENCODER_TYPE_DOUBLE_BYTE) {
+		HPDF_ByteType types[256];
+		HPDF_ParseText_Rec state;
+		HPDF_BYTE b;
+
+		for (code = 0; code < 256; code++) {
+			b = (HPDF_BYTE)code;
+			HPDF_Encoder_SetParseText(encoder, &state, &b, 1);
+			types[code] = HPDF_Encoder_ByteType(encoder, &state);
+		}
+
+		for (code = 65535; code > 0; code--) {
+			HPDF_ByteType type = types[code > 0xff ? code >> 8 : code];
+
+			if (type != (code > 0xff ? HPDF_BYTE_TYPE_LEAD : HPDF_BYTE_TYPE_SINGLE)) {
+				continue;
+			}
+			if ((u = HPDF_Encoder_ToUnicode(encoder, (HPDF_UINT16)code)) != 0 && (HPDF_UINT)(u >> 8) == high) {
+				page[u & 0xff] = (HPDF_UINT16)code;
+			}
+		}
+	}
+}
+/* }}} */
+
+/* the character code of the unicode in the encoding of the font, 0 if none */
+static HPDF_UINT16 php_haru_font_code(php_haru_widths *w, HPDF_Encoder encoder, uint32_t u) /* {{{ */
+{
+	HPDF_UINT16 *page;
+
+	if (u > 0xffff) {
+		return 0;
+	}
+	if (!w->codes) {
+		w->codes = ecalloc(256, sizeof(HPDF_UINT16 *));
+	}
+	if ((page = w->codes[u >> 8]) == NULL) {
+		page = w->codes[u >> 8] = ecalloc(256, sizeof(HPDF_UINT16));
+		php_haru_font_codes_fill(encoder, page, u >> 8);
+	}
+	return page[u & 0xff];
+}
+/* }}} */
+
+/* decode the UTF-8 sequence at text, returns its length or 0 when it is invalid */
+static size_t php_haru_utf8_decode(const unsigned char *text, size_t len, uint32_t *cp) /* {{{ */
+{
+	uint32_t c = text[0];
+	size_t n, i;
+
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	} else if (c >= 0xc2 && c <= 0xdf) {
+		n = 2;
+		c &= 0x1f;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		n = 3;
+		c &= 0x0f;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		n = 4;
+		c &= 0x07;
+	} else {
+		return 0;
+	}
+
+	if (len < n) {
+		return 0;
+	}
+	for (i = 1; i < n; i++) {
+		if ((text[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+		c = (c << 6) | (text[i] & 0x3f);
+	}
+
+	/* overlong forms, surrogates and values above U+10FFFF */
+	if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10ffff)) || (c >= 0xd800 && c <= 0xdfff)) {
+		return 0;
+	}
+	*cp = c;
+	return n;
+}
+/* }}} */
+
+/* convert UTF-8 text into the encoding of the font; when offsets is given it
+ * receives the offset in the UTF-8 text for each byte of the result and one
+ * past the end. Throws and returns NULL if the text can not be converted */
+static zend_string *php_haru_utf8_to_font(php_harudoc *doc, HPDF_Font font, zend_string *text, uint32_t **offsets) /* {{{ */
+{
+	HPDF_Encoder encoder = ((HPDF_FontAttr)font->attr)->encoder;
+	const unsigned char *src = (const unsigned char *)ZSTR_VAL(text);
+	size_t len = ZSTR_LEN(text), pos = 0, n;
+	zend_bool as_is = (strcmp(encoder->name, "UTF-8") == 0);
+	php_haru_widths *w = as_is ? NULL : php_haru_widths_get(doc, font);
+	zend_string *result;
+	unsigned char *out;
+	uint32_t *offs = NULL;
+	uint32_t cp;
+
+	if (len > HPDF_LIMIT_MAX_STRING_LEN) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Text is too long");
+		return NULL;
+	}
+
+	/* a character takes at most 2 bytes in a font encoding and 4 in UTF-8 */
+	result = zend_string_alloc(as_is ? len : len * 2, 0);
+	out = (unsigned char *)ZSTR_VAL(result);
+	if (offsets) {
+		offs = safe_emalloc(ZSTR_LEN(result) + 1, sizeof(uint32_t), 0);
+	}
+
+	while (pos < len) {
+		HPDF_UINT16 code;
+
+		if ((n = php_haru_utf8_decode(src + pos, len - pos, &cp)) == 0) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid UTF-8 sequence at offset %ld", (long)pos);
+			goto failure;
+		}
+
+		if (as_is) {
+			if (cp == 0) {
+				zend_throw_exception_ex(ce_haruexception, 0, "Character U+0000 at offset %ld can not be printed", (long)pos);
+				goto failure;
+			}
+			memcpy(out, src + pos, n);
+			if (offs) {
+				size_t i;
+				for (i = 0; i < n; i++) {
+					offs[out - (unsigned char *)ZSTR_VAL(result) + i] = (uint32_t)pos;
+				}
+			}
+			out += n;
+			pos += n;
+			continue;
+		}
+
+		if ((code = php_haru_font_code(w, encoder, cp)) == 0) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Character U+%04lX at offset %ld can not be encoded with the current font", (unsigned long)cp, (long)pos);
+			goto failure;
+		}
+
+		if (code > 0xff) {
+			if (offs) {
+				offs[out - (unsigned char *)ZSTR_VAL(result)] = (uint32_t)pos;
+				offs[out - (unsigned char *)ZSTR_VAL(result) + 1] = (uint32_t)pos;
+			}
+			*out++ = (unsigned char)(code >> 8);
+			*out++ = (unsigned char)code;
+		} else {
+			if (offs) {
+				offs[out - (unsigned char *)ZSTR_VAL(result)] = (uint32_t)pos;
+			}
+			*out++ = (unsigned char)code;
+		}
+		pos += n;
+	}
+
+	ZSTR_LEN(result) = out - (unsigned char *)ZSTR_VAL(result);
+	*out = '\0';
+	if (offs) {
+		offs[ZSTR_LEN(result)] = (uint32_t)len;
+		*offsets = offs;
+	}
+	return result;
+
+failure:
+	if (offs) {
+		efree(offs);
+	}
+	zend_string_free(result);
+	return NULL;
+}
+/* }}} */
+
+/* convert UTF-8 text for the current font of the page */
+static zend_string *php_haru_page_utf8(php_harupage *page, zend_string *text, uint32_t **offsets) /* {{{ */
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(&page->doc);
+	HPDF_Font font = HPDF_Page_GetCurrentFont(page->h);
+
+	if (!font) {
+		php_haru_status_to_exception(HPDF_PAGE_FONT_NOT_FOUND);
+		return NULL;
+	}
+	return php_haru_utf8_to_font(doc, font, text, offsets);
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ font subsetting
+ * libharu writes only the glyphs flagged as used when it embeds a TrueType
+ * font, but it flags every glyph reachable through the encoding of a CID font
+ * and every glyph that was measured. The characters actually printed are
+ * recorded per font definition, and with subsetting enabled the flags of the
+ * embedded fonts are reset to those glyphs only right before saving.
+ * libharu writes the font program once, on the first save, so it is written
+ * again on later saves whenever the flagged glyphs have changed. */
+
+typedef struct {
+	unsigned char used[65536 / 8];	/* the unicodes printed */
+	unsigned char *built;			/* the glyph flags the font program was last written with */
+} php_haru_subset;
+
+static void php_haru_subset_dtor(zval *zv) /* {{{ */
+{
+	php_haru_subset *subset = (php_haru_subset *)Z_PTR_P(zv);
+
+	if (subset->built) {
+		efree(subset->built);
+	}
+	efree(subset);
+}
+/* }}} */
+
+static php_haru_subset *php_haru_subset_get(php_harudoc *doc, HPDF_FontDef fontdef) /* {{{ */
+{
+	zend_ulong key = (zend_ulong)(zend_uintptr_t)fontdef;
+	php_haru_subset *subset;
+
+	if (!doc->subset) {
+		ALLOC_HASHTABLE(doc->subset);
+		zend_hash_init(doc->subset, 8, NULL, php_haru_subset_dtor, 0);
+	}
+
+	if ((subset = zend_hash_index_find_ptr(doc->subset, key)) == NULL) {
+		subset = ecalloc(1, sizeof(php_haru_subset));
+		zend_hash_index_update_ptr(doc->subset, key, subset);
+	}
+	return subset;
+}
+/* }}} */
+
+static void php_haru_subset_record(php_harudoc *doc, HPDF_Font font, const HPDF_BYTE *text, size_t len) /* {{{ */
+{
+	HPDF_FontAttr attr = (HPDF_FontAttr)font->attr;
+	HPDF_Encoder encoder = attr->encoder;
+	unsigned char *used;
+	HPDF_UNICODE u;
+	size_t i;
+
+	if (attr->fontdef->type != HPDF_FONTDEF_TYPE_TRUETYPE || !encoder) {
+		return;
+	}
+
+	used = php_haru_subset_get(doc, attr->fontdef)->used;
+
+#define PHP_HARU_SUBSET_MARK(u) used[(u) >> 3] |= (unsigned char)(1 << ((u) & 7))
+
+	if (strcmp(encoder->name, "UTF-8") == 0) {
+		uint32_t cp;
+		size_t n;
+
+		for (i = 0; i < len; i += n) {
+			if ((n = php_haru_utf8_decode(text + i, len - i, &cp)) == 0) {
+				n = 1;
+			} else if (cp <= 0xffff) {
+				PHP_HARU_SUBSET_MARK(cp);
+			}
+		}
+	} else if (encoder->type == HPDF_ENCODER_TYPE_DOUBLE_BYTE) {
+		HPDF_ParseText_Rec state;
+
+		HPDF_Encoder_SetParseText(encoder, &state, text, (HPDF_UINT)len);
+		for (i = 0; i < len; i++) {
+			HPDF_ByteType btype = HPDF_Encoder_ByteType(encoder, &state);
+			HPDF_UINT16 code = text[i];
+
+			if (btype == HPDF_BYTE_TYPE_TRIAL) {
+				continue;
+			}
+			if (btype == HPDF_BYTE_TYPE_LEAD) {
+				code = (HPDF_UINT16)((code << 8) + (i + 1 < len ? text[i + 1] : 0));
+			}
+			u = HPDF_Encoder_ToUnicode(encoder, code);
+			PHP_HARU_SUBSET_MARK(u);
+		}
+	} else {
+		for (i = 0; i < len; i++) {
+			u = HPDF_Encoder_ToUnicode(encoder, text[i]);
+			PHP_HARU_SUBSET_MARK(u);
+		}
+	}
+
+#undef PHP_HARU_SUBSET_MARK
+}
+/* }}} */
+
+/* record the text printed on the page with its current font */
+static void php_haru_subset_record_page(php_harupage *page, const char *text, size_t len) /* {{{ */
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(&page->doc);
+	HPDF_Font font;
+
+	if ((font = HPDF_Page_GetCurrentFont(page->h)) == NULL) {
+		return;
+	}
+	php_haru_subset_record(doc, font, (const HPDF_BYTE *)text, len);
+}
+/* }}} */
+
+/* write the program of an embedded font again with the glyphs flagged now */
+static HPDF_STATUS php_haru_subset_rebuild(HPDF_FontDef fontdef) /* {{{ */
+{
+	HPDF_TTFontDefAttr attr = (HPDF_TTFontDefAttr)fontdef->attr;
+	HPDF_Dict data = (HPDF_Dict)HPDF_Dict_GetItem(fontdef->descriptor, "FontFile2", HPDF_OCLASS_DICT);
+	HPDF_STATUS status;
+
+	if (!data || !data->stream) {
+		return HPDF_OK;
+	}
+
+	HPDF_MemStream_FreeData(data->stream);
+	status = HPDF_TTFontDef_SaveFontData(fontdef, data->stream);
+	if (status == HPDF_OK) {
+		status = HPDF_Dict_AddNumber(data, "Length1", attr->length1);
+	}
+	return status;
+}
+/* }}} */
+
+/* flag only the recorded glyphs in the embedded TrueType fonts if subsetting is
+ * enabled, and bring the font programs written by a previous save up to date */
+static HPDF_STATUS php_haru_subset_apply(php_harudoc *doc) /* {{{ */
+{
+	HPDF_List list = doc->h->fontdef_list;
+	HPDF_STATUS status;
+	HPDF_UINT i;
+
+	for (i = 0; i < list->count; i++) {
+		HPDF_FontDef fontdef = (HPDF_FontDef)HPDF_List_ItemAt(list, i);
+		HPDF_TTFontDefAttr attr;
+		php_haru_subset *subset;
+		HPDF_UINT u;
+
+		if (fontdef->type != HPDF_FONTDEF_TYPE_TRUETYPE) {
+			continue;
+		}
+		attr = (HPDF_TTFontDefAttr)fontdef->attr;
+		if (!attr->embedding || !attr->glyph_tbl.flgs) {
+			continue;
+		}
+		subset = php_haru_subset_get(doc, fontdef);
+
+		if (doc->subset_fonts) {
+			memset(attr->glyph_tbl.flgs, 0, attr->num_glyphs);
+			/* .notdef is always there */
+			attr->glyph_tbl.flgs[0] = 1;
+
+			for (u = 1; u < 65536; u++) {
+				if (subset->used[u >> 3] & (1 << (u & 7))) {
+					/* flags the glyph and the components of composite glyphs */
+					HPDF_TTFontDef_GetCharWidth(fontdef, (HPDF_UNICODE)u);
+				}
+			}
+		}
+
+		if (fontdef->descriptor && (!subset->built || memcmp(subset->built, attr->glyph_tbl.flgs, attr->num_glyphs) != 0)) {
+			status = php_haru_subset_rebuild(fontdef);
+			if (status != HPDF_OK) {
+				return status;
+			}
+		}
+
+		/* without a descriptor libharu writes the program in this save, if the font is used */
+		if (!subset->built) {
+			subset->built = emalloc(attr->num_glyphs);
+		}
+		memcpy(subset->built, attr->glyph_tbl.flgs, attr->num_glyphs);
+	}
+	return HPDF_OK;
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ stream compression
+ * libharu always deflates with the default zlib level. When a level is set
+ * for a class of streams, their data is deflated here right before saving
+ * with the configured level and strategy and handed to libharu as an already
+ * encoded stream; the original streams are put back once the document is
+ * written. With haru.deflate_threads > 1 all the streams are deflated this
+ * way, concurrently by a pool of threads started once per save. */
+
+static HPDF_STATUS php_haru_deflated_write(HPDF_Dict dict, HPDF_Stream stream) /* {{{ */
+{
+	/* the dict is written with HPDF_STREAM_FILTER_NONE, declare the filter of the data */
+	return HPDF_Stream_WriteStr(stream, "/Filter /FlateDecode\012");
+}
+/* }}} */
+
+static int php_haru_stream_class(HPDF_Dict dict) /* {{{ */
+{
+	HPDF_Name name;
+
+	if (dict->header.obj_class == (HPDF_OCLASS_DICT | HPDF_OSUBCLASS_XOBJECT)) {
+		name = HPDF_Dict_GetItem(dict, "Subtype", HPDF_OCLASS_NAME);
+		if (name && strcmp(HPDF_Name_GetValue(name), "Image") == 0) {
+			return PHP_HARU_STREAM_IMAGE;
+		}
+	}
+
+	name = HPDF_Dict_GetItem(dict, "Type", HPDF_OCLASS_NAME);
+	if (name && (strcmp(HPDF_Name_GetValue(name), "Metadata") == 0 || strcmp(HPDF_Name_GetValue(name), "EmbeddedFile") == 0)) {
+		return PHP_HARU_STREAM_METADATA;
+	}
+
+	return PHP_HARU_STREAM_TEXT;
+}
+/* }}} */
+
+typedef struct {
+	HPDF_Dict dict;
+	HPDF_Stream stream;
+	HPDF_UINT filter;
+	int level;
+	int strategy;
+	/* malloc()ed, the deflate jobs may run in other threads */
+	unsigned char *in;
+	size_t in_len;
+	unsigned char *out;
+	size_t out_len;
+	int failed;
+} php_haru_deflated;
+
+typedef struct {
+	php_haru_deflated *items;
+	size_t count;
+#ifdef HAVE_HARU_THREADS
+	struct _php_haru_deflate_pool *pool;	/* the worker threads, started on the first batch */
+#endif
+} php_haru_save_state;
+
+/* runs without touching the engine or libharu, possibly in a worker thread */
+static void php_haru_deflate_job(php_haru_deflated *job) /* {{{ */
+{
+	z_stream strm;
+	size_t bound;
+	int ret;
+
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, job->level, Z_DEFLATED, MAX_WBITS, 8, job->strategy) != Z_OK) {
+		job->failed = 1;
+		return;
+	}
+
+	bound = deflateBound(&strm, (uLong)job->in_len);
+	job->out = malloc(bound);
+	if (!job->out) {
+		deflateEnd(&strm);
+		job->failed = 1;
+		return;
+	}
+
+	strm.next_in = (Bytef *)job->in;
+	strm.avail_in = (uInt)job->in_len;
+	strm.next_out = job->out;
+	strm.avail_out = (uInt)bound;
+
+	ret = deflate(&strm, Z_FINISH);
+	job->out_len = strm.total_out;
+	deflateEnd(&strm);
+
+	job->failed = (ret != Z_STREAM_END);
+}
+/* }}} */
+
+#ifdef HAVE_HARU_THREADS
+/* the workers live as long as a save and take the jobs of every batch */
+typedef struct _php_haru_deflate_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* jobs were queued or the pool is stopping */
+	pthread_cond_t done;	/* the last job of the batch was finished */
+	php_haru_deflated *jobs;
+	size_t count;
+	size_t next;
+	size_t finished;
+	int stopping;
+	pthread_t *tids;
+	int started;
+} php_haru_deflate_pool;
+
+static void *php_haru_deflate_worker(void *arg) /* {{{ */
+{
+	php_haru_deflate_pool *pool = (php_haru_deflate_pool *)arg;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		php_haru_deflated *job;
+
+		while (!pool->stopping && pool->next >= pool->count) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (pool->next >= pool->count) {
+			break;
+		}
+
+		job = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		php_haru_deflate_job(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (++pool->finished == pool->count) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+/* }}} */
+
+/* the current thread is one of the workers, so threads - 1 are started */
+static php_haru_deflate_pool *php_haru_deflate_pool_start(zend_long threads) /* {{{ */
+{
+	php_haru_deflate_pool *pool = ecalloc(1, sizeof(php_haru_deflate_pool));
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	pool->tids = safe_emalloc(threads - 1, sizeof(pthread_t), 0);
+	while (pool->started < threads - 1 && pthread_create(&pool->tids[pool->started], NULL, php_haru_deflate_worker, pool) == 0) {
+		pool->started++;
+	}
+	return pool;
+}
+/* }}} */
+
+static void php_haru_deflate_pool_stop(php_haru_deflate_pool *pool) /* {{{ */
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->started; i++) {
+		pthread_join(pool->tids[i], NULL);
+	}
+	efree(pool->tids);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	efree(pool);
+}
+/* }}} */
+
+/* queue the batch and work on it until all of its jobs are finished */
+static void php_haru_deflate_pool_run(php_haru_deflate_pool *pool, php_haru_deflated *jobs, size_t count) /* {{{ */
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->jobs = jobs;
+	pool->count = count;
+	pool->next = 0;
+	pool->finished = 0;
+	pthread_cond_broadcast(&pool->work);
+
+	while (pool->next < pool->count) {
+		php_haru_deflated *job = &pool->jobs[pool->next++];
+
+		pthread_mutex_unlock(&pool->lock);
+		php_haru_deflate_job(job);
+		pthread_mutex_lock(&pool->lock);
+		pool->finished++;
+	}
+	while (pool->finished < pool->count) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+
+	/* nothing is queued until the next batch */
+	pool->jobs = NULL;
+	pool->count = pool->next = pool->finished = 0;
+	pthread_mutex_unlock(&pool->lock);
+}
+/* }}} */
+#endif
+
+/* deflate the jobs of the batch, by the worker threads if enabled */
+static void php_haru_deflate_jobs(php_haru_save_state *state, size_t start) /* {{{ */
+{
+	size_t i;
+#ifdef HAVE_HARU_THREADS
+	zend_long threads = HARU_G(deflate_threads);
+
+	if (!state->pool && threads > 1 && state->count - start > 1) {
+		state->pool = php_haru_deflate_pool_start(threads);
+	}
+	if (state->pool) {
+		php_haru_deflate_pool_run(state->pool, state->items + start, state->count - start);
+		return;
+	}
+#endif
+
+	for (i = start; i < state->count; i++) {
+		php_haru_deflate_job(&state->items[i]);
+	}
+}
+/* }}} */
+
+/* read the data of a stream into the job */
+static HPDF_STATUS php_haru_deflate_read(php_harudoc *doc, php_haru_deflated *job) /* {{{ */
+{
+	HPDF_UINT size = HPDF_Stream_Size(job->stream);
+	HPDF_STATUS status;
+
+	job->in = malloc(size ? size : 1);
+	if (!job->in) {
+		return HPDF_SetError(&doc->h->error, HPDF_FAILD_TO_ALLOC_MEM, 0);
+	}
+
+	status = HPDF_Stream_Seek(job->stream, 0, HPDF_SEEK_SET);
+	if (status == HPDF_OK) {
+		status = HPDF_Stream_Read(job->stream, job->in, &size);
+		if (status == HPDF_STREAM_EOF) {
+			HPDF_Error_Reset(&doc->h->error);
+			status = HPDF_OK;
+		}
+	}
+	job->in_len = size;
+	return status;
+}
+/* }}} */
+
+/* replace the data of the stream dict by its deflated form */
+static HPDF_STATUS php_haru_deflate_install(php_harudoc *doc, php_haru_deflated *job) /* {{{ */
+{
+	HPDF_Stream deflated;
+	HPDF_STATUS status;
+
+	if (job->failed) {
+		return HPDF_SetError(&doc->h->error, HPDF_ZLIB_ERROR, 0);
+	}
+
+	deflated = HPDF_MemStream_New(doc->h->mmgr, HPDF_STREAM_BUF_SIZ);
+	if (!deflated) {
+		return HPDF_CheckError(&doc->h->error);
+	}
+
+	status = HPDF_Stream_Write(deflated, job->out, (HPDF_UINT)job->out_len);
+	if (status != HPDF_OK) {
+		HPDF_Stream_Free(deflated);
+		return status;
+	}
+
+	job->dict->stream = deflated;
+	job->dict->filter = HPDF_STREAM_FILTER_NONE;
+	job->dict->write_fn = php_haru_deflated_write;
+	return HPDF_OK;
+}
+/* }}} */
+
+/* deflate and install the jobs from the index start on, releasing their buffers */
+static HPDF_STATUS php_haru_deflate_batch(php_harudoc *doc, php_haru_save_state *state, size_t start) /* {{{ */
+{
+	HPDF_STATUS status = HPDF_OK;
+	size_t i;
+
+	php_haru_deflate_jobs(state, start);
+
+	for (i = start; i < state->count; i++) {
+		php_haru_deflated *job = &state->items[i];
+
+		if (status == HPDF_OK) {
+			status = php_haru_deflate_install(doc, job);
+		}
+		free(job->in);
+		free(job->out);
+		job->in = job->out = NULL;
+	}
+	return status;
+}
+/* }}} */
+
+/* a template page lives in a cross-reference table of its own which is never
+ * written, only its content stream is part of the document */
+typedef struct {
+	HPDF_Xref xref;
+	HPDF_Page page;
+} php_haru_template;
+
+static void php_haru_template_dtor(zval *zv) /* {{{ */
+{
+	php_haru_template *tpl = (php_haru_template *)Z_PTR_P(zv);
+
+	HPDF_Xref_Free(tpl->xref);
+	efree(tpl);
+}
+/* }}} */
+
+/* close the pending text and path objects and graphic states of the pages like
+ * libharu does when it writes a page, so the content streams are complete */
+static HPDF_STATUS php_haru_finish_page(HPDF_Page page) /* {{{ */
+{
+	HPDF_PageAttr attr = (HPDF_PageAttr)page->attr;
+	HPDF_STATUS status = HPDF_OK;
+
+	if (attr->gmode == PHP_HARU_GMODE_FLUSHED) {
+		return HPDF_OK;
+	}
+	/* a clipping path is pending until the path is painted or ended too */
+	if (attr->gmode == HPDF_GMODE_PATH_OBJECT || attr->gmode == HPDF_GMODE_CLIPPING_PATH) {
+		status = HPDF_Page_EndPath(page);
+	} else if (attr->gmode == HPDF_GMODE_TEXT_OBJECT) {
+		status = HPDF_Page_EndText(page);
+	}
+	while (status == HPDF_OK && attr->gstate->prev) {
+		status = HPDF_Page_GRestore(page);
+	}
+	return status;
+}
+/* }}} */
+
+/* finish the page and replace its content stream by the deflated data for good;
+ * the page can not be drawn on afterwards */
+static HPDF_STATUS php_haru_flush_page(php_harudoc *doc, HPDF_Page page) /* {{{ */
+{
+	HPDF_PageAttr attr = (HPDF_PageAttr)page->attr;
+	php_haru_deflated job;
+	HPDF_STATUS status;
+	int level = (int)doc->deflate_level[PHP_HARU_STREAM_TEXT];
+
+	if (attr->gmode == PHP_HARU_GMODE_FLUSHED) {
+		return HPDF_OK;
+	}
+
+	status = php_haru_finish_page(page);
+	if (status != HPDF_OK) {
+		return status;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.dict = attr->contents;
+	job.stream = attr->contents->stream;
+	job.filter = attr->contents->filter;
+	job.level = level >= 0 ? level : Z_DEFAULT_COMPRESSION;
+	job.strategy = (int)doc->deflate_strategy[PHP_HARU_STREAM_TEXT];
+
+	status = php_haru_deflate_read(doc, &job);
+	if (status == HPDF_OK) {
+		php_haru_deflate_job(&job);
+		status = php_haru_deflate_install(doc, &job);
+	}
+	free(job.in);
+	free(job.out);
+
+	if (status != HPDF_OK) {
+		return status;
+	}
+
+	/* no HPDF_Page_* drawing function accepts this graphics mode */
+	HPDF_Stream_Free(job.stream);
+	attr->stream = attr->contents->stream;
+	attr->gmode = PHP_HARU_GMODE_FLUSHED;
+	return HPDF_OK;
+}
+/* }}} */
+
+/* deflate the streams with custom compression settings, or all of them with
+ * parallel deflate or if keep is given, before saving; the work is done in
+ * batches to bound the memory held by the buffers. The dictionaries in keep
+ * are left alone */
+static HPDF_STATUS php_haru_save_prepare(php_harudoc *doc, php_haru_save_state *state, HashTable *keep) /* {{{ */
+{
+	HPDF_Xref xref;
+	HPDF_UINT i;
+	size_t size = 0, batch_start = 0, batch_size;
+	int c, custom = 0;
+	zend_long threads = 1;
+	HPDF_STATUS status = HPDF_OK;
+
+	state->items = NULL;
+	state->count = 0;
+#ifdef HAVE_HARU_THREADS
+	state->pool = NULL;
+#endif
+
+	if (doc->templates) {
+		php_haru_template *tpl;
+
+		/* libharu does not know about the template pages */
+		ZEND_HASH_FOREACH_PTR(doc->templates, tpl) {
+			status = php_haru_finish_page(tpl->page);
+			if (status != HPDF_OK) {
+				return status;
+			}
+		} ZEND_HASH_FOREACH_END();
+	}
+
+#ifdef HAVE_HARU_THREADS
+	threads = HARU_G(deflate_threads);
+#endif
+	for (c = 0; c < PHP_HARU_STREAM_CLASSES; c++) {
+		if (doc->deflate_level[c] >= 0) {
+			custom = 1;
+		}
+	}
+	if (!custom && threads <= 1 && !keep) {
+		return HPDF_OK;
+	}
+	batch_size = threads > 1 ? (size_t)threads * 8 : 1;
+
+	for (xref = doc->h->xref; xref; xref = xref->prev) {
+		for (i = 0; i < xref->entries->count; i++) {
+			HPDF_XrefEntry entry = (HPDF_XrefEntry)HPDF_List_ItemAt(xref->entries, i);
+			HPDF_Obj_Header *header;
+			php_haru_deflated *job;
+			HPDF_Dict dict;
+
+			if (!entry || !entry->obj) {
+				continue;
+			}
+
+			header = (HPDF_Obj_Header *)entry->obj;
+			if ((header->obj_class & HPDF_OCLASS_ANY) != HPDF_OCLASS_DICT) {
+				continue;
+			}
+			dict = (HPDF_Dict)entry->obj;
+
+			if (header->obj_class == (HPDF_OCLASS_DICT | HPDF_OSUBCLASS_PAGE)) {
+				status = php_haru_finish_page((HPDF_Page)dict);
+				if (status != HPDF_OK) {
+					goto done;
+				}
+				continue;
+			}
+
+			/* leave alone the streams libharu fills or writes by itself (deferred images,
+			 * embedded font programs) and the ones not compressed at all */
+			if (!dict->stream || dict->filter != HPDF_STREAM_FILTER_FLATE_DECODE ||
+					dict->write_fn || dict->before_write_fn ||
+					HPDF_Dict_GetItem(dict, "Length1", HPDF_OCLASS_NUMBER) ||
+					HPDF_Stream_Size(dict->stream) == 0) {
+				continue;
+			}
+			if (keep && zend_hash_index_exists(keep, (zend_ulong)(zend_uintptr_t)dict)) {
+				continue;
+			}
+
+			c = php_haru_stream_class(dict);
+			if (doc->deflate_level[c] < 0 && threads <= 1 && !keep) {
+				continue;
+			}
+
+			if (state->count == size) {
+				size = size ? size * 2 : 64;
+				state->items = safe_erealloc(state->items, size, sizeof(php_haru_deflated), 0);
+			}
+			job = &state->items[state->count++];
+			memset(job, 0, sizeof(*job));
+			job->dict = dict;
+			job->stream = dict->stream;
+			job->filter = dict->filter;
+			job->level = doc->deflate_level[c] >= 0 ? (int)doc->deflate_level[c] : Z_DEFAULT_COMPRESSION;
+			job->strategy = (int)doc->deflate_strategy[c];
+
+			status = php_haru_deflate_read(doc, job);
+			if (status == HPDF_OK && state->count - batch_start == batch_size) {
+				status = php_haru_deflate_batch(doc, state, batch_start);
+				batch_start = state->count;
+			}
+			if (status != HPDF_OK) {
+				/* the buffers of the pending jobs are released by php_haru_save_finish() */
+				goto done;
+			}
+		}
+	}
+
+	if (batch_start < state->count) {
+		status = php_haru_deflate_batch(doc, state, batch_start);
+	}
+
+done:
+#ifdef HAVE_HARU_THREADS
+	if (state->pool) {
+		php_haru_deflate_pool_stop(state->pool);
+		state->pool = NULL;
+	}
+#endif
+	return status;
+}
+/* }}} */
+
+/* put the original streams back */
+static void php_haru_save_finish(php_harudoc *doc, php_haru_save_state *state) /* {{{ */
+{
+	size_t i;
+
+	for (i = 0; i < state->count; i++) {
+		php_haru_deflated *job = &state->items[i];
+		HPDF_Dict dict = job->dict;
+
+		free(job->in);
+		free(job->out);
+
+		if (dict->stream != job->stream) {
+			HPDF_Stream_Free(dict->stream);
+			dict->stream = job->stream;
+			dict->filter = job->filter;
+			dict->write_fn = NULL;
+		}
+	}
+
+	if (state->items) {
+		efree(state->items);
+	}
+	state->items = NULL;
+	state->count = 0;
+}
+/* }}} */
+
+/* save the document into the file or into pdf->stream if filename is NULL */
+static HPDF_STATUS php_haru_save(php_harudoc *doc, const char *filename) /* {{{ */
+{
+	php_haru_save_state state;
+	HPDF_STATUS status;
+
+	status = php_haru_subset_apply(doc);
+	if (status != HPDF_OK) {
+		return status;
+	}
+
+	status = php_haru_save_prepare(doc, &state, NULL);
+	if (status == HPDF_OK) {
+		if (filename) {
+			status = HPDF_SaveToFile(doc->h, filename);
+		} else {
+			status = HPDF_SaveToStream(doc->h);
+		}
+	}
+	php_haru_save_finish(doc, &state);
+
+	return status;
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ document writers
+ * libharu serializes the document through an HPDF_Stream, calling its write
+ * function for every token. The writer collects these small chunks into
+ * a buffer and hands them over to the sink function in large blocks. */
+
+typedef size_t (*php_haru_write_func)(void *ctx, const char *data, size_t len);
+
+typedef struct {
+	php_haru_write_func write;
+	void *ctx;
+	char *buf;
+	size_t buf_size;
+	size_t buf_used;
+} php_haru_writer;
+
+static int php_haru_writer_flush(php_haru_writer *writer) /* {{{ */
+{
+	size_t len = writer->buf_used;
+
+	writer->buf_used = 0;
+
+	if (len && writer->write(writer->ctx, writer->buf, len) != len) {
+		return FAILURE;
+	}
+	return SUCCESS;
+}
+/* }}} */
+
+static HPDF_STATUS php_haru_writer_stream_write(HPDF_Stream stream, const HPDF_BYTE *ptr, HPDF_UINT size) /* {{{ */
+{
+	php_haru_writer *writer = (php_haru_writer *)stream->attr;
+
+	if (writer->buf_used + size > writer->buf_size) {
+		if (php_haru_writer_flush(writer) == FAILURE) {
+			return HPDF_SetError(stream->error, HPDF_FILE_IO_ERROR, 0);
+		}
+
+		if (size >= writer->buf_size) {
+			/* doesn't fit into the buffer, pass it through */
+			if (writer->write(writer->ctx, (const char *)ptr, size) != size) {
+				return HPDF_SetError(stream->error, HPDF_FILE_IO_ERROR, 0);
+			}
+			return HPDF_OK;
+		}
+	}
+
+	memcpy(writer->buf + writer->buf_used, ptr, size);
+	writer->buf_used += size;
+	return HPDF_OK;
+}
+/* }}} */
+
+static HPDF_STATUS php_haru_save_to_writer(php_harudoc *doc, php_haru_writer *writer) /* {{{ */
+{
+	HPDF_Stream stream, mem_stream;
+	HPDF_STATUS status;
+
+	stream = HPDF_CallbackWriter_New(doc->h->mmgr, php_haru_writer_stream_write, writer);
+	if (!stream) {
+		return HPDF_CheckError(&doc->h->error);
+	}
+
+	writer->buf = writer->buf_size ? emalloc(writer->buf_size) : NULL;
+	writer->buf_used = 0;
+
+	/* HPDF_SaveToStream() serializes the document into pdf->stream,
+	 * so substitute the callback stream for the memory stream while saving */
+	mem_stream = doc->h->stream;
+	doc->h->stream = stream;
+
+	status = php_haru_save(doc, NULL);
+
+	doc->h->stream = mem_stream;
+
+	if (status == HPDF_OK) {
+		doc->output_size = stream->size;
+	}
+	HPDF_Stream_Free(stream);
+
+	if (status == HPDF_OK && php_haru_writer_flush(writer) == FAILURE) {
+		status = HPDF_FILE_IO_ERROR;
+	}
+
+	if (writer->buf) {
+		efree(writer->buf);
+		writer->buf = NULL;
+	}
+	return status;
+}
+/* }}} */
+
+static size_t php_haru_output_write(void *ctx, const char *data, size_t len) /* {{{ */
+{
+	return PHPWRITE(data, len);
+}
+/* }}} */
+
+static size_t php_haru_php_stream_write(void *ctx, const char *data, size_t len) /* {{{ */
+{
+	return (size_t)php_stream_write((php_stream *)ctx, data, len);
+}
+/* }}} */
+
+typedef struct {
+	zend_string *str;
+	size_t len;
+} php_haru_string_sink;
+
+static size_t php_haru_string_write(void *ctx, const char *data, size_t len) /* {{{ */
+{
+	php_haru_string_sink *sink = (php_haru_string_sink *)ctx;
+
+	if (!sink->str) {
+		sink->str = zend_string_alloc(MAX(len, PHP_HARU_BUF_SIZE), 0);
+	} else if (sink->len + len > ZSTR_LEN(sink->str)) {
+		/* grow geometrically, so the data is moved O(log n) times at most */
+		size_t size = ZSTR_LEN(sink->str) * 2;
+
+		while (size < sink->len + len) {
+			size *= 2;
+		}
+		sink->str = zend_string_extend(sink->str, size, 0);
+	}
+
+	memcpy(ZSTR_VAL(sink->str) + sink->len, data, len);
+	sink->len += len;
+	return len;
+}
+/* }}} */
+
+static size_t php_haru_callback_write(void *ctx, const char *data, size_t len) /* {{{ */
+{
+	zval args[1], retval;
+	int result;
+
+	ZVAL_STRINGL(&args[0], data, len);
+	result = call_user_function(EG(function_table), NULL, (zval *)ctx, &retval, 1, args);
+	zval_ptr_dtor(&args[0]);
+
+	if (result == FAILURE || EG(exception)) {
+		return 0;
+	}
+
+	/* returning false stops the output */
+	result = Z_TYPE(retval) == IS_FALSE;
+	zval_ptr_dtor(&retval);
+
+	return result ? 0 : len;
+}
+/* }}} */
+
+/* }}} */
+
+
+/* {{{ zip archives
+ * HaruZip writes the documents straight into the entries of a ZIP archive as
+ * libharu serializes them: the chunks are deflated on the fly and the sizes
+ * and CRC of an entry follow its data in a data descriptor, so the archive is
+ * written in a single pass and the stream does not need to be seekable. The
+ * central directory is kept in memory until HaruZip::close(). ZIP64 is not
+ * supported. */
+
+#define PHP_HARU_ZIP_FLAGS 0x0808	/* data descriptor, UTF-8 names */
+#define PHP_HARU_ZIP_VERSION 20
+#define PHP_HARU_ZIP_MAX 0xffffffffU
+
+typedef struct {
+	php_stream *stream;
+	z_stream zs;
+	uLong crc;
+	uint64_t size;
+	uint64_t written;
+	unsigned char *out;
+} php_haru_zip_entry;
+
+static void php_haru_zip_put16(char *p, uint16_t v) /* {{{ */
+{
+	p[0] = (char)(v & 0xff);
+	p[1] = (char)(v >> 8);
+}
+/* }}} */
+
+static void php_haru_zip_put32(char *p, uint32_t v) /* {{{ */
+{
+	p[0] = (char)(v & 0xff);
+	p[1] = (char)((v >> 8) & 0xff);
+	p[2] = (char)((v >> 16) & 0xff);
+	p[3] = (char)(v >> 24);
+}
+/* }}} */
+
+static void php_haru_zip_dostime(uint16_t *dos_time, uint16_t *dos_date) /* {{{ */
+{
+	time_t now = time(NULL);
+	struct tm tmbuf, *tm = php_localtime_r(&now, &tmbuf);
+
+	if (!tm || tm->tm_year < 80) {
+		*dos_time = 0;
+		*dos_date = (1 << 5) | 1;
+		return;
+	}
+	*dos_time = (uint16_t)((tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec >> 1));
+	*dos_date = (uint16_t)(((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday);
+}
+/* }}} */
+
+/* deflate the data into the archive, flushing everything with Z_FINISH */
+static int php_haru_zip_deflate(php_haru_zip_entry *entry, const char *data, size_t len, int flush) /* {{{ */
+{
+	int ret;
+
+	entry->zs.next_in = (Bytef *)data;
+	entry->zs.avail_in = (uInt)len;
+
+	do {
+		size_t n;
+
+		entry->zs.next_out = entry->out;
+		entry->zs.avail_out = PHP_HARU_BUF_SIZE;
+
+		ret = deflate(&entry->zs, flush);
+		if (ret == Z_STREAM_ERROR) {
+			return FAILURE;
+		}
+
+		n = PHP_HARU_BUF_SIZE - entry->zs.avail_out;
+		if (n && php_stream_write(entry->stream, (const char *)entry->out, n) != n) {
+			return FAILURE;
+		}
+		entry->written += n;
+	} while (flush == Z_FINISH ? ret != Z_STREAM_END : entry->zs.avail_out == 0);
+
+	return SUCCESS;
+}
+/* }}} */
+
+static size_t php_haru_zip_write(void *ctx, const char *data, size_t len) /* {{{ */
+{
+	php_haru_zip_entry *entry = (php_haru_zip_entry *)ctx;
+
+	entry->crc = crc32(entry->crc, (const Bytef *)data, (uInt)len);
+	entry->size += len;
+
+	if (php_haru_zip_deflate(entry, data, len, Z_NO_FLUSH) == FAILURE) {
+		return 0;
+	}
+	return len;
+}
+/* }}} */
+
+/* }}} */
+
+
+/* {{{ mail merge
+ * Placeholders are named text fields on the pages of a template document.
+ * HaruDoc::merge() saves the document once per record: the content streams of
+ * the pages with placeholders are rebuilt from their static part followed by
+ * the texts of the record, everything else (fonts, images, the other pages)
+ * is shared by all the documents, and the streams not depending on the
+ * records are deflated once for the whole batch. */
+
+typedef struct {
+	HPDF_Page page;
+	zend_string *name;
+	HPDF_Font font;
+	double size;
+	double char_space;
+	double word_space;
+	double x;
+	double y;
+	double width;
+	zend_long align;
+	HPDF_RGBColor color;
+} php_haru_placeholder;
+
+typedef struct {
+	HPDF_Page page;
+	HPDF_Stream stream;	/* the original content stream */
+	HPDF_Stream merged;	/* the content stream of the current record */
+	unsigned char *data;	/* the static content */
+	size_t len;
+} php_haru_merge_page;
+
+typedef struct {
+	php_harudoc *doc;
+	php_haru_merge_page *pages;
+	int npages;
+	zval *output;
+	zend_long count;
+} php_haru_merge;
+
+static void php_haru_placeholder_dtor(zval *zv) /* {{{ */
+{
+	php_haru_placeholder *p = (php_haru_placeholder *)Z_PTR_P(zv);
+
+	zend_string_release(p->name);
+	efree(p);
+}
+/* }}} */
+
+/* rebuild the content streams of the pages with the texts of the record */
+static HPDF_STATUS php_haru_merge_fill(php_haru_merge *merge, HashTable *record) /* {{{ */
+{
+	php_harudoc *doc = merge->doc;
+	HPDF_STATUS status = HPDF_OK;
+	int i;
+
+	for (i = 0; i < merge->npages && status == HPDF_OK; i++) {
+		php_haru_merge_page *mp = &merge->pages[i];
+		php_haru_placeholder *p;
+
+		HPDF_MemStream_FreeData(mp->merged);
+		if (mp->len) {
+			status = HPDF_Stream_Write(mp->merged, (const HPDF_BYTE *)mp->data, (HPDF_UINT)mp->len);
+		}
+		if (status == HPDF_OK) {
+			status = HPDF_Page_GSave(mp->page);
+		}
+		if (status == HPDF_OK) {
+			status = HPDF_Page_BeginText(mp->page);
+		}
+
+		ZEND_HASH_FOREACH_PTR(doc->placeholders, p) {
+			zend_string *text;
+			zval *value;
+			double x = p->x;
+			size_t len;
+
+			if (status != HPDF_OK) {
+				break;
+			}
+			if (p->page != mp->page || (value = zend_symtable_find(record, p->name)) == NULL) {
+				continue;
+			}
+			if (Z_TYPE_P(value) == IS_INDIRECT) {
+				value = Z_INDIRECT_P(value);
+			}
+			ZVAL_DEREF(value);
+			if (Z_TYPE_P(value) == IS_NULL) {
+				continue;
+			}
+
+			text = zval_get_string(value);
+			/* the text is printed up to the first NUL, so it is measured the same way */
+			len = strlen(ZSTR_VAL(text));
+			if (len > 0) {
+				if (p->align != HPDF_TALIGN_LEFT) {
+					HPDF_TextWidth tw = php_haru_text_width(doc, p->font, (const HPDF_BYTE *)ZSTR_VAL(text), (HPDF_UINT)len);
+					double width = tw.width * p->size / 1000 + p->word_space * tw.numspace + p->char_space * tw.numchars;
+
+					x += p->align == HPDF_TALIGN_RIGHT ? p->width - width : (p->width - width) / 2;
+				}
+				php_haru_subset_record(doc, p->font, (const HPDF_BYTE *)ZSTR_VAL(text), len);
+
+				status = HPDF_Page_SetFontAndSize(mp->page, p->font, (HPDF_REAL)p->size);
+				if (status == HPDF_OK) {
+					status = HPDF_Page_SetCharSpace(mp->page, (HPDF_REAL)p->char_space);
+				}
+				if (status == HPDF_OK) {
+					status = HPDF_Page_SetWordSpace(mp->page, (HPDF_REAL)p->word_space);
+				}
+				if (status == HPDF_OK) {
+					status = HPDF_Page_SetRGBFill(mp->page, p->color.r, p->color.g, p->color.b);
+				}
+				if (status == HPDF_OK) {
+					status = HPDF_Page_TextOut(mp->page, (HPDF_REAL)x, (HPDF_REAL)p->y, ZSTR_VAL(text));
+				}
+			}
+			zend_string_release(text);
+		} ZEND_HASH_FOREACH_END();
+
+		if (status == HPDF_OK) {
+			status = HPDF_Page_EndText(mp->page);
+		}
+		if (status == HPDF_OK) {
+			status = HPDF_Page_GRestore(mp->page);
+		}
+	}
+	return status;
+}
+/* }}} */
+
+/* produce the document of one record and hand it over to the output */
+static int php_haru_merge_one(php_haru_merge *merge, zval *key, zval *record) /* {{{ */
+{
+	php_harudoc *doc = merge->doc;
+	php_haru_writer writer = {0};
+	HashTable *fields;
+	HPDF_STATUS status;
+
+	ZVAL_DEREF(record);
+	if ((fields = HASH_OF(record)) == NULL) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid record, array or object expected");
+		return FAILURE;
+	}
+
+	status = php_haru_merge_fill(merge, fields);
+	if (php_haru_status_to_exception(status)) {
+		return FAILURE;
+	}
+
+	if (Z_TYPE_P(merge->output) == IS_STRING) {
+		zend_string *name = zval_get_string(key), *path;
+		php_stream *stream;
+		size_t i;
+
+		/* the key becomes the file name, keep it inside the directory */
+		for (i = 0; i < ZSTR_LEN(name); i++) {
+			char c = ZSTR_VAL(name)[i];
+
+			if (!isalnum((unsigned char)c) && c != '_' && c != '-' && (c != '.' || i == 0)) {
+				break;
+			}
+		}
+		if (i == 0 || i < ZSTR_LEN(name)) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid record key '%s', cannot be used as a file name", ZSTR_VAL(name));
+			zend_string_release(name);
+			return FAILURE;
+		}
+
+		path = strpprintf(0, "%s%c%s.pdf", Z_STRVAL_P(merge->output), DEFAULT_SLASH, ZSTR_VAL(name));
+		zend_string_release(name);
+
+		zend_replace_error_handling(EH_THROW, ce_haruexception, NULL);
+		stream = php_stream_open_wrapper(ZSTR_VAL(path), "wb", REPORT_ERRORS, NULL);
+		zend_replace_error_handling(EH_NORMAL, NULL, NULL);
+		zend_string_release(path);
+
+		if (!stream) {
+			return FAILURE;
+		}
+
+		writer.write = php_haru_php_stream_write;
+		writer.ctx = stream;
+		writer.buf_size = PHP_HARU_BUF_SIZE;
+
+		status = php_haru_save_to_writer(doc, &writer);
+		php_stream_close(stream);
+
+		if (php_haru_status_to_exception(status)) {
+			return FAILURE;
+		}
+	} else {
+		php_haru_string_sink sink = {NULL, 0};
+		zval args[3], retval;
+		int result;
+
+		writer.write = php_haru_string_write;
+		writer.ctx = &sink;
+		writer.buf_size = 0;
+
+		status = php_haru_save_to_writer(doc, &writer);
+
+		if (status != HPDF_OK || !sink.str) {
+			if (sink.str) {
+				zend_string_free(sink.str);
+			}
+			if (!php_haru_status_to_exception(status)) {
+				zend_throw_exception_ex(ce_haruexception, 0, "Failed to save the document");
+			}
+			return FAILURE;
+		}
+
+		sink.str = zend_string_truncate(sink.str, sink.len, 0);
+		ZSTR_VAL(sink.str)[sink.len] = '\0';
+
+		ZVAL_NEW_STR(&args[0], sink.str);
+		ZVAL_COPY(&args[1], key);
+		ZVAL_COPY(&args[2], record);
+
+		result = call_user_function(EG(function_table), NULL, merge->output, &retval, 3, args);
+
+		zval_ptr_dtor(&args[0]);
+		zval_ptr_dtor(&args[1]);
+		zval_ptr_dtor(&args[2]);
+
+		if (result == FAILURE) {
+			if (!EG(exception)) {
+				zend_throw_exception_ex(ce_haruexception, 0, "Failed to call the output callback");
+			}
+			return FAILURE;
+		}
+		zval_ptr_dtor(&retval);
+	}
+
+	merge->count++;
+	return EG(exception) ? FAILURE : SUCCESS;
+}
+/* }}} */
+
+/* }}} */
+
+
+/* {{{ setup journal
+ * The calls setting up a forkable document (fonts, encodings, images, info and
+ * viewer attributes, security and compression settings) are remembered with
+ * their arguments as they succeed, holding the image data passed to the
+ * FromString loaders until the document is released; other documents record
+ * nothing. HaruDoc::fork() replays them on a new
+ * document, where fonts come from the font cache and images from the image
+ * index, which is always enabled in a fork. Loading calls are all kept, of the
+ * setters only the last call for the same key argument, if any, is kept. */
+
+#define PHP_HARU_JOURNAL_ALL -1	/* every call is replayed */
+#define PHP_HARU_JOURNAL_LAST 0	/* only the last call is replayed */
+
+/* key_arg is PHP_HARU_JOURNAL_ALL, PHP_HARU_JOURNAL_LAST or the position of the
+ * argument keying the calls, like the attribute type of setInfoAttr() */
+static void php_haru_journal_add(php_harudoc *doc, zend_execute_data *execute_data, int key_arg) /* {{{ */
+{
+	uint32_t argc = ZEND_NUM_ARGS(), i;
+	zval entry, args;
+
+	doc->set_up = 1;
+	if (!doc->forkable) {
+		return;
+	}
+
+	if (Z_TYPE(doc->journal) == IS_UNDEF) {
+		array_init(&doc->journal);
+	}
+
+	array_init_size(&args, argc);
+	for (i = 0; i < argc; i++) {
+		zval *arg = ZEND_CALL_ARG(execute_data, i + 1);
+
+		ZVAL_DEREF(arg);
+		Z_TRY_ADDREF_P(arg);
+		add_next_index_zval(&args, arg);
+	}
+
+	array_init_size(&entry, 2);
+	add_next_index_str(&entry, zend_string_copy(EX(func)->common.function_name));
+	add_next_index_zval(&entry, &args);
+
+	if (key_arg == PHP_HARU_JOURNAL_ALL) {
+		add_next_index_zval(&doc->journal, &entry);
+	} else {
+		zend_string *name = EX(func)->common.function_name, *value, *key;
+
+		if (key_arg > 0 && (uint32_t)key_arg <= argc) {
+			value = zval_get_string(ZEND_CALL_ARG(execute_data, key_arg));
+		} else {
+			value = ZSTR_EMPTY_ALLOC();
+		}
+
+		key = zend_string_alloc(ZSTR_LEN(name) + 1 + ZSTR_LEN(value), 0);
+		memcpy(ZSTR_VAL(key), ZSTR_VAL(name), ZSTR_LEN(name));
+		ZSTR_VAL(key)[ZSTR_LEN(name)] = '\0';
+		memcpy(ZSTR_VAL(key) + ZSTR_LEN(name) + 1, ZSTR_VAL(value), ZSTR_LEN(value) + 1);
+
+		/* the previous call is overridden, the last one is replayed at its position */
+		zend_hash_del(Z_ARRVAL(doc->journal), key);
+		zend_hash_add_new(Z_ARRVAL(doc->journal), key, &entry);
+
+		zend_string_release(key);
+		zend_string_release(value);
+	}
+}
+/* }}} */
+
+/* }}} */
+
+/* HaruDoc methods {{{ */
+
+/* {{{ proto void HaruDoc::__construct([int mem_pool_buf_size])
+ Construct new HaruDoc instance.
+ With a non-zero mem_pool_buf_size libharu carves its objects out of blocks of
+ that size, which are only released all together when the document is destroyed */
+static PHP_METHOD(HaruDoc, __construct)
+{
+	zval *object = getThis();
+	php_harudoc *doc;
+	zend_long mem_pool_buf_size = 0;
+
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS(), "|l", &mem_pool_buf_size)) {
+		return;
+	}
+
+	if (mem_pool_buf_size < 0 || mem_pool_buf_size > UINT_MAX) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid memory pool buffer size");
+		return;
+	}
+
+	doc = Z_HARUDOC_OBJ_P(object);
+
+	if (doc->h) {
+		/* called __construct() twice, bail out */
+		return;
+	}
+
+	doc->h = HPDF_NewEx(NULL, php_haru_alloc, php_haru_free, (HPDF_UINT)mem_pool_buf_size, NULL);
+
+	PHP_HARU_NULL_CHECK(doc->h, "Cannot create HaruDoc handle");
+}
+/* }}} */
+
+/* {{{ proto bool HaruDoc::setForkable(bool enable)
+ Record the setup of the document for fork(), must be enabled before the document is set up */
+static PHP_METHOD(HaruDoc, setForkable)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	zend_bool enable;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "b", &enable) == FAILURE) {
+		return;
+	}
+
+	if (enable && !doc->forkable && doc->set_up) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Cannot make a document forkable after it was set up");
+		return;
+	}
+
+	doc->forkable = enable;
+	if (!enable) {
+		/* release the recorded arguments */
+		zval_ptr_dtor(&doc->journal);
+		ZVAL_UNDEF(&doc->journal);
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto object HaruDoc::fork()
+ Create a new forkable document set up with the same fonts, encodings, images and settings, with image deduplication enabled.
+ Only the setup is carried over, a document which already has pages or is not forkable can not be forked */
+static PHP_METHOD(HaruDoc, fork)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	php_harudoc *copy;
+	zval *entry;
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	if (!doc->forkable) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Cannot fork a document which is not forkable, call setForkable() before setting it up");
+		return;
+	}
+
+	if (doc->h->page_list->count > 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Cannot fork a document which has pages");
+		return;
+	}
+
+	object_init_ex(return_value, Z_OBJCE_P(getThis()));
+	copy = Z_HARUDOC_OBJ_P(return_value);
+
+	copy->h = HPDF_NewEx(NULL, php_haru_alloc, php_haru_free, doc->h->mmgr->buf_size, NULL);
+
+	PHP_HARU_NULL_CHECK(copy->h, "Cannot create HaruDoc handle");
+	copy->forkable = 1;
+
+	/* loading a replayed image again returns it instead of embedding it twice */
+	ALLOC_HASHTABLE(copy->image_index);
+	zend_hash_init(copy->image_index, 8, NULL, NULL, 0);
+
+	if (Z_TYPE(doc->journal) == IS_UNDEF) {
+		return;
+	}
+
+	/* the replayed calls are recorded in the journal of the copy again */
+	ZEND_HASH_FOREACH_VAL(Z_ARRVAL(doc->journal), entry) {
+		zval *name = zend_hash_index_find(Z_ARRVAL_P(entry), 0);
+		zval *args = zend_hash_index_find(Z_ARRVAL_P(entry), 1);
+		zval retval, *params, *arg;
+		uint32_t argc = 0;
+		int result;
+
+		if (zend_string_equals_literal_ci(Z_STR_P(name), "setImageDeduplication")) {
+			continue;
+		}
+
+		params = safe_emalloc(zend_hash_num_elements(Z_ARRVAL_P(args)) + 1, sizeof(zval), 0);
+		ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(args), arg) {
+			ZVAL_COPY_VALUE(&params[argc++], arg);
+		} ZEND_HASH_FOREACH_END();
+
+		ZVAL_UNDEF(&retval);
+		result = call_user_function(NULL, return_value, name, &retval, argc, params);
+		efree(params);
+		zval_ptr_dtor(&retval);
+
+		if (result == FAILURE || EG(exception)) {
+			zval_ptr_dtor(return_value);
+			ZVAL_NULL(return_value);
+			return;
+		}
+	} ZEND_HASH_FOREACH_END();
+}
+/* }}} */
+
+/* {{{ proto bool HaruDoc::resetError()
+ Reset error state in the document handle */
+static PHP_METHOD(HaruDoc, resetError)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	HPDF_ResetError(doc->h);
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto object HaruDoc::addPage()
+ Add new page to the document */
+static PHP_METHOD(HaruDoc, addPage)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	php_harupage *page;
+	HPDF_Page p;
+
+	if (doc->auto_flush && (p = HPDF_GetCurrentPage(doc->h)) != NULL) {
+		if (php_haru_status_to_exception(php_haru_flush_page(doc, p))) {
+			return;
+		}
+	}
+
+	p = HPDF_AddPage(doc->h);
+
+	if (php_haru_check_doc_error(doc)) {
+		return;
+	}
+	PHP_HARU_NULL_CHECK(p, "Cannot create HaruPage handle");
+
+	object_init_ex(return_value, ce_harupage);
+//	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
+
+	page = Z_HARUPAGE_OBJ_P(return_value);
+
+	page->doc = *getThis();
+	page->h = p;
+
+//	zend_objects_store_add_ref(getThis());
+}
+/* }}} */
+
+/* {{{ proto object HaruDoc::insertPage(object page)
+ Insert new page just before the specified page */
+static PHP_METHOD(HaruDoc, insertPage)
+{
+	zval *z_page;
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	php_harupage *target, *page;
+	HPDF_Page p;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "O", &z_page, ce_harupage) == FAILURE) {
+		return;
+	}
+
+	if (instanceof_function(Z_OBJCE_P(z_page), ce_harutemplate)) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Cannot insert a page before a template");
+		return;
+	}
+
+	target = Z_HARUPAGE_OBJ_P(z_page);
+
+	if (doc->auto_flush && (p = HPDF_GetCurrentPage(doc->h)) != NULL) {
+		if (php_haru_status_to_exception(php_haru_flush_page(doc, p))) {
+			return;
+		}
+	}
+
+	p = HPDF_InsertPage(doc->h, target->h);
+
+	if (php_haru_check_doc_error(doc)) {
+		return;
+	}
+	PHP_HARU_NULL_CHECK(p, "Cannot create HaruPage handle");
+
+	object_init_ex(return_value, ce_harupage);
+//	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
+
+	page = Z_HARUPAGE_OBJ_P(return_value);
+
+	page->doc = *getThis();
+	page->h = p;
+
+//	zend_objects_store_add_ref(getThis());
+}
+/* }}} */
+
+/* {{{ proto object HaruDoc::getCurrentPage()
+ Return current page of the document */
+static PHP_METHOD(HaruDoc, getCurrentPage)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	php_harupage *page;
+	HPDF_Page p;
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	p = HPDF_GetCurrentPage(doc->h);
+
+	if (php_haru_check_doc_error(doc)) {
+		return;
+	}
+
+	if (!p) {
+		/* no current page is not an error */
+		RETURN_FALSE;
+	}
+
+	object_init_ex(return_value, ce_harupage);
+//	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
+
+	page = Z_HARUPAGE_OBJ_P(return_value);
+
+	page->doc = *getThis();
+	page->h = p;
+
+//	zend_objects_store_add_ref(getThis());
+}
+/* }}} */
+
+/* {{{ proto bool HaruDoc::flushPage([object page])
+ Finish the page (the current page by default) and compress its contents to free memory */
+static PHP_METHOD(HaruDoc, flushPage)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	zval *z_page = NULL;
+	HPDF_Page p;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "|O", &z_page, ce_harupage) == FAILURE) {
+		return;
+	}
+
+	if (z_page) {
+		php_harupage *page = Z_HARUPAGE_OBJ_P(z_page);
+
+		p = page->h;
+		if (p->mmgr != doc->h->mmgr) {
+			zend_throw_exception_ex(ce_haruexception, 0, "The page belongs to another document");
+			return;
+		}
+	} else {
+		p = HPDF_GetCurrentPage(doc->h);
+		PHP_HARU_NULL_CHECK(p, "The document has no pages");
+	}
+
+	if (php_haru_status_to_exception(php_haru_flush_page(doc, p))) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruDoc::setAutoFlush(bool enable)
+ Flush the current page automatically when a new page is added */
+static PHP_METHOD(HaruDoc, setAutoFlush)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	zend_bool enable;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "b", &enable) == FAILURE) {
+		return;
+	}
+
+	doc->auto_flush = enable;
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
+	RETURN_TRUE;
+}
+/* }}} */
+
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20200
+/* {{{ proto object HaruDoc::createTemplate(double width, double height)
+ Create a template (Form XObject) which is drawn like a page and can be placed on pages many times */
+static PHP_METHOD(HaruDoc, createTemplate)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	php_harupage *page;
+	php_haru_template *tpl;
+	HPDF_Xref xref;
+	HPDF_Page p;
+	HPDF_PageAttr attr;
+	HPDF_Dict resources, contents;
+	HPDF_Array procset, bbox;
+	HPDF_STATUS status = HPDF_OK;
+	double width, height;
+	static const char *procsets[] = {"PDF", "Text", "ImageB", "ImageC", "ImageI"};
+	size_t i;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dd", &width, &height) == FAILURE) {
+		return;
+	}
+
+	if (width < HPDF_MIN_PAGESIZE || height < HPDF_MIN_PAGESIZE || width > HPDF_MAX_PAGESIZE || height > HPDF_MAX_PAGESIZE) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid template size");
+		return;
+	}
+
+	/* a page which is not part of the page tree and not written at all,
+	 * its contents stream created in the document becomes the form */
+	xref = HPDF_Xref_New(doc->h->mmgr, 0);
+	if (!xref) {
+		if (!php_haru_check_doc_error(doc)) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Cannot create HaruTemplate handle");
+		}
+		return;
+	}
+
+	p = HPDF_Page_New(doc->h->mmgr, xref);
+	contents = p ? HPDF_DictStream_New(doc->h->mmgr, doc->h->xref) : NULL;
+	if (!contents) {
+		HPDF_Xref_Free(xref);
+		if (!php_haru_check_doc_error(doc)) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Cannot create HaruTemplate handle");
+		}
+		return;
+	}
+
+	attr = (HPDF_PageAttr)p->attr;
+	attr->contents = contents;
+	attr->stream = contents->stream;
+	attr->xref = doc->h->xref;
+	if (doc->h->compression_mode & HPDF_COMP_TEXT) {
+		attr->contents->filter = HPDF_STREAM_FILTER_FLATE_DECODE;
+	}
+
+	/* the resources are shared by the page and the form, so they must be an indirect object,
+	 * every new object is attached right away so libharu frees it when it cannot be added */
+	resources = HPDF_Dict_New(doc->h->mmgr);
+	if (!resources || (status = HPDF_Xref_Add(doc->h->xref, resources)) != HPDF_OK) {
+		goto failed;
+	}
+
+	procset = HPDF_Array_New(doc->h->mmgr);
+	if (!procset || (status = HPDF_Dict_Add(resources, "ProcSet", procset)) != HPDF_OK) {
+		goto failed;
+	}
+	for (i = 0; i < sizeof(procsets) / sizeof(procsets[0]); i++) {
+		if ((status = HPDF_Array_Add(procset, HPDF_Name_New(doc->h->mmgr, procsets[i]))) != HPDF_OK) {
+			goto failed;
+		}
+	}
+	if ((status = HPDF_Dict_Add(p, "Resources", resources)) != HPDF_OK) {
+		goto failed;
+	}
+
+	bbox = HPDF_Array_New(doc->h->mmgr);
+	if (!bbox || (status = HPDF_Dict_Add(attr->contents, "BBox", bbox)) != HPDF_OK) {
+		goto failed;
+	}
+	if ((status = HPDF_Array_AddReal(bbox, 0)) != HPDF_OK
+		|| (status = HPDF_Array_AddReal(bbox, 0)) != HPDF_OK
+		|| (status = HPDF_Array_AddReal(bbox, (HPDF_REAL)width)) != HPDF_OK
+		|| (status = HPDF_Array_AddReal(bbox, (HPDF_REAL)height)) != HPDF_OK) {
+		goto failed;
+	}
+
+	if ((status = HPDF_Dict_AddName(attr->contents, "Type", "XObject")) != HPDF_OK
+		|| (status = HPDF_Dict_AddName(attr->contents, "Subtype", "Form")) != HPDF_OK
+		|| (status = HPDF_Dict_Add(attr->contents, "Resources", resources)) != HPDF_OK) {
+		goto failed;
+	}
+	attr->contents->header.obj_class |= HPDF_OSUBCLASS_XOBJECT;
+
+	if ((status = HPDF_Page_SetWidth(p, (HPDF_REAL)width)) != HPDF_OK
+		|| (status = HPDF_Page_SetHeight(p, (HPDF_REAL)height)) != HPDF_OK) {
+		goto failed;
+	}
+
+	if (!doc->templates) {
+		ALLOC_HASHTABLE(doc->templates);
+		zend_hash_init(doc->templates, 8, NULL, php_haru_template_dtor, 0);
+	}
+	tpl = emalloc(sizeof(php_haru_template));
+	tpl->xref = xref;
+	tpl->page = p;
+	zend_hash_next_index_insert_ptr(doc->templates, tpl);
+
+	object_init_ex(return_value, ce_harutemplate);
+
+	page = Z_HARUPAGE_OBJ_P(return_value);
+
+	page->doc = *getThis();
+	page->h = p;
+	return;
+
+failed:
+	/* the page is not registered yet, the empty contents stream stays in the document */
+	HPDF_Xref_Free(xref);
+	if (!php_haru_check_doc_error(doc) && !php_haru_status_to_exception(status)) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Cannot create HaruTemplate handle");
+	}
+}
+/* }}} */
+#endif
+
+/* {{{ proto object HaruDoc::getEncoder(string encoding)
+ Return HaruEncoder instance with the specified encoding */
+static PHP_METHOD(HaruDoc, getEncoder)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	php_haruencoder *encoder;
+	HPDF_Encoder e;
+	char *enc;
+	int enc_len;
+	zend_string *zenc;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &zenc) == FAILURE) {
+		return;
+	}
+
+	enc = ZSTR_VAL(zenc);
+	enc_len = ZSTR_LEN(zenc);
+
+	e = HPDF_GetEncoder(doc->h, (const char *)enc);
+
+	if (php_haru_check_doc_error(doc)) {
+		return;
+	}
+	PHP_HARU_NULL_CHECK(e, "Cannot create HaruEncoder handle");
+
+	object_init_ex(return_value, ce_haruencoder);
+
+	encoder = Z_HARUENCODER_OBJ_P(return_value);
+
+	encoder->doc = *getThis();
+	encoder->h = e;
+}
+/* }}} */
+
+/* {{{ proto object HaruDoc::getCurrentEncoder()
+ Return HaruEncoder currently used in the document */
+static PHP_METHOD(HaruDoc, getCurrentEncoder)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	php_haruencoder *encoder;
+	HPDF_Encoder e;
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	e = HPDF_GetCurrentEncoder(doc->h);
+
+	if (php_haru_check_doc_error(doc)) {
+		return;
+	}
+
+	if (!e) {
+		/* no encoder set */
+		RETURN_FALSE;
+	}
+
+	object_init_ex(return_value, ce_haruencoder);
+//	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
+
+	encoder = Z_HARUENCODER_OBJ_P(return_value);
+
+	encoder->doc = *getThis();
+	encoder->h = e;
+
+//	zend_objects_store_add_ref(getThis());
+}
+/* }}} */
+
+/* {{{ proto bool HaruDoc::setCurrentEncoder(string encoding)
+ Set the current encoder for the document */
+static PHP_METHOD(HaruDoc, setCurrentEncoder)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	char *enc;
+	int enc_len;
+	HPDF_STATUS status;
+	zend_string *zenc;
+
+//	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &enc, &enc_len) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &zenc) == FAILURE) {
+		return;
+	}
+
+	enc = ZSTR_VAL(zenc);
+	status = HPDF_SetCurrentEncoder(doc->h, (const char *)enc);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
+	RETURN_TRUE;
+}
 /* }}} */
 
 /* {{{ proto bool HaruDoc::save(string file)
@@ -946,68 +3853,337 @@ static PHP_METHOD(HaruDoc, save)
 	filename = ZSTR_VAL(zfilename);
 	filename_len = ZSTR_LEN(zfilename);
 
-	HARU_CHECK_FILE(filename);
+	HARU_CHECK_FILE(filename);
+
+	status = php_haru_save(doc, filename);
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+
+	{
+		zend_stat_t sb;
+
+		if (VCWD_STAT(filename, &sb) == 0) {
+			doc->output_size = (size_t)sb.st_size;
+		}
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruDoc::output()
+ Write the document data to the output buffer as it is being generated */
+static PHP_METHOD(HaruDoc, output)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	HPDF_STATUS status;
+	php_haru_writer writer = {0};
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	writer.write = php_haru_output_write;
+	writer.buf_size = PHP_HARU_BUF_SIZE;
+
+	status = php_haru_save_to_writer(doc, &writer);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruDoc::saveToPhpStream(mixed stream[, int buffer_size])
+ Save the document into a PHP stream resource or a stream wrapper URL */
+static PHP_METHOD(HaruDoc, saveToPhpStream)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	HPDF_STATUS status;
+	zval *ztarget;
+	zend_long buffer_size = PHP_HARU_BUF_SIZE;
+	php_stream *stream;
+	php_haru_writer writer = {0};
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z|l", &ztarget, &buffer_size) == FAILURE) {
+		return;
+	}
+
+	if (buffer_size < 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Buffer size must be greater than or equal to zero");
+		return;
+	}
+
+	if (Z_TYPE_P(ztarget) == IS_RESOURCE) {
+		php_stream_from_zval(stream, ztarget);
+	} else {
+		convert_to_string_ex(ztarget);
+
+		zend_replace_error_handling(EH_THROW, ce_haruexception, NULL);
+		stream = php_stream_open_wrapper(Z_STRVAL_P(ztarget), "wb", REPORT_ERRORS, NULL);
+		zend_replace_error_handling(EH_NORMAL, NULL, NULL);
+
+		if (!stream) {
+			return;
+		}
+	}
+
+	writer.write = php_haru_php_stream_write;
+	writer.ctx = stream;
+	writer.buf_size = (size_t)buffer_size;
+
+	status = php_haru_save_to_writer(doc, &writer);
+
+	if (Z_TYPE_P(ztarget) != IS_RESOURCE) {
+		php_stream_close(stream);
+	}
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruDoc::saveToCallback(callable callback[, int buffer_size])
+ Save the document by passing its data to the callback in chunks of buffer_size bytes, the callback returning false stops the output */
+static PHP_METHOD(HaruDoc, saveToCallback)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	HPDF_STATUS status;
+	zval *zcallback;
+	zend_long buffer_size = PHP_HARU_BUF_SIZE;
+	php_haru_writer writer = {0};
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z|l", &zcallback, &buffer_size) == FAILURE) {
+		return;
+	}
+
+	if (!zend_is_callable(zcallback, 0, NULL)) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid callback");
+		return;
+	}
+
+	if (buffer_size <= 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Buffer size must be greater than zero");
+		return;
+	}
+
+	writer.write = php_haru_callback_write;
+	writer.ctx = zcallback;
+	writer.buf_size = (size_t)buffer_size;
+
+	status = php_haru_save_to_writer(doc, &writer);
+
+	if (EG(exception) || php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto string HaruDoc::toString()
+ Return the document data as a string */
+static PHP_METHOD(HaruDoc, toString)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	HPDF_STATUS status;
+	php_haru_writer writer = {0};
+	php_haru_string_sink sink = {NULL, 0};
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	/* no intermediate buffer, libharu writes right into the string */
+	writer.write = php_haru_string_write;
+	writer.ctx = &sink;
+	writer.buf_size = 0;
 
-	status = HPDF_SaveToFile(doc->h, filename);
-	if (php_haru_status_to_exception(status)) {
+	status = php_haru_save_to_writer(doc, &writer);
+
+	if (status != HPDF_OK || !sink.str) {
+		if (sink.str) {
+			zend_string_free(sink.str);
+		}
+		if (!php_haru_status_to_exception(status)) {
+			RETURN_EMPTY_STRING();
+		}
 		return;
 	}
-	RETURN_TRUE;
+
+	sink.str = zend_string_truncate(sink.str, sink.len, 0);
+	ZSTR_VAL(sink.str)[sink.len] = '\0';
+	RETURN_NEW_STR(sink.str);
 }
 /* }}} */
 
-/* {{{ proto bool HaruDoc::output()
- Write the document data to the output buffer */
-static PHP_METHOD(HaruDoc, output)
+/* {{{ proto int HaruDoc::merge(mixed records, mixed output)
+ Produce a document per record of the array or Traversable records, each an array or object with the texts of the placeholders;
+ output is the directory to write key.pdf files into or a callable called with the document data, the key and the record. Return the number of documents */
+static PHP_METHOD(HaruDoc, merge)
 {
 	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	zval *zrecords, *zoutput;
+	php_haru_merge merge = {0};
+	php_haru_placeholder *p;
+	php_haru_save_state state;
+	HashTable keep;
+	HPDF_STATUS status = HPDF_OK;
+	int i;
 
-	HPDF_STATUS status;
-	HPDF_UINT32 size, requested_bytes;
-	char *buffer;
-	unsigned int buffer_size;
-
-	if (zend_parse_parameters_none() == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "zz", &zrecords, &zoutput) == FAILURE) {
 		return;
 	}
 
-	status = HPDF_SaveToStream(doc->h);
-
-	if (php_haru_status_to_exception(status)) {
+	if (Z_TYPE_P(zrecords) != IS_ARRAY &&
+			(Z_TYPE_P(zrecords) != IS_OBJECT || !instanceof_function(Z_OBJCE_P(zrecords), zend_ce_traversable))) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid records, array or Traversable expected");
 		return;
 	}
 
-	size = HPDF_GetStreamSize(doc->h);
+	if (Z_TYPE_P(zoutput) != IS_STRING && !zend_is_callable(zoutput, 0, NULL)) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid output, directory or callable expected");
+		return;
+	}
 
-	if (!size) {
-		zend_throw_exception_ex(ce_haruexception, 0, "Zero stream size, the PDF document contains no data");
+	if (!doc->placeholders || zend_hash_num_elements(doc->placeholders) == 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "The document has no placeholders");
 		return;
 	}
 
-	buffer_size = (size > PHP_HARU_BUF_SIZE) ? PHP_HARU_BUF_SIZE : size;
-	buffer = emalloc(buffer_size + 1);
+	merge.doc = doc;
+	merge.output = zoutput;
+	merge.pages = ecalloc(zend_hash_num_elements(doc->placeholders), sizeof(php_haru_merge_page));
+	zend_hash_init(&keep, 8, NULL, NULL, 0);
 
-	while (size > 0) {
-		requested_bytes = buffer_size;
+	/* take the static content of the pages with placeholders */
+	ZEND_HASH_FOREACH_PTR(doc->placeholders, p) {
+		HPDF_PageAttr attr = (HPDF_PageAttr)p->page->attr;
+		php_haru_merge_page *mp;
+		php_haru_deflated job;
 
-		status = HPDF_ReadFromStream(doc->h, (HPDF_BYTE *)buffer, &requested_bytes);
-		if (status != HPDF_STREAM_EOF && php_haru_status_to_exception(status)) {
-			efree(buffer);
-			return;
+		if (zend_hash_index_exists(&keep, (zend_ulong)(zend_uintptr_t)attr->contents)) {
+			continue;
+		}
+		if (attr->gmode == PHP_HARU_GMODE_FLUSHED) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Cannot merge into a flushed page");
+			goto cleanup;
+		}
+		status = php_haru_finish_page(p->page);
+		if (status != HPDF_OK) {
+			goto cleanup;
 		}
 
-		if (requested_bytes > 0) {
-			PHPWRITE(buffer, requested_bytes);
-			size -= requested_bytes;
+		memset(&job, 0, sizeof(job));
+		job.stream = attr->contents->stream;
+		status = php_haru_deflate_read(doc, &job);
+		if (status != HPDF_OK) {
+			free(job.in);
+			goto cleanup;
 		}
 
-		if (status == HPDF_STREAM_EOF) {
-			/* reached the end of the stream */
-			break;
+		mp = &merge.pages[merge.npages++];
+		mp->page = p->page;
+		mp->stream = attr->contents->stream;
+		mp->data = job.in;
+		mp->len = job.in_len;
+		mp->merged = HPDF_MemStream_New(doc->h->mmgr, PHP_HARU_BUF_SIZE);
+		if (!mp->merged) {
+			status = HPDF_CheckError(&doc->h->error);
+			goto cleanup;
+		}
+		attr->contents->stream = mp->merged;
+		attr->stream = mp->merged;
+
+		zend_hash_index_add_empty_element(&keep, (zend_ulong)(zend_uintptr_t)attr->contents);
+	} ZEND_HASH_FOREACH_END();
+
+	/* the rest of the document is the same for every record */
+	status = php_haru_save_prepare(doc, &state, &keep);
+	if (status == HPDF_OK) {
+		if (Z_TYPE_P(zrecords) == IS_ARRAY) {
+			zend_string *str_key;
+			zend_ulong num_key;
+			zval *record, key;
+
+			ZEND_HASH_FOREACH_KEY_VAL_IND(Z_ARRVAL_P(zrecords), num_key, str_key, record) {
+				if (str_key) {
+					ZVAL_STR_COPY(&key, str_key);
+				} else {
+					ZVAL_LONG(&key, num_key);
+				}
+				i = php_haru_merge_one(&merge, &key, record);
+				zval_ptr_dtor(&key);
+				if (i == FAILURE) {
+					break;
+				}
+			} ZEND_HASH_FOREACH_END();
+		} else {
+			zend_class_entry *ce = Z_OBJCE_P(zrecords);
+			zend_object_iterator *it = ce->get_iterator(ce, zrecords, 0);
+			zend_long index = 0;
+
+			if (it && !EG(exception)) {
+				if (it->funcs->rewind) {
+					it->funcs->rewind(it);
+				}
+				while (!EG(exception) && it->funcs->valid(it) == SUCCESS) {
+					zval *record = it->funcs->get_current_data(it), key;
+
+					if (EG(exception) || !record) {
+						break;
+					}
+					if (it->funcs->get_current_key) {
+						it->funcs->get_current_key(it, &key);
+					} else {
+						ZVAL_LONG(&key, index);
+					}
+					i = php_haru_merge_one(&merge, &key, record);
+					zval_ptr_dtor(&key);
+					if (i == FAILURE) {
+						break;
+					}
+					it->funcs->move_forward(it);
+					index++;
+				}
+			}
+			if (it) {
+				zend_iterator_dtor(it);
+			}
 		}
 	}
-	efree(buffer);
-	RETURN_TRUE;
+	php_haru_save_finish(doc, &state);
+
+cleanup:
+	/* put the template back */
+	for (i = 0; i < merge.npages; i++) {
+		php_haru_merge_page *mp = &merge.pages[i];
+		HPDF_PageAttr attr = (HPDF_PageAttr)mp->page->attr;
+		HPDF_STATUS finished = php_haru_finish_page(mp->page);
+
+		if (status == HPDF_OK) {
+			status = finished;
+		}
+		attr->contents->stream = mp->stream;
+		attr->stream = mp->stream;
+		if (mp->merged) {
+			HPDF_Stream_Free(mp->merged);
+		}
+		free(mp->data);
+	}
+	efree(merge.pages);
+	zend_hash_destroy(&keep);
+
+	if (EG(exception) || php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_LONG(merge.count);
 }
 /* }}} */
 
@@ -1023,11 +4199,13 @@ static PHP_METHOD(HaruDoc, saveToStream)
 		return;
 	}
 
-	status = HPDF_SaveToStream(doc->h);
+	status = php_haru_save(doc, NULL);
 
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+
+	doc->output_size = HPDF_GetStreamSize(doc->h);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1108,6 +4286,118 @@ static PHP_METHOD(HaruDoc, readFromStream)
 }
 /* }}} */
 
+/* {{{ proto bool HaruDoc::setImageDeduplication(bool enable)
+ Enable or disable reusing already loaded images with identical contents */
+static PHP_METHOD(HaruDoc, setImageDeduplication)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	zend_bool enable;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "b", &enable) == FAILURE) {
+		return;
+	}
+
+	if (enable && !doc->image_index) {
+		ALLOC_HASHTABLE(doc->image_index);
+		zend_hash_init(doc->image_index, 8, NULL, NULL, 0);
+	} else if (!enable && doc->image_index) {
+		zend_hash_destroy(doc->image_index);
+		FREE_HASHTABLE(doc->image_index);
+		doc->image_index = NULL;
+	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruDoc::setFontSubsetting(bool enable)
+ Enable or disable embedding only the glyphs printed with TrueType fonts */
+static PHP_METHOD(HaruDoc, setFontSubsetting)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	zend_bool enable;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "b", &enable) == FAILURE) {
+		return;
+	}
+
+	/* the printed characters are recorded anyway, text drawn before is kept */
+	doc->subset_fonts = enable;
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto array HaruDoc::getStats()
+ Get memory usage and object statistics of the document, request_memory_usage and request_memory_peak cover all the documents of the request */
+static PHP_METHOD(HaruDoc, getStats)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+
+	HPDF_MPool_Node node;
+	HPDF_Xref xref;
+	HPDF_UINT i;
+	zend_long pool_size = 0, pool_used = 0, objects = 0, images = 0, content_size = 0;
+	zval page_content_sizes;
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	/* the memory pool belongs to this document only */
+	for (node = doc->h->mmgr->mpool; node; node = node->next_node) {
+		pool_size += node->size;
+		pool_used += node->used_size;
+	}
+
+	for (xref = doc->h->xref; xref; xref = xref->prev) {
+		for (i = 0; i < xref->entries->count; i++) {
+			HPDF_XrefEntry entry = (HPDF_XrefEntry)HPDF_List_ItemAt(xref->entries, i);
+			HPDF_Obj_Header *header;
+
+			if (!entry || !entry->obj) {
+				continue;
+			}
+			objects++;
+
+			header = (HPDF_Obj_Header *)entry->obj;
+			if (header->obj_class == (HPDF_OCLASS_DICT | HPDF_OSUBCLASS_XOBJECT)) {
+				HPDF_Name subtype = HPDF_Dict_GetItem((HPDF_Dict)entry->obj, "Subtype", HPDF_OCLASS_NAME);
+
+				if (subtype && strcmp(HPDF_Name_GetValue(subtype), "Image") == 0) {
+					images++;
+				}
+			}
+		}
+	}
+
+	array_init_size(&page_content_sizes, doc->h->page_list->count);
+	for (i = 0; i < doc->h->page_list->count; i++) {
+		HPDF_Page p = (HPDF_Page)HPDF_List_ItemAt(doc->h->page_list, i);
+		HPDF_PageAttr attr = (HPDF_PageAttr)p->attr;
+
+		add_next_index_long(&page_content_sizes, (zend_long)attr->stream->size);
+		content_size += attr->stream->size;
+	}
+
+	array_init(return_value);
+	/* libharu allocates without telling which document for, so these are the
+	 * allocations of all the documents in the current request */
+	add_assoc_long_ex(return_value, "request_memory_usage", sizeof("request_memory_usage") - 1, (zend_long)HARU_G(mem_usage));
+	add_assoc_long_ex(return_value, "request_memory_peak", sizeof("request_memory_peak") - 1, (zend_long)HARU_G(mem_peak));
+	add_assoc_long_ex(return_value, "pool_size", sizeof("pool_size") - 1, pool_size);
+	add_assoc_long_ex(return_value, "pool_used", sizeof("pool_used") - 1, pool_used);
+	add_assoc_long_ex(return_value, "pages", sizeof("pages") - 1, (zend_long)doc->h->page_list->count);
+	add_assoc_long_ex(return_value, "objects", sizeof("objects") - 1, objects);
+	add_assoc_long_ex(return_value, "fonts", sizeof("fonts") - 1, (zend_long)doc->h->font_mgr->count);
+	add_assoc_long_ex(return_value, "images", sizeof("images") - 1, images);
+	add_assoc_long_ex(return_value, "image_index_hits", sizeof("image_index_hits") - 1, doc->image_index_hits);
+	add_assoc_long_ex(return_value, "content_size", sizeof("content_size") - 1, content_size);
+	add_assoc_zval_ex(return_value, "page_content_sizes", sizeof("page_content_sizes") - 1, &page_content_sizes);
+	add_assoc_long_ex(return_value, "output_size", sizeof("output_size") - 1, (zend_long)doc->output_size);
+}
+/* }}} */
+
 /* {{{ proto bool HaruDoc::setPageLayout(int layout)
  Set how pages should be displayed */
 static PHP_METHOD(HaruDoc, setPageLayout)
@@ -1136,6 +4426,7 @@ static PHP_METHOD(HaruDoc, setPageLayout)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1187,6 +4478,7 @@ static PHP_METHOD(HaruDoc, setPageMode)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1241,6 +4533,7 @@ static PHP_METHOD(HaruDoc, setInfoAttr)
 		return;
 	}
 
+	php_haru_journal_add(doc, execute_data, 1);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1331,32 +4624,53 @@ static PHP_METHOD(HaruDoc, setInfoDateAttr)
 		return;
 	}
 
+	php_haru_journal_add(doc, execute_data, 1);
 	RETURN_TRUE;
 }
 /* }}} */
 
 /* {{{ proto object HaruDoc::getFont(string fontname[, string encoding ])
- Create and return HaruFont instance */
+ Return HaruFont instance, the same one for the same font name and encoding */
 static PHP_METHOD(HaruDoc, getFont)
 {
 	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
 	HPDF_Font f;
 	php_harufont *font;
-	zend_string *zfontname, *zencoding;
+	zend_string *zfontname, *zencoding = NULL, *key;
+	zval *cached;
 
 	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S|S", &zfontname, &zencoding) == FAILURE) {
 		return;
 	}
 
-	if (ZSTR_LEN(zencoding) == 0) {
+	if (zencoding && ZSTR_LEN(zencoding) == 0) {
 		zencoding = NULL;
 	}
 
-	f = HPDF_GetFont(doc->h, (const char *)ZSTR_VAL(zfontname), (const char*)ZSTR_VAL(zencoding));
+	/* font name and encoding name can not contain NUL */
+	key = zend_string_alloc(ZSTR_LEN(zfontname) + 1 + (zencoding ? ZSTR_LEN(zencoding) : 0), 0);
+	memcpy(ZSTR_VAL(key), ZSTR_VAL(zfontname), ZSTR_LEN(zfontname));
+	ZSTR_VAL(key)[ZSTR_LEN(zfontname)] = '\0';
+	if (zencoding) {
+		memcpy(ZSTR_VAL(key) + ZSTR_LEN(zfontname) + 1, ZSTR_VAL(zencoding), ZSTR_LEN(zencoding));
+	}
+	ZSTR_VAL(key)[ZSTR_LEN(key)] = '\0';
+
+	if (doc->fonts && (cached = zend_hash_find(doc->fonts, key)) != NULL) {
+		zend_string_release(key);
+		ZVAL_COPY(return_value, cached);
+		return;
+	}
+
+	f = HPDF_GetFont(doc->h, (const char *)ZSTR_VAL(zfontname), zencoding ? (const char *)ZSTR_VAL(zencoding) : NULL);
 
 	if (php_haru_check_doc_error(doc)) {
+		zend_string_release(key);
 		return;
 	}
+	if (!f) {
+		zend_string_release(key);
+	}
 	PHP_HARU_NULL_CHECK(f, "Cannot create HaruFont handle");
 
 	object_init_ex(return_value, ce_harufont);
@@ -1367,6 +4681,15 @@ static PHP_METHOD(HaruDoc, getFont)
 	font->doc = *getThis();
 	font->h = f;
 
+	/* the document keeps a reference */
+	if (!doc->fonts) {
+		ALLOC_HASHTABLE(doc->fonts);
+		zend_hash_init(doc->fonts, 8, NULL, ZVAL_PTR_DTOR, 0);
+	}
+	Z_ADDREF_P(return_value);
+	zend_hash_add_new(doc->fonts, key, return_value);
+	zend_string_release(key);
+
 //	zend_objects_store_add_ref(getThis());
 }
 /* }}} */
@@ -1392,13 +4715,15 @@ static PHP_METHOD(HaruDoc, loadTTF)
 
 	HARU_CHECK_FILE(fontfile);
 
-	name = HPDF_LoadTTFontFromFile(doc->h, (const char *)fontfile, (HPDF_BOOL)embed);
+	name = php_haru_load_ttf(doc, (const char *)fontfile, -1, (HPDF_BOOL)embed);
 
 	if (php_haru_check_doc_error(doc)) {
 		return;
 	}
 	PHP_HARU_NULL_CHECK(name, "Failed to load TTF font");
 
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_ALL);
+
 //	RETURN_STRING((char *)name, 1);
 	RETURN_STRING((char *)name);
 }
@@ -1420,13 +4745,20 @@ static PHP_METHOD(HaruDoc, loadTTC)
 
 	HARU_CHECK_FILE(ZSTR_VAL(fontfile));
 
-	name = HPDF_LoadTTFontFromFile2(doc->h, (const char *)ZSTR_VAL(fontfile), (HPDF_UINT)index, (HPDF_BOOL)embed);
+	if (index < 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid font index");
+		return;
+	}
+
+	name = php_haru_load_ttf(doc, (const char *)ZSTR_VAL(fontfile), index, (HPDF_BOOL)embed);
 
 	if (php_haru_check_doc_error(doc)) {
 		return;
 	}
 	PHP_HARU_NULL_CHECK(name, "Failed to load TTF font from the font collection");
 
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_ALL);
+
 //	RETURN_STRING((char *)name, 1);
 	RETURN_STRING((char *)name);
 }
@@ -1459,6 +4791,8 @@ static PHP_METHOD(HaruDoc, loadType1)
 	}
 	PHP_HARU_NULL_CHECK(name, "Failed to load Type1 font");
 
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_ALL);
+
 //	RETURN_STRING((char *)name, 1);
 	RETURN_STRING((char *)name);
 }
@@ -1473,6 +4807,7 @@ static PHP_METHOD(HaruDoc, loadPNG)
 	HPDF_Image i;
 	zend_bool deferred = 0;
 	zend_string *zfilename;
+	zend_string *key = NULL;
 
 	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S|b", &zfilename, &deferred) == FAILURE) {
 		return;
@@ -1480,18 +4815,35 @@ static PHP_METHOD(HaruDoc, loadPNG)
 
 	HARU_CHECK_FILE(ZSTR_VAL(zfilename));
 
-	if (deferred) {
+	/* deferred images are indexed apart, their file is read at save time */
+	if (doc->image_index) {
+		zend_long params[1] = {deferred};
+
+		key = php_haru_image_key_file('P', ZSTR_VAL(zfilename), params, 1);
+	}
+
+	if (key && (i = php_haru_image_index_find(doc, key)) != NULL) {
+		/* already loaded */
+	} else if (deferred) {
 		i = HPDF_LoadPngImageFromFile2(doc->h, (const char*)ZSTR_VAL(zfilename));
 	} else {
 		/* default */
 		i = HPDF_LoadPngImageFromFile(doc->h, (const char*)ZSTR_VAL(zfilename));
 	}
 
+	if (key) {
+		if (i) {
+			zend_hash_add_ptr(doc->image_index, key, i);
+		}
+		zend_string_release(key);
+	}
+
 	if (php_haru_check_doc_error(doc)) {
 		return;
 	}
 	PHP_HARU_NULL_CHECK(i, "Failed to load PNG image");
 
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_ALL);
 	object_init_ex(return_value, ce_haruimage);
 //	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
 
@@ -1513,6 +4865,7 @@ static PHP_METHOD(HaruDoc, loadJPEG)
 	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
 	php_haruimage *image;
 	HPDF_Image i;
+	zend_string *key = NULL;
 	zend_string *filename;
 
 	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &filename) == FAILURE) {
@@ -1521,13 +4874,27 @@ static PHP_METHOD(HaruDoc, loadJPEG)
 
 	HARU_CHECK_FILE(ZSTR_VAL(filename));
 
-	i = HPDF_LoadJpegImageFromFile(doc->h, (const char*)ZSTR_VAL(filename));
+	if (doc->image_index) {
+		key = php_haru_image_key_file('J', ZSTR_VAL(filename), NULL, 0);
+	}
+
+	if (!key || (i = php_haru_image_index_find(doc, key)) == NULL) {
+		i = HPDF_LoadJpegImageFromFile(doc->h, (const char*)ZSTR_VAL(filename));
+	}
+
+	if (key) {
+		if (i) {
+			zend_hash_add_ptr(doc->image_index, key, i);
+		}
+		zend_string_release(key);
+	}
 
 	if (php_haru_check_doc_error(doc)) {
 		return;
 	}
 	PHP_HARU_NULL_CHECK(i, "Failed to load JPEG image");
 
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_ALL);
 	object_init_ex(return_value, ce_haruimage);
 //	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
 
@@ -1548,6 +4915,7 @@ static PHP_METHOD(HaruDoc, loadRaw)
 	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
 	php_haruimage *image;
 	HPDF_Image i;
+	zend_string *key = NULL;
 	zend_string *filename;
 	zend_long width, height, color_space;
 
@@ -1568,13 +4936,29 @@ static PHP_METHOD(HaruDoc, loadRaw)
 			return;
 	}
 
-	i = HPDF_LoadRawImageFromFile(doc->h, (const char *)ZSTR_VAL(filename), width, height, (HPDF_ColorSpace)color_space);
+	if (doc->image_index) {
+		zend_long params[3] = {width, height, color_space};
+
+		key = php_haru_image_key_file('R', ZSTR_VAL(filename), params, 3);
+	}
+
+	if (!key || (i = php_haru_image_index_find(doc, key)) == NULL) {
+		i = HPDF_LoadRawImageFromFile(doc->h, (const char *)ZSTR_VAL(filename), width, height, (HPDF_ColorSpace)color_space);
+	}
+
+	if (key) {
+		if (i) {
+			zend_hash_add_ptr(doc->image_index, key, i);
+		}
+		zend_string_release(key);
+	}
 
 	if (php_haru_check_doc_error(doc)) {
 		return;
 	}
 	PHP_HARU_NULL_CHECK(i, "Failed to load RAW image");
 
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_ALL);
 	object_init_ex(return_value, ce_haruimage);
 //	HARU_SET_REFCOUNT_AND_IS_REF(return_value);
 
@@ -1588,6 +4972,195 @@ static PHP_METHOD(HaruDoc, loadRaw)
 }
 /* }}} */
 
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20200
+/* {{{ proto object HaruDoc::loadPNGFromString(string data)
+ Load PNG image from a string and return HaruImage instance */
+static PHP_METHOD(HaruDoc, loadPNGFromString)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	php_haruimage *image;
+	HPDF_Image i;
+	zend_string *key = NULL;
+	zend_string *data;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &data) == FAILURE) {
+		return;
+	}
+
+	if (ZSTR_LEN(data) == 0 || ZSTR_LEN(data) > UINT_MAX) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid image data length");
+		return;
+	}
+
+	if (doc->image_index) {
+		key = php_haru_image_key_mem('P', ZSTR_VAL(data), ZSTR_LEN(data), NULL, 0);
+	}
+
+	if (!key || (i = php_haru_image_index_find(doc, key)) == NULL) {
+		/* libharu copies the data into its own stream */
+		i = HPDF_LoadPngImageFromMem(doc->h, (const HPDF_BYTE *)ZSTR_VAL(data), (HPDF_UINT)ZSTR_LEN(data));
+	}
+
+	if (key) {
+		if (i) {
+			zend_hash_add_ptr(doc->image_index, key, i);
+		}
+		zend_string_release(key);
+	}
+
+	if (php_haru_check_doc_error(doc)) {
+		return;
+	}
+	PHP_HARU_NULL_CHECK(i, "Failed to load PNG image");
+
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_ALL);
+	object_init_ex(return_value, ce_haruimage);
+
+	image = Z_HARUIMAGE_OBJ_P(return_value);
+
+	image->doc = *getThis();
+	image->h = i;
+}
+/* }}} */
+
+/* {{{ proto object HaruDoc::loadJPEGFromString(string data)
+ Load JPEG image from a string and return HaruImage instance */
+static PHP_METHOD(HaruDoc, loadJPEGFromString)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	php_haruimage *image;
+	HPDF_Image i;
+	zend_string *key = NULL;
+	zend_string *data;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &data) == FAILURE) {
+		return;
+	}
+
+	if (ZSTR_LEN(data) == 0 || ZSTR_LEN(data) > UINT_MAX) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid image data length");
+		return;
+	}
+
+	if (doc->image_index) {
+		key = php_haru_image_key_mem('J', ZSTR_VAL(data), ZSTR_LEN(data), NULL, 0);
+	}
+
+	if (!key || (i = php_haru_image_index_find(doc, key)) == NULL) {
+		i = HPDF_LoadJpegImageFromMem(doc->h, (const HPDF_BYTE *)ZSTR_VAL(data), (HPDF_UINT)ZSTR_LEN(data));
+	}
+
+	if (key) {
+		if (i) {
+			zend_hash_add_ptr(doc->image_index, key, i);
+		}
+		zend_string_release(key);
+	}
+
+	if (php_haru_check_doc_error(doc)) {
+		return;
+	}
+	PHP_HARU_NULL_CHECK(i, "Failed to load JPEG image");
+
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_ALL);
+	object_init_ex(return_value, ce_haruimage);
+
+	image = Z_HARUIMAGE_OBJ_P(return_value);
+
+	image->doc = *getThis();
+	image->h = i;
+}
+/* }}} */
+#endif
+
+/* {{{ proto object HaruDoc::loadRawFromString(string data, int width, int height, int color_space[, int bits_per_component])
+ Load RAW image from a string and return HaruImage instance */
+static PHP_METHOD(HaruDoc, loadRawFromString)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	php_haruimage *image;
+	HPDF_Image i;
+	zend_string *key = NULL;
+	zend_string *data;
+	zend_long width, height, color_space, bits_per_component = 8;
+	double size;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "Slll|l", &data, &width, &height, &color_space, &bits_per_component) == FAILURE) {
+		return;
+	}
+
+	switch(color_space) {
+		case HPDF_CS_DEVICE_GRAY:
+		case HPDF_CS_DEVICE_RGB:
+		case HPDF_CS_DEVICE_CMYK:
+			/* only these are valid */
+			break;
+		default:
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid color_space parameter value");
+			return;
+	}
+
+	switch(bits_per_component) {
+		case 1:
+		case 2:
+		case 4:
+		case 8:
+			break;
+		default:
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid bits_per_component parameter value");
+			return;
+	}
+
+	if (width <= 0 || height <= 0 || width > UINT_MAX || height > UINT_MAX) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid image dimensions");
+		return;
+	}
+
+	/* libharu reads as many bytes as the dimensions require, computed the same way */
+	size = (double)(HPDF_UINT)((double)width * height / (8 / bits_per_component) + 0.876);
+	if (color_space == HPDF_CS_DEVICE_RGB) {
+		size *= 3;
+	} else if (color_space == HPDF_CS_DEVICE_CMYK) {
+		size *= 4;
+	}
+
+	if ((double)ZSTR_LEN(data) < size) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Image data is too short for the given dimensions");
+		return;
+	}
+
+	if (doc->image_index) {
+		zend_long params[4] = {width, height, color_space, bits_per_component};
+
+		key = php_haru_image_key_mem('R', ZSTR_VAL(data), ZSTR_LEN(data), params, 4);
+	}
+
+	if (!key || (i = php_haru_image_index_find(doc, key)) == NULL) {
+		i = HPDF_LoadRawImageFromMem(doc->h, (const HPDF_BYTE *)ZSTR_VAL(data), (HPDF_UINT)width, (HPDF_UINT)height, (HPDF_ColorSpace)color_space, (HPDF_UINT)bits_per_component);
+	}
+
+	if (key) {
+		if (i) {
+			zend_hash_add_ptr(doc->image_index, key, i);
+		}
+		zend_string_release(key);
+	}
+
+	if (php_haru_check_doc_error(doc)) {
+		return;
+	}
+	PHP_HARU_NULL_CHECK(i, "Failed to load RAW image");
+
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_ALL);
+	object_init_ex(return_value, ce_haruimage);
+
+	image = Z_HARUIMAGE_OBJ_P(return_value);
+
+	image->doc = *getThis();
+	image->h = i;
+}
+/* }}} */
+
 /* {{{ proto bool HaruDoc::setPassword(string owner_password, string user_password)
  Set owner and user passwords for the document */
 static PHP_METHOD(HaruDoc, setPassword)
@@ -1605,6 +5178,7 @@ static PHP_METHOD(HaruDoc, setPassword)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1626,6 +5200,7 @@ static PHP_METHOD(HaruDoc, setPermission)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1654,9 +5229,53 @@ static PHP_METHOD(HaruDoc, setEncryptionMode)
 
 	status = HPDF_SetEncryptionMode(doc->h, (HPDF_EncryptMode)mode, (HPDF_UINT)key_len);
 
-	if (php_haru_status_to_exception(status)) {
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruDoc::setCompressionLevel(int level[, int strategy[, int streams]])
+ Set zlib compression level and strategy for the streams of the document compressed according to the compression mode */
+static PHP_METHOD(HaruDoc, setCompressionLevel)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	zend_long level, strategy = Z_DEFAULT_STRATEGY, streams = HPDF_COMP_ALL;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "l|ll", &level, &strategy, &streams) == FAILURE) {
+		return;
+	}
+
+	if (!php_haru_valid_level(level)) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid compression level, expected -1 to 9");
+		return;
+	}
+
+	if (!php_haru_valid_strategy(strategy)) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid compression strategy");
+		return;
+	}
+
+	if (streams & ~HPDF_COMP_ALL) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid streams value");
 		return;
 	}
+
+	if (streams & HPDF_COMP_TEXT) {
+		doc->deflate_level[PHP_HARU_STREAM_TEXT] = level;
+		doc->deflate_strategy[PHP_HARU_STREAM_TEXT] = strategy;
+	}
+	if (streams & HPDF_COMP_IMAGE) {
+		doc->deflate_level[PHP_HARU_STREAM_IMAGE] = level;
+		doc->deflate_strategy[PHP_HARU_STREAM_IMAGE] = strategy;
+	}
+	if (streams & HPDF_COMP_METADATA) {
+		doc->deflate_level[PHP_HARU_STREAM_METADATA] = level;
+		doc->deflate_strategy[PHP_HARU_STREAM_METADATA] = strategy;
+	}
+	php_haru_journal_add(doc, execute_data, 3);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1678,6 +5297,7 @@ static PHP_METHOD(HaruDoc, setCompressionMode)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1699,6 +5319,7 @@ static PHP_METHOD(HaruDoc, setPagesConfiguration)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1807,6 +5428,7 @@ static PHP_METHOD(HaruDoc, addPageLabel)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, 1);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1827,6 +5449,7 @@ static PHP_METHOD(HaruDoc, useJPFonts)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1847,6 +5470,7 @@ static PHP_METHOD(HaruDoc, useJPEncodings)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1867,6 +5491,7 @@ static PHP_METHOD(HaruDoc, useKRFonts)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1887,6 +5512,7 @@ static PHP_METHOD(HaruDoc, useKREncodings)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1907,6 +5533,7 @@ static PHP_METHOD(HaruDoc, useCNSFonts)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1927,6 +5554,7 @@ static PHP_METHOD(HaruDoc, useCNSEncodings)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1947,6 +5575,7 @@ static PHP_METHOD(HaruDoc, useCNTFonts)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -1967,9 +5596,33 @@ static PHP_METHOD(HaruDoc, useCNTEncodings)
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
+	RETURN_TRUE;
+}
+/* }}} */
+
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20300
+/* {{{ proto bool HaruDoc::useUTFEncodings()
+ Enable the UTF-8 encoding for TrueType fonts */
+static PHP_METHOD(HaruDoc, useUTFEncodings)
+{
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(getThis());
+	HPDF_STATUS status;
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	status = HPDF_UseUTFEncodings(doc->h);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	php_haru_journal_add(doc, execute_data, PHP_HARU_JOURNAL_LAST);
 	RETURN_TRUE;
 }
 /* }}} */
+#endif
 
 /* }}} */
 
@@ -2773,11 +6426,257 @@ static PHP_METHOD(HaruPage, lineTo)
 	HPDF_STATUS status;
 	double x, y;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dd", &x, &y) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dd", &x, &y) == FAILURE) {
+		return;
+	}
+
+	status = HPDF_Page_LineTo(page->h, (HPDF_REAL)x, (HPDF_REAL)y);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::curveTo(double x1, double y1, double x2, double y2, double x3, double y3)
+ Append a Bezier curve to the current path */
+static PHP_METHOD(HaruPage, curveTo)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	double x1, x2, x3, y1, y2, y3;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dddddd", &x1, &y1, &x2, &y2, &x3, &y3) == FAILURE) {
+		return;
+	}
+
+	status = HPDF_Page_CurveTo(page->h, (HPDF_REAL)x1, (HPDF_REAL)y1, (HPDF_REAL)x2, (HPDF_REAL)y2, (HPDF_REAL)x3, (HPDF_REAL)y3);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::curveTo2(double x2, double y2, double x3, double y3)
+ Append a Bezier curve to the current path */
+static PHP_METHOD(HaruPage, curveTo2)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	double x2, x3, y2, y3;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dddd", &x2, &y2, &x3, &y3) == FAILURE) {
+		return;
+	}
+
+	status = HPDF_Page_CurveTo2(page->h, (HPDF_REAL)x2, (HPDF_REAL)y2, (HPDF_REAL)x3, (HPDF_REAL)y3);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::curveTo3(double x1, double y1, double x3, double y3)
+ Append a Bezier curve to the current path */
+static PHP_METHOD(HaruPage, curveTo3)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	double x1, x3, y1, y3;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dddd", &x1, &y1, &x3, &y3) == FAILURE) {
+		return;
+	}
+
+	status = HPDF_Page_CurveTo3(page->h, (HPDF_REAL)x1, (HPDF_REAL)y1, (HPDF_REAL)x3, (HPDF_REAL)y3);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::rectangle(double x, double y, double width, double height)
+ Append a rectangle to the current path */
+static PHP_METHOD(HaruPage, rectangle)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	double x, y, width, height;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dddd", &x, &y, &width, &height) == FAILURE) {
+		return;
+	}
+
+	status = HPDF_Page_Rectangle(page->h, (HPDF_REAL)x, (HPDF_REAL)y, (HPDF_REAL)width, (HPDF_REAL)height);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::arc(double x, double y, double ray, double ang1, double ang2)
+ Append an arc to the current path */
+static PHP_METHOD(HaruPage, arc)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	double x, y, ray, ang1, ang2;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ddddd", &x, &y, &ray, &ang1, &ang2) == FAILURE) {
+		return;
+	}
+
+	status = HPDF_Page_Arc(page->h, (HPDF_REAL)x, (HPDF_REAL)y, (HPDF_REAL)ray, (HPDF_REAL)ang1, (HPDF_REAL)ang2);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::circle(double x, double y, double ray)
+ Append a circle to the current path */
+static PHP_METHOD(HaruPage, circle)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	double x, y, ray;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ddd", &x, &y, &ray) == FAILURE) {
+		return;
+	}
+
+	status = HPDF_Page_Circle(page->h, (HPDF_REAL)x, (HPDF_REAL)y, (HPDF_REAL)ray);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::ellipse(double x, double y, double xray, double yray)
+ Append an ellipse to the current path */
+static PHP_METHOD(HaruPage, ellipse)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	double x, y, xray, yray;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dddd", &x, &y, &xray, &yray) == FAILURE) {
+		return;
+	}
+
+	status = HPDF_Page_Ellipse(page->h, (HPDF_REAL) x, (HPDF_REAL)y, (HPDF_REAL)xray, (HPDF_REAL)yray);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::showText(string text)
+ Print text at the current position of the page */
+static PHP_METHOD(HaruPage, showText)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	zend_string *ztext;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &ztext) == FAILURE) {
+		return;
+	}
+
+	php_haru_subset_record_page(page, ZSTR_VAL(ztext), ZSTR_LEN(ztext));
+	status = HPDF_Page_ShowText(page->h, (const char*)ZSTR_VAL(ztext));
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::showTextUTF8(string text)
+ Print UTF-8 text at the current position of the page using the current font */
+static PHP_METHOD(HaruPage, showTextUTF8)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	zend_string *ztext, *encoded;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &ztext) == FAILURE) {
+		return;
+	}
+
+	if ((encoded = php_haru_page_utf8(page, ztext, NULL)) == NULL) {
+		return;
+	}
+
+	php_haru_subset_record_page(page, ZSTR_VAL(encoded), ZSTR_LEN(encoded));
+	status = HPDF_Page_ShowText(page->h, (const char*)ZSTR_VAL(encoded));
+	zend_string_release(encoded);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::showTextNextLine(string text)
+ Move current position to the start of the next line and print the text */
+static PHP_METHOD(HaruPage, showTextNextLine)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	zend_string *text;
+	double word_space = 0, char_space = 0;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S|dd", &text, &word_space, &char_space) == FAILURE) {
+		return;
+	}
+
+	php_haru_subset_record_page(page, ZSTR_VAL(text), ZSTR_LEN(text));
+	if (ZEND_NUM_ARGS() == 1) {
+		status = HPDF_Page_ShowTextNextLine(page->h, (const char*)ZSTR_VAL(text));
+	} else {
+		status = HPDF_Page_ShowTextNextLineEx(page->h, (HPDF_REAL)word_space, (HPDF_REAL)char_space, (const char*)ZSTR_VAL(text));
+	}
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruPage::textOut(double x, double y, string text)
+ Print the text on the specified position */
+static PHP_METHOD(HaruPage, textOut)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	double x, y;
+	zend_string *text;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ddS", &x, &y, &text) == FAILURE) {
 		return;
 	}
 
-	status = HPDF_Page_LineTo(page->h, (HPDF_REAL)x, (HPDF_REAL)y);
+	php_haru_subset_record_page(page, ZSTR_VAL(text), ZSTR_LEN(text));
+	status = HPDF_Page_TextOut(page->h, (HPDF_REAL)x, (HPDF_REAL)y, (const char*)ZSTR_VAL(text));
 
 	if (php_haru_status_to_exception(status)) {
 		return;
@@ -2786,19 +6685,26 @@ static PHP_METHOD(HaruPage, lineTo)
 }
 /* }}} */
 
-/* {{{ proto bool HaruPage::curveTo(double x1, double y1, double x2, double y2, double x3, double y3)
- Append a Bezier curve to the current path */
-static PHP_METHOD(HaruPage, curveTo)
+/* {{{ proto bool HaruPage::textOutUTF8(double x, double y, string text)
+ Print UTF-8 text on the specified position using the current font */
+static PHP_METHOD(HaruPage, textOutUTF8)
 {
 	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
 	HPDF_STATUS status;
-	double x1, x2, x3, y1, y2, y3;
+	double x, y;
+	zend_string *text, *encoded;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dddddd", &x1, &y1, &x2, &y2, &x3, &y3) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ddS", &x, &y, &text) == FAILURE) {
 		return;
 	}
 
-	status = HPDF_Page_CurveTo(page->h, (HPDF_REAL)x1, (HPDF_REAL)y1, (HPDF_REAL)x2, (HPDF_REAL)y2, (HPDF_REAL)x3, (HPDF_REAL)y3);
+	if ((encoded = php_haru_page_utf8(page, text, NULL)) == NULL) {
+		return;
+	}
+
+	php_haru_subset_record_page(page, ZSTR_VAL(encoded), ZSTR_LEN(encoded));
+	status = HPDF_Page_TextOut(page->h, (HPDF_REAL)x, (HPDF_REAL)y, (const char*)ZSTR_VAL(encoded));
+	zend_string_release(encoded);
 
 	if (php_haru_status_to_exception(status)) {
 		return;
@@ -2807,19 +6713,18 @@ static PHP_METHOD(HaruPage, curveTo)
 }
 /* }}} */
 
-/* {{{ proto bool HaruPage::curveTo2(double x2, double y2, double x3, double y3)
- Append a Bezier curve to the current path */
-static PHP_METHOD(HaruPage, curveTo2)
+/* {{{ proto bool HaruPage::beginText()
+ Begin a text object and set the current text position to (0,0) */
+static PHP_METHOD(HaruPage, beginText)
 {
 	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
 	HPDF_STATUS status;
-	double x2, x3, y2, y3;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dddd", &x2, &y2, &x3, &y3) == FAILURE) {
+	if (zend_parse_parameters_none() == FAILURE) {
 		return;
 	}
 
-	status = HPDF_Page_CurveTo2(page->h, (HPDF_REAL)x2, (HPDF_REAL)y2, (HPDF_REAL)x3, (HPDF_REAL)y3);
+	status = HPDF_Page_BeginText(page->h);
 
 	if (php_haru_status_to_exception(status)) {
 		return;
@@ -2828,19 +6733,18 @@ static PHP_METHOD(HaruPage, curveTo2)
 }
 /* }}} */
 
-/* {{{ proto bool HaruPage::curveTo3(double x1, double y1, double x3, double y3)
- Append a Bezier curve to the current path */
-static PHP_METHOD(HaruPage, curveTo3)
+/* {{{ proto bool HaruPage::endText()
+ End current text object */
+static PHP_METHOD(HaruPage, endText)
 {
 	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
 	HPDF_STATUS status;
-	double x1, x3, y1, y3;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dddd", &x1, &y1, &x3, &y3) == FAILURE) {
+	if (zend_parse_parameters_none() == FAILURE) {
 		return;
 	}
 
-	status = HPDF_Page_CurveTo3(page->h, (HPDF_REAL)x1, (HPDF_REAL)y1, (HPDF_REAL)x3, (HPDF_REAL)y3);
+	status = HPDF_Page_EndText(page->h);
 
 	if (php_haru_status_to_exception(status)) {
 		return;
@@ -2849,19 +6753,34 @@ static PHP_METHOD(HaruPage, curveTo3)
 }
 /* }}} */
 
-/* {{{ proto bool HaruPage::rectangle(double x, double y, double width, double height)
- Append a rectangle to the current path */
-static PHP_METHOD(HaruPage, rectangle)
+/* {{{ proto bool HaruPage::textRect(double left, double top, double right, double bottom, string text[, int align ])
+ Print the text inside the specified region */
+static PHP_METHOD(HaruPage, textRect)
 {
 	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
 	HPDF_STATUS status;
-	double x, y, width, height;
+	double left, top, right, bottom;
+	zend_string *str;
+	long align = HPDF_TALIGN_LEFT;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dddd", &x, &y, &width, &height) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ddddS|l", &left, &top, &right, &bottom, &str, &align) == FAILURE) {
 		return;
 	}
 
-	status = HPDF_Page_Rectangle(page->h, (HPDF_REAL)x, (HPDF_REAL)y, (HPDF_REAL)width, (HPDF_REAL)height);
+	switch(align) {
+		case HPDF_TALIGN_LEFT:
+		case HPDF_TALIGN_RIGHT:
+		case HPDF_TALIGN_CENTER:
+		case HPDF_TALIGN_JUSTIFY:
+			/* only these are valid */
+			break;
+		default:
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid align value");
+			return;
+	}
+
+	php_haru_subset_record_page(page, ZSTR_VAL(str), ZSTR_LEN(str));
+	status = HPDF_Page_TextRect(page->h, (HPDF_REAL)left, (HPDF_REAL)top, (HPDF_REAL)right, (HPDF_REAL)bottom, (const char *)ZSTR_VAL(str), (HPDF_TextAlignment) align, NULL);
 
 	if (php_haru_status_to_exception(status)) {
 		return;
@@ -2870,19 +6789,39 @@ static PHP_METHOD(HaruPage, rectangle)
 }
 /* }}} */
 
-/* {{{ proto bool HaruPage::arc(double x, double y, double ray, double ang1, double ang2)
- Append an arc to the current path */
-static PHP_METHOD(HaruPage, arc)
+/* {{{ proto bool HaruPage::textRectUTF8(double left, double top, double right, double bottom, string text[, int align ])
+ Print UTF-8 text inside the specified region using the current font */
+static PHP_METHOD(HaruPage, textRectUTF8)
 {
 	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
 	HPDF_STATUS status;
-	double x, y, ray, ang1, ang2;
+	double left, top, right, bottom;
+	zend_string *str, *encoded;
+	long align = HPDF_TALIGN_LEFT;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ddddd", &x, &y, &ray, &ang1, &ang2) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ddddS|l", &left, &top, &right, &bottom, &str, &align) == FAILURE) {
 		return;
 	}
 
-	status = HPDF_Page_Arc(page->h, (HPDF_REAL)x, (HPDF_REAL)y, (HPDF_REAL)ray, (HPDF_REAL)ang1, (HPDF_REAL)ang2);
+	switch(align) {
+		case HPDF_TALIGN_LEFT:
+		case HPDF_TALIGN_RIGHT:
+		case HPDF_TALIGN_CENTER:
+		case HPDF_TALIGN_JUSTIFY:
+			/* only these are valid */
+			break;
+		default:
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid align value");
+			return;
+	}
+
+	if ((encoded = php_haru_page_utf8(page, str, NULL)) == NULL) {
+		return;
+	}
+
+	php_haru_subset_record_page(page, ZSTR_VAL(encoded), ZSTR_LEN(encoded));
+	status = HPDF_Page_TextRect(page->h, (HPDF_REAL)left, (HPDF_REAL)top, (HPDF_REAL)right, (HPDF_REAL)bottom, (const char *)ZSTR_VAL(encoded), (HPDF_TextAlignment) align, NULL);
+	zend_string_release(encoded);
 
 	if (php_haru_status_to_exception(status)) {
 		return;
@@ -2891,188 +6830,682 @@ static PHP_METHOD(HaruPage, arc)
 }
 /* }}} */
 
-/* {{{ proto bool HaruPage::circle(double x, double y, double ray)
- Append a circle to the current path */
-static PHP_METHOD(HaruPage, circle)
+/* find the end of the line starting at *pos which fits into width; the length
+ * of the line without trailing blanks is stored in line_len and *pos is moved
+ * to the start of the next line. Returns 0 if not even one character fits */
+static int php_haru_break_line(HPDF_Font font, double size, double char_space, double word_space, const char *text, size_t len, size_t *pos, double width, size_t *line_len, zend_bool *hard) /* {{{ */
 {
-	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
-	HPDF_STATUS status;
-	double x, y, ray;
+	const char *nl = memchr(text + *pos, '\n', len - *pos);
+	size_t seg_len = nl ? (size_t)(nl - (text + *pos)) : len - *pos;
+	size_t n = 0;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ddd", &x, &y, &ray) == FAILURE) {
-		return;
+	if (seg_len > 0) {
+		n = HPDF_Font_MeasureText(font, (const HPDF_BYTE *)text + *pos, (HPDF_UINT)seg_len, (HPDF_REAL)width, (HPDF_REAL)size, (HPDF_REAL)char_space, (HPDF_REAL)word_space, HPDF_TRUE, NULL);
+		if (n == 0) {
+			/* a single word wider than the box, break it anywhere */
+			n = HPDF_Font_MeasureText(font, (const HPDF_BYTE *)text + *pos, (HPDF_UINT)seg_len, (HPDF_REAL)width, (HPDF_REAL)size, (HPDF_REAL)char_space, (HPDF_REAL)word_space, HPDF_FALSE, NULL);
+			if (n == 0) {
+				return 0;
+			}
+		}
 	}
+	*hard = (n >= seg_len);
 
-	status = HPDF_Page_Circle(page->h, (HPDF_REAL)x, (HPDF_REAL)y, (HPDF_REAL)ray);
+	*line_len = n;
+	while (*line_len > 0 && (text[*pos + *line_len - 1] == ' ' || text[*pos + *line_len - 1] == '\r')) {
+		(*line_len)--;
+	}
 
-	if (php_haru_status_to_exception(status)) {
-		return;
+	*pos += n;
+	if (*hard) {
+		if (nl) {
+			/* skip the newline */
+			(*pos)++;
+		}
+	} else {
+		while (*pos < len && text[*pos] == ' ') {
+			(*pos)++;
+		}
 	}
-	RETURN_TRUE;
+	return 1;
 }
 /* }}} */
 
-/* {{{ proto bool HaruPage::ellipse(double x, double y, double xray, double yray)
- Append an ellipse to the current path */
-static PHP_METHOD(HaruPage, ellipse)
+/* {{{ proto array HaruPage::layoutText(string text, array box[, array options])
+ Break the text into lines and print them inside the box or the list of boxes,
+ return the text that did not fit together with the used height */
+static PHP_METHOD(HaruPage, layoutText)
 {
 	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(&page->doc);
 	HPDF_STATUS status;
-	double x, y, xray, yray;
+	HPDF_Font font;
+	HPDF_Box bbox;
+	HPDF_Rect *boxes;
+	zend_string *str;
+	zval *zboxes, *zoptions = NULL, *element;
+	zend_long align = HPDF_TALIGN_LEFT;
+	zend_bool draw = 1;
+	double size, leading, char_space, word_space, ascent, descent, height = 0;
+	const char *text;
+	char *line;
+	size_t len, pos = 0;
+	int nboxes, b, last_box = 0;
+	zend_long lines = 0;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "dddd", &x, &y, &xray, &yray) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sa|a", &str, &zboxes, &zoptions) == FAILURE) {
 		return;
 	}
 
-	status = HPDF_Page_Ellipse(page->h, (HPDF_REAL) x, (HPDF_REAL)y, (HPDF_REAL)xray, (HPDF_REAL)yray);
-
-	if (php_haru_status_to_exception(status)) {
+	font = HPDF_Page_GetCurrentFont(page->h);
+	if (!font) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Font is not set");
 		return;
 	}
-	RETURN_TRUE;
-}
-/* }}} */
+	size = HPDF_Page_GetCurrentFontSize(page->h);
+	char_space = HPDF_Page_GetCharSpace(page->h);
+	word_space = HPDF_Page_GetWordSpace(page->h);
+	leading = HPDF_Page_GetTextLeading(page->h);
 
-/* {{{ proto bool HaruPage::showText(string text)
- Print text at the current position of the page */
-static PHP_METHOD(HaruPage, showText)
-{
-	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
-	HPDF_STATUS status;
-	zend_string *ztext;
+	bbox = HPDF_Font_GetBBox(font);
+	ascent = bbox.top / 1000 * size;
+	descent = bbox.bottom / 1000 * size;
+	if (leading == 0) {
+		leading = ascent - descent;
+	}
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &ztext) == FAILURE) {
+	if (zoptions) {
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zoptions), "align", sizeof("align") - 1)) != NULL) {
+			align = zval_get_long(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zoptions), "leading", sizeof("leading") - 1)) != NULL) {
+			leading = zval_get_double(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zoptions), "draw", sizeof("draw") - 1)) != NULL) {
+			draw = zend_is_true(element);
+		}
+	}
+
+	switch(align) {
+		case HPDF_TALIGN_LEFT:
+		case HPDF_TALIGN_RIGHT:
+		case HPDF_TALIGN_CENTER:
+		case HPDF_TALIGN_JUSTIFY:
+			/* only these are valid */
+			break;
+		default:
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid align value");
+			return;
+	}
+
+	if (leading <= 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid leading value");
 		return;
 	}
 
-	status = HPDF_Page_ShowText(page->h, (const char*)ZSTR_VAL(ztext));
+	if (draw && HPDF_Page_GetGMode(page->h) != HPDF_GMODE_TEXT_OBJECT) {
+		php_haru_status_to_exception(HPDF_PAGE_INVALID_GMODE);
+		return;
+	}
 
-	if (php_haru_status_to_exception(status)) {
+	/* a single box or a list of boxes */
+	nboxes = zend_hash_num_elements(Z_ARRVAL_P(zboxes));
+	element = zend_hash_index_find(Z_ARRVAL_P(zboxes), 0);
+	if (nboxes == 0 || !element) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid box");
 		return;
 	}
-	RETURN_TRUE;
+
+	if (Z_TYPE_P(element) == IS_ARRAY) {
+		boxes = safe_emalloc(nboxes, sizeof(HPDF_Rect), 0);
+		b = 0;
+		ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(zboxes), element) {
+			if (Z_TYPE_P(element) != IS_ARRAY || zend_hash_num_elements(Z_ARRVAL_P(element)) != 4) {
+				zend_throw_exception_ex(ce_haruexception, 0, "Invalid box at index %d, array of 4 elements expected", b);
+				efree(boxes);
+				return;
+			}
+			boxes[b++] = php_haru_array_to_rect(element);
+		} ZEND_HASH_FOREACH_END();
+	} else {
+		if (nboxes != 4) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid box, array of 4 elements expected");
+			return;
+		}
+		boxes = emalloc(sizeof(HPDF_Rect));
+		boxes[0] = php_haru_array_to_rect(zboxes);
+		nboxes = 1;
+	}
+
+	text = ZSTR_VAL(str);
+	len = ZSTR_LEN(str);
+	line = emalloc(len + 1);
+
+	for (b = 0; b < nboxes && pos < len; b++) {
+		HPDF_Rect *box = &boxes[b];
+		double width = box->right - box->left;
+		double y = box->top - ascent;
+		zend_long box_lines = 0;
+
+		last_box = b;
+		height = 0;
+
+		while (pos < len && y + descent >= box->bottom) {
+			size_t start = pos, line_len;
+			zend_bool hard;
+			HPDF_TextWidth tw;
+			double line_width, x;
+
+			if (!php_haru_break_line(font, size, char_space, word_space, text, len, &pos, width, &line_len, &hard)) {
+				/* the box is too narrow for a single character */
+				break;
+			}
+
+			if (draw && line_len > 0) {
+				tw = php_haru_text_width(doc, font, (const HPDF_BYTE *)text + start, (HPDF_UINT)line_len);
+				line_width = tw.width * size / 1000 + word_space * tw.numspace + char_space * tw.numchars;
+
+				switch (align) {
+					case HPDF_TALIGN_RIGHT:
+						x = box->left + width - line_width;
+						break;
+					case HPDF_TALIGN_CENTER:
+						x = box->left + (width - line_width) / 2;
+						break;
+					default:
+						x = box->left;
+						break;
+				}
+
+				memcpy(line, text + start, line_len);
+				line[line_len] = '\0';
+				php_haru_subset_record_page(page, line, line_len);
+
+				/* the last line of a paragraph is not justified */
+				if (align == HPDF_TALIGN_JUSTIFY && !hard && tw.numspace > 0) {
+					status = HPDF_Page_SetWordSpace(page->h, (HPDF_REAL)(word_space + (width - line_width) / tw.numspace));
+					if (status == HPDF_OK) {
+						status = HPDF_Page_TextOut(page->h, (HPDF_REAL)x, (HPDF_REAL)y, line);
+						HPDF_Page_SetWordSpace(page->h, (HPDF_REAL)word_space);
+					}
+				} else {
+					status = HPDF_Page_TextOut(page->h, (HPDF_REAL)x, (HPDF_REAL)y, line);
+				}
+
+				if (php_haru_status_to_exception(status)) {
+					efree(line);
+					efree(boxes);
+					return;
+				}
+			}
+
+			height = box->top - (y + descent);
+			box_lines++;
+			y -= leading;
+		}
+
+		lines += box_lines;
+	}
+
+	efree(line);
+	efree(boxes);
+
+	array_init(return_value);
+	add_assoc_stringl_ex(return_value, "remainder", sizeof("remainder") - 1, (char *)text + pos, len - pos);
+	add_assoc_double_ex(return_value, "height", sizeof("height") - 1, height);
+	add_assoc_long_ex(return_value, "lines", sizeof("lines") - 1, lines);
+	add_assoc_long_ex(return_value, "box", sizeof("box") - 1, (zend_long)last_box);
 }
 /* }}} */
 
-/* {{{ proto bool HaruPage::showTextNextLine(string text)
- Move current position to the start of the next line and print the text */
-static PHP_METHOD(HaruPage, showTextNextLine)
+typedef struct {
+	const char *text;
+	size_t len;
+	double x;
+	double y;
+} php_haru_table_line;
+
+/* {{{ proto array HaruPage::drawTable(array rows, array columns[, array style])
+ Draw the rows, arrays of cell texts, as a table with the current font from the x, y corner given in style down to its bottom,
+ return the index of the first row that did not fit, the bottom of the table and the number of rows drawn */
+static PHP_METHOD(HaruPage, drawTable)
 {
 	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
-	HPDF_STATUS status;
-	zend_string *text;
-	double word_space = 0, char_space = 0;
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(&page->doc);
+	HPDF_STATUS status = HPDF_OK;
+	HPDF_Font font;
+	HPDF_Box bbox;
+	HPDF_RGBColor grid_color = {0, 0, 0}, header_color, stripe_color;
+	zend_bool has_header_color = 0, has_stripe_color = 0, wrap = 1;
+	zval *zrows, *zcolumns, *zstyle = NULL, *element, **rows, strings;
+	double size, char_space, word_space, ascent, descent, leading;
+	double left = 0, top, bottom = 0, padding = 2, line_width = 0.5, y;
+	double *xs, *widths, *row_top, *row_height;
+	zend_long *aligns, *row_index, start = -1, header = 0, next;
+	php_haru_table_line *lines = NULL;
+	size_t nlines = 0, lines_size = 0, k;
+	char *buf = NULL;
+	size_t buf_size = 0;
+	int ncols, nrows, ndrawn = 0, data_rows = 0, i, c, n;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S|dd", &text, &word_space, &char_space) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "aa|a", &zrows, &zcolumns, &zstyle) == FAILURE) {
 		return;
 	}
 
-	if (ZEND_NUM_ARGS() == 1) {
-		status = HPDF_Page_ShowTextNextLine(page->h, (const char*)ZSTR_VAL(text));
-	} else {
-		status = HPDF_Page_ShowTextNextLineEx(page->h, (HPDF_REAL)word_space, (HPDF_REAL)char_space, (const char*)ZSTR_VAL(text));
+	font = HPDF_Page_GetCurrentFont(page->h);
+	if (!font) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Font is not set");
+		return;
 	}
 
-	if (php_haru_status_to_exception(status)) {
+	if (HPDF_Page_GetGMode(page->h) != HPDF_GMODE_PAGE_DESCRIPTION) {
+		php_haru_status_to_exception(HPDF_PAGE_INVALID_GMODE);
 		return;
 	}
-	RETURN_TRUE;
-}
-/* }}} */
 
-/* {{{ proto bool HaruPage::textOut(double x, double y, string text)
- Print the text on the specified position */
-static PHP_METHOD(HaruPage, textOut)
-{
-	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
-	HPDF_STATUS status;
-	double x, y;
-	zend_string *text;
+	size = HPDF_Page_GetCurrentFontSize(page->h);
+	char_space = HPDF_Page_GetCharSpace(page->h);
+	word_space = HPDF_Page_GetWordSpace(page->h);
+
+	bbox = HPDF_Font_GetBBox(font);
+	ascent = bbox.top / 1000 * size;
+	descent = bbox.bottom / 1000 * size;
+	leading = ascent - descent;
+	top = HPDF_Page_GetHeight(page->h);
+
+	if (zstyle) {
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "x", sizeof("x") - 1)) != NULL) {
+			left = zval_get_double(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "y", sizeof("y") - 1)) != NULL) {
+			top = zval_get_double(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "bottom", sizeof("bottom") - 1)) != NULL) {
+			bottom = zval_get_double(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "start", sizeof("start") - 1)) != NULL) {
+			start = zval_get_long(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "header", sizeof("header") - 1)) != NULL) {
+			header = zval_get_long(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "padding", sizeof("padding") - 1)) != NULL) {
+			padding = zval_get_double(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "leading", sizeof("leading") - 1)) != NULL) {
+			leading = zval_get_double(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "wrap", sizeof("wrap") - 1)) != NULL) {
+			wrap = zend_is_true(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "line_width", sizeof("line_width") - 1)) != NULL) {
+			line_width = zval_get_double(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "grid_color", sizeof("grid_color") - 1)) != NULL) {
+			if (php_haru_array_to_rgb(element, &grid_color) == FAILURE) {
+				zend_throw_exception_ex(ce_haruexception, 0, "Invalid grid_color value, array of 3 elements expected");
+				return;
+			}
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "header_color", sizeof("header_color") - 1)) != NULL) {
+			if (php_haru_array_to_rgb(element, &header_color) == FAILURE) {
+				zend_throw_exception_ex(ce_haruexception, 0, "Invalid header_color value, array of 3 elements expected");
+				return;
+			}
+			has_header_color = 1;
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zstyle), "stripe_color", sizeof("stripe_color") - 1)) != NULL) {
+			if (php_haru_array_to_rgb(element, &stripe_color) == FAILURE) {
+				zend_throw_exception_ex(ce_haruexception, 0, "Invalid stripe_color value, array of 3 elements expected");
+				return;
+			}
+			has_stripe_color = 1;
+		}
+	}
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ddS", &x, &y, &text) == FAILURE) {
+	if (padding < 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid padding value");
+		return;
+	}
+	if (leading <= 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid leading value");
+		return;
+	}
+	if (line_width < 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid line_width value");
+		return;
+	}
+
+	nrows = zend_hash_num_elements(Z_ARRVAL_P(zrows));
+	if (header < 0 || header > nrows) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid header value");
+		return;
+	}
+	/* the data rows begin after the header rows by default */
+	if (start < header) {
+		start = header;
+	}
+
+	ncols = zend_hash_num_elements(Z_ARRVAL_P(zcolumns));
+	if (ncols == 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "No columns given");
 		return;
 	}
 
-	status = HPDF_Page_TextOut(page->h, (HPDF_REAL)x, (HPDF_REAL)y, (const char*)ZSTR_VAL(text));
+	widths = safe_emalloc(ncols, sizeof(double), 0);
+	aligns = safe_emalloc(ncols, sizeof(zend_long), 0);
+	xs = safe_emalloc(ncols + 1, sizeof(double), 0);
+
+	c = 0;
+	xs[0] = left;
+	ZEND_HASH_FOREACH_VAL_IND(Z_ARRVAL_P(zcolumns), element) {
+		aligns[c] = HPDF_TALIGN_LEFT;
+		if (Z_TYPE_P(element) == IS_ARRAY) {
+			zval *value;
+
+			widths[c] = 0;
+			if ((value = zend_hash_str_find(Z_ARRVAL_P(element), "width", sizeof("width") - 1)) != NULL) {
+				widths[c] = zval_get_double(value);
+			}
+			if ((value = zend_hash_str_find(Z_ARRVAL_P(element), "align", sizeof("align") - 1)) != NULL) {
+				aligns[c] = zval_get_long(value);
+			}
+		} else {
+			widths[c] = zval_get_double(element);
+		}
+
+		if (widths[c] <= 2 * padding) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid width of column %d", c);
+			goto cleanup_columns;
+		}
+		if (aligns[c] != HPDF_TALIGN_LEFT && aligns[c] != HPDF_TALIGN_RIGHT && aligns[c] != HPDF_TALIGN_CENTER) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid align value of column %d", c);
+			goto cleanup_columns;
+		}
+		xs[c + 1] = xs[c] + widths[c];
+		c++;
+	} ZEND_HASH_FOREACH_END();
+
+	rows = safe_emalloc(nrows + 1, sizeof(zval *), 0);
+	i = 0;
+	ZEND_HASH_FOREACH_VAL_IND(Z_ARRVAL_P(zrows), element) {
+		if (Z_TYPE_P(element) != IS_ARRAY) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid row at index %d, array expected", i);
+			efree(rows);
+			goto cleanup_columns;
+		}
+		rows[i++] = element;
+	} ZEND_HASH_FOREACH_END();
+
+	row_top = safe_emalloc(nrows + 1, sizeof(double), 0);
+	row_height = safe_emalloc(nrows + 1, sizeof(double), 0);
+	row_index = safe_emalloc(nrows + 1, sizeof(zend_long), 0);
+
+	/* the cell texts, kept until the lines pointing into them are printed */
+	array_init(&strings);
+
+	/* lay the rows out until one does not fit */
+	y = top;
+	next = start;
+	for (i = 0; ; i++) {
+		zend_long r = i < header ? i : start + (i - header);
+		size_t first_line = nlines;
+		int max_lines = 1;
+		double height;
+
+		if (r >= nrows) {
+			break;
+		}
+
+		for (c = 0; c < ncols; c++) {
+			zval *cell = zend_hash_index_find(Z_ARRVAL_P(rows[r]), c);
+			double avail = widths[c] - 2 * padding;
+			zend_string *str;
+			size_t pos = 0, line_start, line_len;
+			zend_bool hard;
+
+			if (!cell) {
+				continue;
+			}
+			str = zval_get_string(cell);
+			add_next_index_str(&strings, str);
+
+			for (n = 0; pos < ZSTR_LEN(str); n++) {
+				line_start = pos;
+				if (!php_haru_break_line(font, size, char_space, word_space, ZSTR_VAL(str), ZSTR_LEN(str), &pos, avail, &line_len, &hard)) {
+					/* the column is too narrow for a single character */
+					break;
+				}
+
+				if (line_len > 0) {
+					double x = xs[c] + padding;
+
+					if (aligns[c] != HPDF_TALIGN_LEFT) {
+						HPDF_TextWidth tw = php_haru_text_width(doc, font, (const HPDF_BYTE *)ZSTR_VAL(str) + line_start, (HPDF_UINT)line_len);
+						double w = tw.width * size / 1000 + word_space * tw.numspace + char_space * tw.numchars;
+
+						x += (aligns[c] == HPDF_TALIGN_RIGHT) ? avail - w : (avail - w) / 2;
+					}
+
+					if (nlines == lines_size) {
+						lines_size = lines_size ? lines_size * 2 : 64;
+						lines = safe_erealloc(lines, lines_size, sizeof(php_haru_table_line), 0);
+					}
+					lines[nlines].text = ZSTR_VAL(str) + line_start;
+					lines[nlines].len = line_len;
+					lines[nlines].x = x;
+					lines[nlines].y = y - padding - ascent - n * leading;
+					nlines++;
+
+					if (line_len >= buf_size) {
+						buf_size = line_len + 1;
+					}
+				}
+
+				if (!wrap) {
+					/* truncated to the first line */
+					n++;
+					break;
+				}
+			}
+
+			if (n > max_lines) {
+				max_lines = n;
+			}
+		}
+
+		height = 2 * padding + (ascent - descent) + (max_lines - 1) * leading;
+		if (y - height < bottom) {
+			/* the row does not fit */
+			nlines = first_line;
+			break;
+		}
+
+		row_top[ndrawn] = y;
+		row_height[ndrawn] = height;
+		row_index[ndrawn] = r;
+		ndrawn++;
+		y -= height;
+
+		if (i >= header) {
+			data_rows++;
+			next = r + 1;
+		}
+	}
+
+	if (data_rows == 0) {
+		/* do not leave the header alone */
+		ndrawn = 0;
+		nlines = 0;
+		y = top;
+	}
+
+#define PHP_HARU_TABLE_OP(call) if (status == HPDF_OK) { status = (call); }
+
+	if (ndrawn > 0) {
+		/* the fills, a single path per color */
+		PHP_HARU_TABLE_OP(HPDF_Page_GSave(page->h));
+		if (has_header_color && header > 0) {
+			PHP_HARU_TABLE_OP(HPDF_Page_SetRGBFill(page->h, header_color.r, header_color.g, header_color.b));
+			for (i = 0; i < header; i++) {
+				PHP_HARU_TABLE_OP(HPDF_Page_Rectangle(page->h, (HPDF_REAL)left, (HPDF_REAL)(row_top[i] - row_height[i]), (HPDF_REAL)(xs[ncols] - left), (HPDF_REAL)row_height[i]));
+			}
+			PHP_HARU_TABLE_OP(HPDF_Page_Fill(page->h));
+		}
+		if (has_stripe_color) {
+			n = 0;
+			for (i = header; i < ndrawn; i++) {
+				if ((row_index[i] - header) % 2 == 1) {
+					if (n++ == 0) {
+						PHP_HARU_TABLE_OP(HPDF_Page_SetRGBFill(page->h, stripe_color.r, stripe_color.g, stripe_color.b));
+					}
+					PHP_HARU_TABLE_OP(HPDF_Page_Rectangle(page->h, (HPDF_REAL)left, (HPDF_REAL)(row_top[i] - row_height[i]), (HPDF_REAL)(xs[ncols] - left), (HPDF_REAL)row_height[i]));
+				}
+			}
+			if (n > 0) {
+				PHP_HARU_TABLE_OP(HPDF_Page_Fill(page->h));
+			}
+		}
+		PHP_HARU_TABLE_OP(HPDF_Page_GRestore(page->h));
+
+		/* the texts, in a single text object */
+		if (nlines > 0) {
+			buf = emalloc(buf_size);
+			PHP_HARU_TABLE_OP(HPDF_Page_BeginText(page->h));
+			for (k = 0; k < nlines && status == HPDF_OK; k++) {
+				memcpy(buf, lines[k].text, lines[k].len);
+				buf[lines[k].len] = '\0';
+				php_haru_subset_record_page(page, buf, lines[k].len);
+				status = HPDF_Page_TextOut(page->h, (HPDF_REAL)lines[k].x, (HPDF_REAL)lines[k].y, buf);
+			}
+			PHP_HARU_TABLE_OP(HPDF_Page_EndText(page->h));
+		}
+
+		/* the grid, a single path */
+		if (line_width > 0) {
+			PHP_HARU_TABLE_OP(HPDF_Page_GSave(page->h));
+			PHP_HARU_TABLE_OP(HPDF_Page_SetLineWidth(page->h, (HPDF_REAL)line_width));
+			PHP_HARU_TABLE_OP(HPDF_Page_SetRGBStroke(page->h, grid_color.r, grid_color.g, grid_color.b));
+			PHP_HARU_TABLE_OP(HPDF_Page_MoveTo(page->h, (HPDF_REAL)left, (HPDF_REAL)top));
+			PHP_HARU_TABLE_OP(HPDF_Page_LineTo(page->h, (HPDF_REAL)xs[ncols], (HPDF_REAL)top));
+			for (i = 0; i < ndrawn; i++) {
+				PHP_HARU_TABLE_OP(HPDF_Page_MoveTo(page->h, (HPDF_REAL)left, (HPDF_REAL)(row_top[i] - row_height[i])));
+				PHP_HARU_TABLE_OP(HPDF_Page_LineTo(page->h, (HPDF_REAL)xs[ncols], (HPDF_REAL)(row_top[i] - row_height[i])));
+			}
+			for (c = 0; c <= ncols; c++) {
+				PHP_HARU_TABLE_OP(HPDF_Page_MoveTo(page->h, (HPDF_REAL)xs[c], (HPDF_REAL)top));
+				PHP_HARU_TABLE_OP(HPDF_Page_LineTo(page->h, (HPDF_REAL)xs[c], (HPDF_REAL)y));
+			}
+			PHP_HARU_TABLE_OP(HPDF_Page_Stroke(page->h));
+			PHP_HARU_TABLE_OP(HPDF_Page_GRestore(page->h));
+		}
+	}
+
+#undef PHP_HARU_TABLE_OP
+
+	if (buf) {
+		efree(buf);
+	}
+	if (lines) {
+		efree(lines);
+	}
+	zval_ptr_dtor(&strings);
+	efree(row_top);
+	efree(row_height);
+	efree(row_index);
+	efree(rows);
+	efree(xs);
+	efree(aligns);
+	efree(widths);
 
 	if (php_haru_status_to_exception(status)) {
 		return;
 	}
-	RETURN_TRUE;
+
+	array_init(return_value);
+	add_assoc_long_ex(return_value, "next", sizeof("next") - 1, next);
+	add_assoc_double_ex(return_value, "y", sizeof("y") - 1, y);
+	add_assoc_long_ex(return_value, "rows", sizeof("rows") - 1, (zend_long)data_rows);
+	return;
+
+cleanup_columns:
+	efree(xs);
+	efree(aligns);
+	efree(widths);
 }
 /* }}} */
 
-/* {{{ proto bool HaruPage::beginText()
- Begin a text object and set the current text position to (0,0) */
-static PHP_METHOD(HaruPage, beginText)
+/* {{{ proto bool HaruPage::addPlaceholder(string name, double x, double y[, array options])
+ Add a text field filled in by HaruDoc::merge() at x, y with the current font, size and fill color;
+ options are the width of the field and the align, left, right or center, of the text in it */
+static PHP_METHOD(HaruPage, addPlaceholder)
 {
 	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
-	HPDF_STATUS status;
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(&page->doc);
+	HPDF_PageAttr attr = (HPDF_PageAttr)page->h->attr;
+	php_haru_placeholder *p;
+	zend_string *name;
+	zval *zoptions = NULL, *element;
+	double x, y, width = 0;
+	zend_long align = HPDF_TALIGN_LEFT;
 
-	if (zend_parse_parameters_none() == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sdd|a", &name, &x, &y, &zoptions) == FAILURE) {
 		return;
 	}
 
-	status = HPDF_Page_BeginText(page->h);
-
-	if (php_haru_status_to_exception(status)) {
+	if (instanceof_function(Z_OBJCE_P(getThis()), ce_harutemplate)) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Cannot add a placeholder to a template");
 		return;
 	}
-	RETURN_TRUE;
-}
-/* }}} */
 
-/* {{{ proto bool HaruPage::endText()
- End current text object */
-static PHP_METHOD(HaruPage, endText)
-{
-	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
-	HPDF_STATUS status;
+	if (attr->gmode == PHP_HARU_GMODE_FLUSHED) {
+		php_haru_status_to_exception(HPDF_PAGE_INVALID_GMODE);
+		return;
+	}
 
-	if (zend_parse_parameters_none() == FAILURE) {
+	if (!attr->gstate->font) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Font is not set");
 		return;
 	}
 
-	status = HPDF_Page_EndText(page->h);
+	if (zoptions) {
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zoptions), "width", sizeof("width") - 1)) != NULL) {
+			width = zval_get_double(element);
+		}
+		if ((element = zend_hash_str_find(Z_ARRVAL_P(zoptions), "align", sizeof("align") - 1)) != NULL) {
+			align = zval_get_long(element);
+		}
+	}
 
-	if (php_haru_status_to_exception(status)) {
+	if (align != HPDF_TALIGN_LEFT && align != HPDF_TALIGN_RIGHT && align != HPDF_TALIGN_CENTER) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid align value");
 		return;
 	}
-	RETURN_TRUE;
-}
-/* }}} */
-
-/* {{{ proto bool HaruPage::textRect(double left, double top, double right, double bottom, string text[, int align ])
- Print the text inside the specified region */
-static PHP_METHOD(HaruPage, textRect)
-{
-	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
-	HPDF_STATUS status;
-	double left, top, right, bottom;
-	zend_string *str;
-	long align = HPDF_TALIGN_LEFT;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ddddS|l", &left, &top, &right, &bottom, &str, &align) == FAILURE) {
+	if (width < 0 || (align != HPDF_TALIGN_LEFT && width == 0)) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid width value");
 		return;
 	}
 
-	switch(align) {
-		case HPDF_TALIGN_LEFT:
-		case HPDF_TALIGN_RIGHT:
-		case HPDF_TALIGN_CENTER:
-		case HPDF_TALIGN_JUSTIFY:
-			/* only these are valid */
-			break;
-		default:
-			zend_throw_exception_ex(ce_haruexception, 0, "Invalid align value");
-			return;
+	if (!doc->placeholders) {
+		ALLOC_HASHTABLE(doc->placeholders);
+		zend_hash_init(doc->placeholders, 8, NULL, php_haru_placeholder_dtor, 0);
 	}
 
-	status = HPDF_Page_TextRect(page->h, (HPDF_REAL)left, (HPDF_REAL)top, (HPDF_REAL)right, (HPDF_REAL)bottom, (const char *)ZSTR_VAL(str), (HPDF_TextAlignment) align, NULL);
+	p = emalloc(sizeof(php_haru_placeholder));
+	p->page = page->h;
+	p->name = zend_string_copy(name);
+	p->font = attr->gstate->font;
+	p->size = attr->gstate->font_size;
+	p->char_space = attr->gstate->char_space;
+	p->word_space = attr->gstate->word_space;
+	p->x = x;
+	p->y = y;
+	p->width = width;
+	p->align = align;
+	p->color = HPDF_Page_GetRGBFill(page->h);
+	zend_hash_next_index_insert_ptr(doc->placeholders, p);
 
-	if (php_haru_status_to_exception(status)) {
-		return;
-	}
 	RETURN_TRUE;
 }
 /* }}} */
@@ -3446,14 +7879,29 @@ static PHP_METHOD(HaruPage, createURLAnnotation)
 static PHP_METHOD(HaruPage, getTextWidth)
 {
 	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(&page->doc);
+	HPDF_PageAttr attr = (HPDF_PageAttr)page->h->attr;
+	HPDF_TextWidth tw;
 	HPDF_REAL width;
 	zend_string *str;
+	size_t len;
 
 	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &str) == FAILURE) {
 		return;
 	}
 
-	width = HPDF_Page_TextWidth(page->h, (const char *)ZSTR_VAL(str));
+	if (!attr->gstate->font) {
+		php_haru_status_to_exception(HPDF_PAGE_FONT_NOT_FOUND);
+		return;
+	}
+
+	/* same as HPDF_Page_TextWidth(), the text ends at the first NUL */
+	len = strlen(ZSTR_VAL(str));
+	if (len > HPDF_LIMIT_MAX_STRING_LEN) {
+		len = HPDF_LIMIT_MAX_STRING_LEN;
+	}
+	tw = php_haru_text_width(doc, attr->gstate->font, (const HPDF_BYTE *)ZSTR_VAL(str), (HPDF_UINT)len);
+	width = attr->gstate->word_space * tw.numspace + tw.width * attr->gstate->font_size / 1000 + attr->gstate->char_space * tw.numchars;
 
 	if (php_haru_check_error(page->h->error)) {
 		return;
@@ -3485,6 +7933,37 @@ static PHP_METHOD(HaruPage, MeasureText)
 }
 /* }}} */
 
+/* {{{ proto int HaruPage::MeasureTextUTF8(string text, double width[, bool wordwrap])
+ Calculate the number of bytes of the UTF-8 text which can be included within the specified width */
+static PHP_METHOD(HaruPage, MeasureTextUTF8)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_UINT result;
+	double width;
+	zend_bool wordwrap = 0;
+	zend_string *str, *encoded;
+	uint32_t *offsets;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sd|b", &str, &width, &wordwrap) == FAILURE) {
+		return;
+	}
+
+	if ((encoded = php_haru_page_utf8(page, str, &offsets)) == NULL) {
+		return;
+	}
+
+	result = HPDF_Page_MeasureText(page->h, (const char *)ZSTR_VAL(encoded), (HPDF_REAL)width, (HPDF_BOOL)wordwrap, NULL);
+	result = offsets[MIN(result, ZSTR_LEN(encoded))];
+	efree(offsets);
+	zend_string_release(encoded);
+
+	if (php_haru_check_error(page->h->error)) {
+		return;
+	}
+	RETURN_LONG(result);
+}
+/* }}} */
+
 /* {{{ proto int HaruPage::getGMode()
  Get the current graphics mode */
 static PHP_METHOD(HaruPage, getGMode)
@@ -4126,6 +8605,194 @@ static PHP_METHOD(HaruPage, setZoom)
 /* }}} */
 #endif
 
+/* {{{ proto int HaruPage::drawOps(mixed ops)
+ Execute a sequence of drawing operations given as an array or a string of packed doubles,
+ return -1 on success or the index of the first failed operation */
+static PHP_METHOD(HaruPage, drawOps)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	zval *zops;
+	double *ops;
+	size_t count, pos, n;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z", &zops) == FAILURE) {
+		return;
+	}
+
+	ops = php_haru_zval_to_doubles(zops, &count);
+	if (!ops) {
+		return;
+	}
+
+	/* validate the whole sequence first, so malformed input draws nothing */
+	for (pos = 0; pos < count; pos += 1 + php_haru_op_args[(int)ops[pos]]) {
+		double op = ops[pos];
+
+		if (op < 1 || op >= PHP_HARU_OP_LAST || op != (double)(int)op) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid operation code at offset %zu", pos);
+			efree(ops);
+			return;
+		}
+		if (count - pos - 1 < php_haru_op_args[(int)op]) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Missing arguments of the operation at offset %zu", pos);
+			efree(ops);
+			return;
+		}
+	}
+
+	for (pos = 0, n = 0; pos < count; pos += 1 + php_haru_op_args[(int)ops[pos]], n++) {
+		status = php_haru_page_exec_op(page->h, (int)ops[pos], ops + pos + 1);
+
+		if (status != HPDF_OK) {
+			/* the failure is reported by the return value */
+			HPDF_Error_Reset(page->h->error);
+			efree(ops);
+			RETURN_LONG((zend_long)n);
+		}
+	}
+
+	efree(ops);
+	RETURN_LONG(-1);
+}
+/* }}} */
+
+/* emit the points as one path, skipping the ones closer than tolerance in
+ * device space to the last point drawn; the last point is always drawn */
+static void php_haru_page_poly(INTERNAL_FUNCTION_PARAMETERS, int close) /* {{{ */
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	HPDF_STATUS status;
+	HPDF_TransMatrix m;
+	zval *zpoints;
+	double *points, tolerance = 0, last_x, last_y;
+	size_t count, i, drawn;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z|d", &zpoints, &tolerance) == FAILURE) {
+		return;
+	}
+
+	if (tolerance < 0) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid tolerance value");
+		return;
+	}
+
+	points = php_haru_zval_to_doubles(zpoints, &count);
+	if (!points) {
+		return;
+	}
+
+	if (count % 2 != 0 || count < 4) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Expected at least 2 points given as x, y pairs");
+		efree(points);
+		return;
+	}
+
+	m = HPDF_Page_GetTransMatrix(page->h);
+	tolerance *= tolerance;
+
+	status = HPDF_Page_MoveTo(page->h, (HPDF_REAL)points[0], (HPDF_REAL)points[1]);
+	last_x = points[0];
+	last_y = points[1];
+	drawn = 1;
+
+	for (i = 2; i < count && status == HPDF_OK; i += 2) {
+		double x = points[i], y = points[i + 1];
+
+		if (tolerance > 0 && i + 2 < count) {
+			/* the distance in device space, through the linear part of the CTM */
+			double dx = x - last_x, dy = y - last_y;
+			double ux = m.a * dx + m.c * dy, uy = m.b * dx + m.d * dy;
+
+			if (ux * ux + uy * uy < tolerance) {
+				continue;
+			}
+		}
+
+		status = HPDF_Page_LineTo(page->h, (HPDF_REAL)x, (HPDF_REAL)y);
+		last_x = x;
+		last_y = y;
+		drawn++;
+	}
+
+	if (close && status == HPDF_OK) {
+		status = HPDF_Page_ClosePath(page->h);
+	}
+
+	efree(points);
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_LONG((zend_long)drawn);
+}
+/* }}} */
+
+/* {{{ proto int HaruPage::polyline(mixed points[, double tolerance])
+ Append lines through the points given as an array or a string of packed doubles x0, y0, x1, y1, ... to the path,
+ dropping points within tolerance of the previous one in device space; return the number of points used */
+static PHP_METHOD(HaruPage, polyline)
+{
+	php_haru_page_poly(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+}
+/* }}} */
+
+/* {{{ proto int HaruPage::polygon(mixed points[, double tolerance])
+ Same as polyline(), but close the path; return the number of points used */
+static PHP_METHOD(HaruPage, polygon)
+{
+	php_haru_page_poly(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+}
+/* }}} */
+
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20200
+/* {{{ proto bool HaruPage::drawTemplate(object template, double x, double y[, double scale_x[, double scale_y]])
+ Place the template on the page at the specified position */
+static PHP_METHOD(HaruPage, drawTemplate)
+{
+	php_harupage *page = Z_HARUPAGE_OBJ_P(getThis());
+	php_harupage *tpl;
+	HPDF_STATUS status;
+	zval *z_tpl;
+	double x, y, scale_x = 1, scale_y;
+	HPDF_XObject form;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "Odd|dd", &z_tpl, ce_harutemplate, &x, &y, &scale_x, &scale_y) == FAILURE) {
+		return;
+	}
+
+	if (ZEND_NUM_ARGS() < 5) {
+		scale_y = scale_x;
+	}
+
+	tpl = Z_HARUPAGE_OBJ_P(z_tpl);
+
+	if (tpl->h == page->h) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Cannot draw a template into itself");
+		return;
+	}
+
+	form = ((HPDF_PageAttr)tpl->h->attr)->contents;
+
+	status = HPDF_Page_GSave(page->h);
+	if (status == HPDF_OK) {
+		status = HPDF_Page_Concat(page->h, (HPDF_REAL)scale_x, 0, 0, (HPDF_REAL)scale_y, (HPDF_REAL)x, (HPDF_REAL)y);
+	}
+	if (status == HPDF_OK) {
+		status = HPDF_Page_ExecuteXObject(page->h, form);
+	}
+	if (status == HPDF_OK) {
+		status = HPDF_Page_GRestore(page->h);
+	}
+
+	if (php_haru_status_to_exception(status)) {
+		return;
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+#endif
+
 /* }}} */
 
 /* HaruImage methods {{{ */
@@ -4389,6 +9056,7 @@ static PHP_METHOD(HaruFont, getEncodingName)
 static PHP_METHOD(HaruFont, getUnicodeWidth)
 {
 	php_harufont *font = Z_HARUFONT_OBJ_P(getThis());
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(&font->doc);
 
 	HPDF_INT width;
 	zend_long character;
@@ -4397,7 +9065,7 @@ static PHP_METHOD(HaruFont, getUnicodeWidth)
 		return;
 	}
 
-	width = HPDF_Font_GetUnicodeWidth(font->h, (HPDF_UINT16)character);
+	width = php_haru_unicode_width(doc, font->h, (HPDF_UNICODE)character);
 
 	if (php_haru_check_error(font->h->error)) {
 		return;
@@ -4481,63 +9149,158 @@ static PHP_METHOD(HaruFont, getCapHeight)
 		return;
 	}
 
-	cap_height = HPDF_Font_GetCapHeight(font->h);
+	cap_height = HPDF_Font_GetCapHeight(font->h);
+
+	if (php_haru_check_error(font->h->error)) {
+		return;
+	}
+	RETURN_LONG((long)cap_height);
+}
+/* }}} */
+
+/* {{{ proto array HaruFont::getTextWidth(string text)
+ Get the total width of the text, number of characters, number of words and number of spaces */
+static PHP_METHOD(HaruFont, getTextWidth)
+{
+	php_harufont *font = Z_HARUFONT_OBJ_P(getThis());
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(&font->doc);
+
+	zend_string *str;
+	HPDF_TextWidth width;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &str) == FAILURE) {
+		return;
+	}
+
+	width = php_haru_text_width(doc, font->h, (const HPDF_BYTE *)ZSTR_VAL(str), (HPDF_UINT)ZSTR_LEN(str));
+
+	if (php_haru_check_error(font->h->error)) {
+		return;
+	}
+
+	array_init(return_value);
+	add_assoc_long_ex(return_value, "numchars", sizeof("numchars") - 1, (zend_long) width.numchars);
+	add_assoc_long_ex(return_value, "numwords", sizeof("numwords") - 1, (zend_long) width.numwords);
+	add_assoc_long_ex(return_value, "width", sizeof("width") - 1, (zend_long) width.width);
+	add_assoc_long_ex(return_value, "numspace", sizeof("numspace") - 1, (zend_long) width.numspace);
+}
+/* }}} */
+
+/* {{{ proto int HaruFont::MeasureText(string text, double width, double font_size, double char_space, double word_space[, bool word_wrap])
+ Calculate the number of characters which can be included within the specified width */
+static PHP_METHOD(HaruFont, MeasureText)
+{
+	php_harufont *font = Z_HARUFONT_OBJ_P(getThis());
+
+	int result;
+	double width, font_size, char_space, word_space;
+	zend_bool wordwrap = 0;
+	zend_string *str;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sdddd|b", &str, &width, &font_size, &char_space, &word_space, &wordwrap) == FAILURE) {
+		return;
+	}
+
+	result = HPDF_Font_MeasureText(font->h, (const HPDF_BYTE *)ZSTR_VAL(str), (HPDF_UINT)ZSTR_LEN(str), (HPDF_REAL)width, (HPDF_REAL)font_size, (HPDF_REAL)char_space, (HPDF_REAL)word_space, (HPDF_BOOL)wordwrap, NULL);
+
+	if (php_haru_check_error(font->h->error)) {
+		return;
+	}
+	RETURN_LONG(result);
+}
+/* }}} */
+
+/* {{{ proto int HaruFont::MeasureTextUTF8(string text, double width, double font_size, double char_space, double word_space[, bool word_wrap])
+ Calculate the number of bytes of the UTF-8 text which can be included within the specified width */
+static PHP_METHOD(HaruFont, MeasureTextUTF8)
+{
+	php_harufont *font = Z_HARUFONT_OBJ_P(getThis());
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(&font->doc);
+
+	HPDF_UINT result;
+	double width, font_size, char_space, word_space;
+	zend_bool wordwrap = 0;
+	zend_string *str, *encoded;
+	uint32_t *offsets;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sdddd|b", &str, &width, &font_size, &char_space, &word_space, &wordwrap) == FAILURE) {
+		return;
+	}
+
+	if ((encoded = php_haru_utf8_to_font(doc, font->h, str, &offsets)) == NULL) {
+		return;
+	}
+
+	result = HPDF_Font_MeasureText(font->h, (const HPDF_BYTE *)ZSTR_VAL(encoded), (HPDF_UINT)ZSTR_LEN(encoded), (HPDF_REAL)width, (HPDF_REAL)font_size, (HPDF_REAL)char_space, (HPDF_REAL)word_space, (HPDF_BOOL)wordwrap, NULL);
+	result = offsets[MIN(result, ZSTR_LEN(encoded))];
+	efree(offsets);
+	zend_string_release(encoded);
 
 	if (php_haru_check_error(font->h->error)) {
 		return;
 	}
-	RETURN_LONG((long)cap_height);
+	RETURN_LONG(result);
 }
 /* }}} */
 
-/* {{{ proto array HaruFont::getTextWidth(string text)
- Get the total width of the text, number of characters, number of words and number of spaces */
-static PHP_METHOD(HaruFont, getTextWidth)
+/* {{{ proto mixed HaruFont::measureMany(array strings, double font_size[, double char_space[, double word_space[, bool packed]]])
+ Get the widths of the texts in points as an array or a string of packed doubles */
+static PHP_METHOD(HaruFont, measureMany)
 {
 	php_harufont *font = Z_HARUFONT_OBJ_P(getThis());
+	php_harudoc *doc = Z_HARUDOC_OBJ_P(&font->doc);
 
-	zend_string *str;
-	HPDF_TextWidth width;
+	zval *strings, *element;
+	double size, char_space = 0, word_space = 0;
+	zend_bool packed = 0;
+	zend_string *result = NULL;
+	double *out = NULL;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &str) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ad|ddb", &strings, &size, &char_space, &word_space, &packed) == FAILURE) {
 		return;
 	}
 
-	width = HPDF_Font_TextWidth(font->h, (const HPDF_BYTE *)ZSTR_VAL(str), (HPDF_UINT)ZSTR_LEN(str));
-
-	if (php_haru_check_error(font->h->error)) {
-		return;
+	if (packed) {
+		result = zend_string_safe_alloc(zend_hash_num_elements(Z_ARRVAL_P(strings)), sizeof(double), 0, 0);
+		out = (double *)ZSTR_VAL(result);
+	} else {
+		array_init_size(return_value, zend_hash_num_elements(Z_ARRVAL_P(strings)));
 	}
 
-	array_init(return_value);
-	add_assoc_long_ex(return_value, "numchars", sizeof("numchars") - 1, (zend_long) width.numchars);
-	add_assoc_long_ex(return_value, "numwords", sizeof("numwords") - 1, (zend_long) width.numwords);
-	add_assoc_long_ex(return_value, "width", sizeof("width") - 1, (zend_long) width.width);
-	add_assoc_long_ex(return_value, "numspace", sizeof("numspace") - 1, (zend_long) width.numspace);
-}
-/* }}} */
-
-/* {{{ proto int HaruFont::MeasureText(string text, double width, double font_size, double char_space, double word_space[, bool word_wrap])
- Calculate the number of characters which can be included within the specified width */
-static PHP_METHOD(HaruFont, MeasureText)
-{
-	php_harufont *font = Z_HARUFONT_OBJ_P(getThis());
+	ZEND_HASH_FOREACH_VAL_IND(Z_ARRVAL_P(strings), element) {
+		zend_string *str;
+		HPDF_TextWidth tw;
+		double width;
 
-	int result;
-	double width, font_size, char_space, word_space;
-	zend_bool wordwrap = 0;
-	zend_string *str;
+		if (Z_TYPE_P(element) == IS_STRING) {
+			tw = php_haru_text_width(doc, font->h, (const HPDF_BYTE *)Z_STRVAL_P(element), (HPDF_UINT)Z_STRLEN_P(element));
+		} else {
+			str = zval_get_string(element);
+			tw = php_haru_text_width(doc, font->h, (const HPDF_BYTE *)ZSTR_VAL(str), (HPDF_UINT)ZSTR_LEN(str));
+			zend_string_release(str);
+		}
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sdddd|b", &str, &width, &font_size, &char_space, &word_space, &wordwrap) == FAILURE) {
-		return;
-	}
+		/* same as HPDF_Page_TextWidth() */
+		width = tw.width * size / 1000 + word_space * tw.numspace + char_space * tw.numchars;
 
-	result = HPDF_Font_MeasureText(font->h, (const HPDF_BYTE *)ZSTR_VAL(str), (HPDF_UINT)ZSTR_LEN(str), (HPDF_REAL)width, (HPDF_REAL)font_size, (HPDF_REAL)char_space, (HPDF_REAL)word_space, (HPDF_BOOL)wordwrap, NULL);
+		if (packed) {
+			*out++ = width;
+		} else {
+			add_next_index_double(return_value, width);
+		}
+	} ZEND_HASH_FOREACH_END();
 
 	if (php_haru_check_error(font->h->error)) {
+		if (result) {
+			zend_string_free(result);
+		}
 		return;
 	}
-	RETURN_LONG(result);
+
+	if (packed) {
+		ZSTR_VAL(result)[ZSTR_LEN(result)] = '\0';
+		RETURN_NEW_STR(result);
+	}
 }
 /* }}} */
 
@@ -4996,10 +9759,249 @@ static PHP_METHOD(HaruOutline, setDestination)
 
 /* }}} */
 
+/* HaruZip methods {{{ */
+
+/* {{{ proto void HaruZip::__construct(mixed stream)
+ Construct new HaruZip instance writing the archive into a PHP stream resource or a stream wrapper URL */
+static PHP_METHOD(HaruZip, __construct)
+{
+	php_haruzip *zip = Z_HARUZIP_OBJ_P(getThis());
+	php_stream *stream;
+	zval *ztarget;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z", &ztarget) == FAILURE) {
+		return;
+	}
+
+	if (Z_TYPE(zip->stream) != IS_UNDEF) {
+		/* called __construct() twice, bail out */
+		return;
+	}
+
+	if (Z_TYPE_P(ztarget) == IS_RESOURCE) {
+		stream = (php_stream *)zend_fetch_resource2_ex(ztarget, NULL, php_file_le_stream(), php_file_le_pstream());
+		if (!stream) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Invalid stream resource");
+			return;
+		}
+		ZVAL_COPY(&zip->stream, ztarget);
+	} else {
+		convert_to_string_ex(ztarget);
+
+		zend_replace_error_handling(EH_THROW, ce_haruexception, NULL);
+		stream = php_stream_open_wrapper(Z_STRVAL_P(ztarget), "wb", REPORT_ERRORS, NULL);
+		zend_replace_error_handling(EH_NORMAL, NULL, NULL);
+
+		if (!stream) {
+			return;
+		}
+		php_stream_to_zval(stream, &zip->stream);
+		zip->owned = 1;
+	}
+}
+/* }}} */
+
+/* {{{ proto bool HaruZip::addDocument(string name, object doc[, int level])
+ Save the document into a new entry of the archive, deflated with the compression level from 0 to 9 */
+static PHP_METHOD(HaruZip, addDocument)
+{
+	php_haruzip *zip = Z_HARUZIP_OBJ_P(getThis());
+	php_harudoc *doc;
+	php_haru_zip_entry entry;
+	php_haru_writer writer = {0};
+	HPDF_STATUS status;
+	zend_string *name;
+	zval *zdoc;
+	zend_long level = Z_DEFAULT_COMPRESSION;
+	uint16_t dos_time, dos_date;
+	char header[46];
+	int result;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "SO|l", &name, &zdoc, ce_harudoc, &level) == FAILURE) {
+		return;
+	}
+
+	if (zip->closed || Z_TYPE(zip->stream) == IS_UNDEF) {
+		zend_throw_exception_ex(ce_haruexception, 0, "The archive is closed");
+		return;
+	}
+
+	if (ZSTR_LEN(name) == 0 || ZSTR_LEN(name) > 0xffff) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Invalid entry name");
+		return;
+	}
+
+	if (level < Z_DEFAULT_COMPRESSION || level > 9) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Compression level must be in range -1..9");
+		return;
+	}
+
+	if (zip->count == 0xffff || zip->offset > PHP_HARU_ZIP_MAX) {
+		zend_throw_exception_ex(ce_haruexception, 0, "The archive is full, ZIP64 is not supported");
+		return;
+	}
+
+	memset(&entry, 0, sizeof(entry));
+	entry.stream = (php_stream *)zend_fetch_resource2_ex(&zip->stream, NULL, php_file_le_stream(), php_file_le_pstream());
+	if (!entry.stream) {
+		zend_throw_exception_ex(ce_haruexception, 0, "The stream of the archive is closed");
+		return;
+	}
+
+	doc = Z_HARUDOC_OBJ_P(zdoc);
+	php_haru_zip_dostime(&dos_time, &dos_date);
+
+	/* local file header, the sizes and the CRC follow the data */
+	php_haru_zip_put32(header, 0x04034b50);
+	php_haru_zip_put16(header + 4, PHP_HARU_ZIP_VERSION);
+	php_haru_zip_put16(header + 6, PHP_HARU_ZIP_FLAGS);
+	php_haru_zip_put16(header + 8, Z_DEFLATED);
+	php_haru_zip_put16(header + 10, dos_time);
+	php_haru_zip_put16(header + 12, dos_date);
+	memset(header + 14, 0, 12);
+	php_haru_zip_put16(header + 26, (uint16_t)ZSTR_LEN(name));
+	php_haru_zip_put16(header + 28, 0);
+
+	if (php_stream_write(entry.stream, header, 30) != 30 ||
+			php_stream_write(entry.stream, ZSTR_VAL(name), ZSTR_LEN(name)) != ZSTR_LEN(name)) {
+		zip->closed = 1;
+		zend_throw_exception_ex(ce_haruexception, 0, "Failed to write into the archive");
+		return;
+	}
+
+	if (deflateInit2(&entry.zs, (int)level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		zip->closed = 1;
+		zend_throw_exception_ex(ce_haruexception, 0, "Failed to initialize deflate");
+		return;
+	}
+	entry.crc = crc32(0L, Z_NULL, 0);
+	entry.out = emalloc(PHP_HARU_BUF_SIZE);
+
+	writer.write = php_haru_zip_write;
+	writer.ctx = &entry;
+	writer.buf_size = PHP_HARU_BUF_SIZE;
+
+	status = php_haru_save_to_writer(doc, &writer);
+
+	result = status == HPDF_OK ? php_haru_zip_deflate(&entry, NULL, 0, Z_FINISH) : FAILURE;
+	deflateEnd(&entry.zs);
+	efree(entry.out);
+
+	if (result == SUCCESS && (entry.size > PHP_HARU_ZIP_MAX || entry.written > PHP_HARU_ZIP_MAX)) {
+		zend_throw_exception_ex(ce_haruexception, 0, "The document is too large, ZIP64 is not supported");
+		result = FAILURE;
+	}
+
+	if (result == SUCCESS) {
+		/* data descriptor */
+		php_haru_zip_put32(header, 0x08074b50);
+		php_haru_zip_put32(header + 4, (uint32_t)entry.crc);
+		php_haru_zip_put32(header + 8, (uint32_t)entry.written);
+		php_haru_zip_put32(header + 12, (uint32_t)entry.size);
+
+		if (php_stream_write(entry.stream, header, 16) != 16) {
+			result = FAILURE;
+		}
+	}
+
+	if (result == FAILURE) {
+		/* a partial entry is in the archive, it can not be completed anymore */
+		zip->closed = 1;
+		if (!EG(exception) && !php_haru_status_to_exception(status)) {
+			zend_throw_exception_ex(ce_haruexception, 0, "Failed to write into the archive");
+		}
+		return;
+	}
+
+	/* central directory header */
+	php_haru_zip_put32(header, 0x02014b50);
+	php_haru_zip_put16(header + 4, PHP_HARU_ZIP_VERSION);
+	php_haru_zip_put16(header + 6, PHP_HARU_ZIP_VERSION);
+	php_haru_zip_put16(header + 8, PHP_HARU_ZIP_FLAGS);
+	php_haru_zip_put16(header + 10, Z_DEFLATED);
+	php_haru_zip_put16(header + 12, dos_time);
+	php_haru_zip_put16(header + 14, dos_date);
+	php_haru_zip_put32(header + 16, (uint32_t)entry.crc);
+	php_haru_zip_put32(header + 20, (uint32_t)entry.written);
+	php_haru_zip_put32(header + 24, (uint32_t)entry.size);
+	php_haru_zip_put16(header + 28, (uint16_t)ZSTR_LEN(name));
+	memset(header + 30, 0, 12);
+	php_haru_zip_put32(header + 42, (uint32_t)zip->offset);
+
+	smart_str_appendl(&zip->central, header, 46);
+	smart_str_appendl(&zip->central, ZSTR_VAL(name), ZSTR_LEN(name));
+
+	zip->offset += 30 + ZSTR_LEN(name) + entry.written + 16;
+	zip->count++;
+
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool HaruZip::close()
+ Write the central directory ending the archive, close the stream if it was opened by HaruZip */
+static PHP_METHOD(HaruZip, close)
+{
+	php_haruzip *zip = Z_HARUZIP_OBJ_P(getThis());
+	php_stream *stream;
+	size_t size = zip->central.s ? ZSTR_LEN(zip->central.s) : 0;
+	char footer[22];
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	if (zip->closed || Z_TYPE(zip->stream) == IS_UNDEF) {
+		zend_throw_exception_ex(ce_haruexception, 0, "The archive is closed");
+		return;
+	}
+	zip->closed = 1;
+
+	if (zip->offset + size > PHP_HARU_ZIP_MAX) {
+		zend_throw_exception_ex(ce_haruexception, 0, "The archive is too large, ZIP64 is not supported");
+		return;
+	}
+
+	stream = (php_stream *)zend_fetch_resource2_ex(&zip->stream, NULL, php_file_le_stream(), php_file_le_pstream());
+	if (!stream) {
+		zend_throw_exception_ex(ce_haruexception, 0, "The stream of the archive is closed");
+		return;
+	}
+
+	/* end of central directory record */
+	php_haru_zip_put32(footer, 0x06054b50);
+	php_haru_zip_put16(footer + 4, 0);
+	php_haru_zip_put16(footer + 6, 0);
+	php_haru_zip_put16(footer + 8, (uint16_t)zip->count);
+	php_haru_zip_put16(footer + 10, (uint16_t)zip->count);
+	php_haru_zip_put32(footer + 12, (uint32_t)size);
+	php_haru_zip_put32(footer + 16, (uint32_t)zip->offset);
+	php_haru_zip_put16(footer + 20, 0);
+
+	if ((size && php_stream_write(stream, ZSTR_VAL(zip->central.s), size) != size) ||
+			php_stream_write(stream, footer, 22) != 22) {
+		zend_throw_exception_ex(ce_haruexception, 0, "Failed to write into the archive");
+		return;
+	}
+	smart_str_free(&zip->central);
+
+	if (zip->owned) {
+		zend_list_close(Z_RES(zip->stream));
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* }}} */
+
 /* {{{ arginfo */
 ZEND_BEGIN_ARG_INFO(arginfo_harudoc___void, 0)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc___construct, 0, 0, 0)
+	ZEND_ARG_INFO(0, mem_pool_buf_size)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_insertpage, 0, 0, 1)
 	ZEND_ARG_INFO(0, page)
 ZEND_END_ARG_INFO()
@@ -5012,6 +10014,11 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_save, 0, 0, 1)
 	ZEND_ARG_INFO(0, file)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_savetophpstream, 0, 0, 1)
+	ZEND_ARG_INFO(0, stream)
+	ZEND_ARG_INFO(0, buffer_size)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_readfromstream, 0, 0, 1)
 	ZEND_ARG_INFO(0, bytes)
 ZEND_END_ARG_INFO()
@@ -5083,6 +10090,50 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_loadraw, 0, 0, 4)
 	ZEND_ARG_INFO(0, color_space)
 ZEND_END_ARG_INFO()
 
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20200
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_loadimagefromstring, 0, 0, 1)
+	ZEND_ARG_INFO(0, data)
+ZEND_END_ARG_INFO()
+#endif
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_loadrawfromstring, 0, 0, 4)
+	ZEND_ARG_INFO(0, data)
+	ZEND_ARG_INFO(0, width)
+	ZEND_ARG_INFO(0, height)
+	ZEND_ARG_INFO(0, color_space)
+	ZEND_ARG_INFO(0, bits_per_component)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_flushpage, 0, 0, 0)
+	ZEND_ARG_INFO(0, page)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_setautoflush, 0, 0, 1)
+	ZEND_ARG_INFO(0, enable)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_setforkable, 0, 0, 1)
+	ZEND_ARG_INFO(0, enable)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_setimagededuplication, 0, 0, 1)
+	ZEND_ARG_INFO(0, enable)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_setfontsubsetting, 0, 0, 1)
+	ZEND_ARG_INFO(0, enable)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_savetocallback, 0, 0, 1)
+	ZEND_ARG_INFO(0, callback)
+	ZEND_ARG_INFO(0, buffer_size)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_merge, 0, 0, 2)
+	ZEND_ARG_INFO(0, records)
+	ZEND_ARG_INFO(0, output)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_setpassword, 0, 0, 2)
 	ZEND_ARG_INFO(0, owner_password)
 	ZEND_ARG_INFO(0, user_password)
@@ -5101,6 +10152,12 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_setcompressionmode, 0, 0, 1)
 	ZEND_ARG_INFO(0, mode)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_setcompressionlevel, 0, 0, 1)
+	ZEND_ARG_INFO(0, level)
+	ZEND_ARG_INFO(0, strategy)
+	ZEND_ARG_INFO(0, streams)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_setpagesconfiguration, 0, 0, 1)
 	ZEND_ARG_INFO(0, page_per_pages)
 ZEND_END_ARG_INFO()
@@ -5358,6 +10415,12 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_harupage_gettextwidth, 0, 0, 1)
 	ZEND_ARG_INFO(0, text)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harupage_layouttext, 0, 0, 2)
+	ZEND_ARG_INFO(0, text)
+	ZEND_ARG_INFO(0, box)
+	ZEND_ARG_INFO(0, options)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_harupage_measuretext, 0, 0, 2)
 	ZEND_ARG_INFO(0, text)
 	ZEND_ARG_INFO(0, width)
@@ -5376,6 +10439,43 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_harupage_setzoom, 0, 0, 1)
 ZEND_END_ARG_INFO()
 #endif
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harupage_drawops, 0, 0, 1)
+	ZEND_ARG_INFO(0, ops)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harupage_drawtable, 0, 0, 2)
+	ZEND_ARG_INFO(0, rows)
+	ZEND_ARG_INFO(0, columns)
+	ZEND_ARG_INFO(0, style)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harupage_addplaceholder, 0, 0, 3)
+	ZEND_ARG_INFO(0, name)
+	ZEND_ARG_INFO(0, x)
+	ZEND_ARG_INFO(0, y)
+	ZEND_ARG_INFO(0, options)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harupage_polyline, 0, 0, 1)
+	ZEND_ARG_INFO(0, points)
+	ZEND_ARG_INFO(0, tolerance)
+ZEND_END_ARG_INFO()
+
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20200
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harupage_drawtemplate, 0, 0, 3)
+	ZEND_ARG_INFO(0, template)
+	ZEND_ARG_INFO(0, x)
+	ZEND_ARG_INFO(0, y)
+	ZEND_ARG_INFO(0, scale_x)
+	ZEND_ARG_INFO(0, scale_y)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harudoc_createtemplate, 0, 0, 2)
+	ZEND_ARG_INFO(0, width)
+	ZEND_ARG_INFO(0, height)
+ZEND_END_ARG_INFO()
+#endif
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_haruimage_setcolormask, 0, 0, 6)
 	ZEND_ARG_INFO(0, rmin)
 	ZEND_ARG_INFO(0, rmax)
@@ -5403,6 +10503,14 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_harufont_gettextwidth, 0, 0, 1)
 	ZEND_ARG_INFO(0, text)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_harufont_measuremany, 0, 0, 2)
+	ZEND_ARG_INFO(0, strings)
+	ZEND_ARG_INFO(0, font_size)
+	ZEND_ARG_INFO(0, char_space)
+	ZEND_ARG_INFO(0, word_space)
+	ZEND_ARG_INFO(0, packed)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_harufont_measuretext, 0, 0, 5)
 	ZEND_ARG_INFO(0, text)
 	ZEND_ARG_INFO(0, width)
@@ -5475,23 +10583,45 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO_EX(arginfo_haruoutline_setdestination, 0, 0, 1)
 	ZEND_ARG_INFO(0, destination)
 ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_haruzip___construct, 0, 0, 1)
+	ZEND_ARG_INFO(0, stream)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_haruzip_adddocument, 0, 0, 2)
+	ZEND_ARG_INFO(0, name)
+	ZEND_ARG_INFO(0, doc)
+	ZEND_ARG_INFO(0, level)
+ZEND_END_ARG_INFO()
 /* }}} */
 
 
 /* class method tables {{{ */
 
 static zend_function_entry harudoc_methods[] = { /* {{{ */
-	PHP_ME(HaruDoc, __construct, 			arginfo_harudoc___void, 				ZEND_ACC_CTOR|ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, __construct, 			arginfo_harudoc___construct, 			ZEND_ACC_CTOR|ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, setForkable, 			arginfo_harudoc_setforkable, 			ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, fork, 					arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, resetError, 			arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, save, 					arginfo_harudoc_save, 					ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, output, 				arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, saveToPhpStream, 		arginfo_harudoc_savetophpstream, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, saveToStream, 			arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, saveToCallback, 		arginfo_harudoc_savetocallback, 		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, toString, 				arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, merge, 					arginfo_harudoc_merge, 					ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, resetStream, 			arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, getStreamSize, 			arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, readFromStream, 		arginfo_harudoc_readfromstream, 		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, getStats, 				arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, addPage, 				arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, insertPage, 			arginfo_harudoc_insertpage, 			ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, getCurrentPage, 		arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, flushPage, 				arginfo_harudoc_flushpage, 				ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, setAutoFlush, 			arginfo_harudoc_setautoflush, 			ZEND_ACC_PUBLIC)
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20200
+	PHP_ME(HaruDoc, createTemplate, 		arginfo_harudoc_createtemplate, 		ZEND_ACC_PUBLIC)
+#endif
 	PHP_ME(HaruDoc, getEncoder, 			arginfo_harudoc_setcurrentencoder, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, getCurrentEncoder, 		arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, setCurrentEncoder, 		arginfo_harudoc_setcurrentencoder, 		ZEND_ACC_PUBLIC)
@@ -5509,10 +10639,18 @@ static zend_function_entry harudoc_methods[] = { /* {{{ */
 	PHP_ME(HaruDoc, loadPNG, 				arginfo_harudoc_loadpng, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, loadJPEG, 				arginfo_harudoc_loadjpeg, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, loadRaw, 				arginfo_harudoc_loadraw, 				ZEND_ACC_PUBLIC)
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20200
+	PHP_ME(HaruDoc, loadPNGFromString, 		arginfo_harudoc_loadimagefromstring, 	ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, loadJPEGFromString, 	arginfo_harudoc_loadimagefromstring, 	ZEND_ACC_PUBLIC)
+#endif
+	PHP_ME(HaruDoc, loadRawFromString, 		arginfo_harudoc_loadrawfromstring, 		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, setImageDeduplication, 	arginfo_harudoc_setimagededuplication, 	ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, setFontSubsetting, 		arginfo_harudoc_setfontsubsetting, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, setPassword, 			arginfo_harudoc_setpassword, 			ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, setPermission, 			arginfo_harudoc_setpermission, 			ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, setEncryptionMode, 		arginfo_harudoc_setencryptionmode, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, setCompressionMode, 	arginfo_harudoc_setcompressionmode, 	ZEND_ACC_PUBLIC)
+	PHP_ME(HaruDoc, setCompressionLevel, 	arginfo_harudoc_setcompressionlevel, 	ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, setPagesConfiguration, 	arginfo_harudoc_setpagesconfiguration, 	ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, setOpenAction, 			arginfo_harudoc_setopenaction, 			ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, createOutline, 			arginfo_harudoc_createoutline, 			ZEND_ACC_PUBLIC)
@@ -5525,6 +10663,9 @@ static zend_function_entry harudoc_methods[] = { /* {{{ */
 	PHP_ME(HaruDoc, useCNSEncodings, 		arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, useCNTFonts, 			arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
 	PHP_ME(HaruDoc, useCNTEncodings, 		arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20300
+	PHP_ME(HaruDoc, useUTFEncodings, 		arginfo_harudoc___void, 				ZEND_ACC_PUBLIC)
+#endif
 	{NULL, NULL, NULL}
 };
 /* }}} */
@@ -5554,8 +10695,10 @@ static zend_function_entry harupage_methods[] = { /* {{{ */
 	PHP_ME(HaruPage, arc, 						arginfo_harupage_arc, 			ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, circle, 					arginfo_harupage_circle, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, showText, 					arginfo_harupage_showtext, 		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruPage, showTextUTF8, 				arginfo_harupage_showtext, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, showTextNextLine, 			arginfo_harupage_showtextnextline, ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, textOut, 					arginfo_harupage_textout, 		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruPage, textOutUTF8, 				arginfo_harupage_textout, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, beginText, 				arginfo_harudoc___void, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, endText, 					arginfo_harudoc___void, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, setFontAndSize, 			arginfo_harupage_setfontandsize, ZEND_ACC_PUBLIC)
@@ -5572,6 +10715,8 @@ static zend_function_entry harupage_methods[] = { /* {{{ */
 	PHP_ME(HaruPage, endPath, 					arginfo_harudoc___void, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, ellipse, 					arginfo_harupage_ellipse, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, textRect, 					arginfo_harupage_textrect, 		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruPage, textRectUTF8, 				arginfo_harupage_textrect, 		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruPage, layoutText, 				arginfo_harupage_layouttext, 	ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, moveToNextLine, 			arginfo_harudoc___void, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, setGrayFill, 				arginfo_harupage_setgraystroke, ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, setGrayStroke, 			arginfo_harupage_setgraystroke, ZEND_ACC_PUBLIC)
@@ -5591,6 +10736,7 @@ static zend_function_entry harupage_methods[] = { /* {{{ */
 	PHP_ME(HaruPage, createURLAnnotation, 		arginfo_harupage_createurlannotation, 	ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, getTextWidth, 				arginfo_harupage_gettextwidth, 	ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, MeasureText, 				arginfo_harupage_measuretext, 	ZEND_ACC_PUBLIC)
+	PHP_ME(HaruPage, MeasureTextUTF8, 			arginfo_harupage_measuretext, 	ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, getGMode, 					arginfo_harudoc___void, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, getCurrentPos, 			arginfo_harudoc___void, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruPage, getCurrentTextPos, 		arginfo_harudoc___void, 		ZEND_ACC_PUBLIC)
@@ -5620,6 +10766,19 @@ static zend_function_entry harupage_methods[] = { /* {{{ */
 #if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20200
 	PHP_ME(HaruPage, setZoom,					arginfo_harupage_setzoom,		ZEND_ACC_PUBLIC)
 #endif
+	PHP_ME(HaruPage, drawOps,					arginfo_harupage_drawops,		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruPage, polyline,					arginfo_harupage_polyline,		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruPage, polygon,					arginfo_harupage_polyline,		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruPage, drawTable,					arginfo_harupage_drawtable,		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruPage, addPlaceholder,			arginfo_harupage_addplaceholder,	ZEND_ACC_PUBLIC)
+#if defined(HPDF_VERSION_ID) && HPDF_VERSION_ID >= 20200
+	PHP_ME(HaruPage, drawTemplate,				arginfo_harupage_drawtemplate,	ZEND_ACC_PUBLIC)
+#endif
+	{NULL, NULL, NULL}
+};
+/* }}} */
+
+static zend_function_entry harutemplate_methods[] = { /* {{{ */
 	{NULL, NULL, NULL}
 };
 /* }}} */
@@ -5635,6 +10794,8 @@ static zend_function_entry harufont_methods[] = { /* {{{ */
 	PHP_ME(HaruFont, getCapHeight, 		arginfo_harudoc___void, 			ZEND_ACC_PUBLIC)
 	PHP_ME(HaruFont, getTextWidth, 		arginfo_harufont_gettextwidth, 		ZEND_ACC_PUBLIC)
 	PHP_ME(HaruFont, MeasureText, 		arginfo_harufont_measuretext, 		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruFont, MeasureTextUTF8, 	arginfo_harufont_measuretext, 		ZEND_ACC_PUBLIC)
+	PHP_ME(HaruFont, measureMany, 		arginfo_harufont_measuremany, 		ZEND_ACC_PUBLIC)
 	{NULL, NULL, NULL}
 };
 /* }}} */
@@ -5697,6 +10858,14 @@ static zend_function_entry haruoutline_methods[] = { /* {{{ */
 };
 /* }}} */
 
+static zend_function_entry haruzip_methods[] = { /* {{{ */
+	PHP_ME(HaruZip, __construct, 	arginfo_haruzip___construct, 	ZEND_ACC_CTOR|ZEND_ACC_PUBLIC)
+	PHP_ME(HaruZip, addDocument, 	arginfo_haruzip_adddocument, 	ZEND_ACC_PUBLIC)
+	PHP_ME(HaruZip, close, 			arginfo_harudoc___void, 		ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
+/* }}} */
+
 static zend_function_entry haruexception_methods[] = { /* {{{ */
 	{NULL, NULL, NULL}
 };
@@ -5710,6 +10879,9 @@ static zend_function_entry haru_functions[] = { /* {{{ */
 /* }}} */
 
 #ifdef COMPILE_DL_HARU
+#ifdef ZTS
+ZEND_TSRMLS_CACHE_DEFINE()
+#endif
 ZEND_GET_MODULE(haru)
 #endif
 
@@ -5727,12 +10899,28 @@ ZEND_GET_MODULE(haru)
 
 
 
+/* {{{ PHP_INI
+ */
+PHP_INI_BEGIN()
+	PHP_INI_ENTRY("haru.font_cache_size", "64M", PHP_INI_SYSTEM, OnUpdateHaruFontCacheSize)
+	STD_PHP_INI_ENTRY("haru.compression_level", "-1", PHP_INI_ALL, OnUpdateLong, compression_level, zend_haru_globals, haru_globals)
+	STD_PHP_INI_ENTRY("haru.compression_strategy", "0", PHP_INI_ALL, OnUpdateLong, compression_strategy, zend_haru_globals, haru_globals)
+	STD_PHP_INI_ENTRY("haru.deflate_threads", "1", PHP_INI_SYSTEM, OnUpdateHaruDeflateThreads, deflate_threads, zend_haru_globals, haru_globals)
+PHP_INI_END()
+/* }}} */
+
 /* {{{ PHP_MINIT_FUNCTION
  */
 static PHP_MINIT_FUNCTION(haru)
 {
 	zend_class_entry ce;
 
+	zend_hash_init(&php_haru_font_cache, 8, NULL, NULL, 1);
+#ifdef ZTS
+	php_haru_font_cache_mutex = tsrm_mutex_alloc();
+#endif
+	REGISTER_INI_ENTRIES();
+
 	INIT_CLASS_ENTRY(ce, "HaruException", haruexception_methods);
 	ce_haruexception = zend_register_internal_class_ex(&ce, zend_exception_get_default());
 
@@ -5744,6 +10932,10 @@ static PHP_MINIT_FUNCTION(haru)
 	HARU_INIT_CLASS("HaruAnnotation", haruannotation);
 	HARU_INIT_CLASS("HaruEncoder", haruencoder);
 	HARU_INIT_CLASS("HaruOutline", haruoutline);
+	HARU_INIT_CLASS("HaruZip", haruzip);
+
+	INIT_CLASS_ENTRY(ce, "HaruTemplate", harutemplate_methods);
+	ce_harutemplate = zend_register_internal_class_ex(&ce, ce_harupage);
 
 	HARU_CLASS_CONST(ce_harudoc, "CS_DEVICE_GRAY", HPDF_CS_DEVICE_GRAY);
 	HARU_CLASS_CONST(ce_harudoc, "CS_DEVICE_RGB", HPDF_CS_DEVICE_RGB);
@@ -5780,6 +10972,12 @@ static PHP_MINIT_FUNCTION(haru)
 	HARU_CLASS_CONST(ce_harudoc, "COMP_METADATA", HPDF_COMP_METADATA);
 	HARU_CLASS_CONST(ce_harudoc, "COMP_ALL", HPDF_COMP_ALL);
 
+	HARU_CLASS_CONST(ce_harudoc, "STRATEGY_DEFAULT", Z_DEFAULT_STRATEGY);
+	HARU_CLASS_CONST(ce_harudoc, "STRATEGY_FILTERED", Z_FILTERED);
+	HARU_CLASS_CONST(ce_harudoc, "STRATEGY_HUFFMAN_ONLY", Z_HUFFMAN_ONLY);
+	HARU_CLASS_CONST(ce_harudoc, "STRATEGY_RLE", Z_RLE);
+	HARU_CLASS_CONST(ce_harudoc, "STRATEGY_FIXED", Z_FIXED);
+
 	HARU_CLASS_CONST(ce_harudoc, "PAGE_LAYOUT_SINGLE", HPDF_PAGE_LAYOUT_SINGLE);
 	HARU_CLASS_CONST(ce_harudoc, "PAGE_LAYOUT_ONE_COLUMN", HPDF_PAGE_LAYOUT_ONE_COLUMN);
 	HARU_CLASS_CONST(ce_harudoc, "PAGE_LAYOUT_TWO_COLUMN_LEFT", HPDF_PAGE_LAYOUT_TWO_COLUMN_LEFT);
@@ -5815,6 +11013,40 @@ static PHP_MINIT_FUNCTION(haru)
 	HARU_CLASS_CONST(ce_harupage, "FILL_STROKE_CLIPPING", HPDF_FILL_STROKE_CLIPPING);
 	HARU_CLASS_CONST(ce_harupage, "CLIPPING", HPDF_CLIPPING);
 
+	HARU_CLASS_CONST(ce_harupage, "OP_MOVE_TO", PHP_HARU_OP_MOVE_TO);
+	HARU_CLASS_CONST(ce_harupage, "OP_LINE_TO", PHP_HARU_OP_LINE_TO);
+	HARU_CLASS_CONST(ce_harupage, "OP_CURVE_TO", PHP_HARU_OP_CURVE_TO);
+	HARU_CLASS_CONST(ce_harupage, "OP_CURVE_TO2", PHP_HARU_OP_CURVE_TO2);
+	HARU_CLASS_CONST(ce_harupage, "OP_CURVE_TO3", PHP_HARU_OP_CURVE_TO3);
+	HARU_CLASS_CONST(ce_harupage, "OP_RECTANGLE", PHP_HARU_OP_RECTANGLE);
+	HARU_CLASS_CONST(ce_harupage, "OP_ARC", PHP_HARU_OP_ARC);
+	HARU_CLASS_CONST(ce_harupage, "OP_CIRCLE", PHP_HARU_OP_CIRCLE);
+	HARU_CLASS_CONST(ce_harupage, "OP_ELLIPSE", PHP_HARU_OP_ELLIPSE);
+	HARU_CLASS_CONST(ce_harupage, "OP_CLOSE_PATH", PHP_HARU_OP_CLOSE_PATH);
+	HARU_CLASS_CONST(ce_harupage, "OP_STROKE", PHP_HARU_OP_STROKE);
+	HARU_CLASS_CONST(ce_harupage, "OP_CLOSE_PATH_STROKE", PHP_HARU_OP_CLOSE_PATH_STROKE);
+	HARU_CLASS_CONST(ce_harupage, "OP_FILL", PHP_HARU_OP_FILL);
+	HARU_CLASS_CONST(ce_harupage, "OP_EOFILL", PHP_HARU_OP_EOFILL);
+	HARU_CLASS_CONST(ce_harupage, "OP_FILL_STROKE", PHP_HARU_OP_FILL_STROKE);
+	HARU_CLASS_CONST(ce_harupage, "OP_CLOSE_PATH_FILL_STROKE", PHP_HARU_OP_CLOSE_PATH_FILL_STROKE);
+	HARU_CLASS_CONST(ce_harupage, "OP_EOFILL_STROKE", PHP_HARU_OP_EOFILL_STROKE);
+	HARU_CLASS_CONST(ce_harupage, "OP_CLOSE_PATH_EOFILL_STROKE", PHP_HARU_OP_CLOSE_PATH_EOFILL_STROKE);
+	HARU_CLASS_CONST(ce_harupage, "OP_END_PATH", PHP_HARU_OP_END_PATH);
+	HARU_CLASS_CONST(ce_harupage, "OP_CLIP", PHP_HARU_OP_CLIP);
+	HARU_CLASS_CONST(ce_harupage, "OP_EOCLIP", PHP_HARU_OP_EOCLIP);
+	HARU_CLASS_CONST(ce_harupage, "OP_GSAVE", PHP_HARU_OP_GSAVE);
+	HARU_CLASS_CONST(ce_harupage, "OP_GRESTORE", PHP_HARU_OP_GRESTORE);
+	HARU_CLASS_CONST(ce_harupage, "OP_CONCAT", PHP_HARU_OP_CONCAT);
+	HARU_CLASS_CONST(ce_harupage, "OP_SET_LINE_WIDTH", PHP_HARU_OP_SET_LINE_WIDTH);
+	HARU_CLASS_CONST(ce_harupage, "OP_SET_LINE_CAP", PHP_HARU_OP_SET_LINE_CAP);
+	HARU_CLASS_CONST(ce_harupage, "OP_SET_LINE_JOIN", PHP_HARU_OP_SET_LINE_JOIN);
+	HARU_CLASS_CONST(ce_harupage, "OP_SET_GRAY_FILL", PHP_HARU_OP_SET_GRAY_FILL);
+	HARU_CLASS_CONST(ce_harupage, "OP_SET_GRAY_STROKE", PHP_HARU_OP_SET_GRAY_STROKE);
+	HARU_CLASS_CONST(ce_harupage, "OP_SET_RGB_FILL", PHP_HARU_OP_SET_RGB_FILL);
+	HARU_CLASS_CONST(ce_harupage, "OP_SET_RGB_STROKE", PHP_HARU_OP_SET_RGB_STROKE);
+	HARU_CLASS_CONST(ce_harupage, "OP_SET_CMYK_FILL", PHP_HARU_OP_SET_CMYK_FILL);
+	HARU_CLASS_CONST(ce_harupage, "OP_SET_CMYK_STROKE", PHP_HARU_OP_SET_CMYK_STROKE);
+
 	HARU_CLASS_CONST(ce_harupage, "TALIGN_LEFT", HPDF_TALIGN_LEFT);
 	HARU_CLASS_CONST(ce_harupage, "TALIGN_RIGHT", HPDF_TALIGN_RIGHT);
 	HARU_CLASS_CONST(ce_harupage, "TALIGN_CENTER", HPDF_TALIGN_CENTER);
@@ -5890,6 +11122,52 @@ static PHP_MINIT_FUNCTION(haru)
 }
 /* }}} */
 
+/* {{{ PHP_MSHUTDOWN_FUNCTION
+ */
+static PHP_MSHUTDOWN_FUNCTION(haru)
+{
+	php_haru_font_entry *entry;
+
+	UNREGISTER_INI_ENTRIES();
+
+	ZEND_HASH_FOREACH_PTR(&php_haru_font_cache, entry) {
+		php_haru_font_entry_free(entry);
+	} ZEND_HASH_FOREACH_END();
+	zend_hash_destroy(&php_haru_font_cache);
+
+#ifdef ZTS
+	tsrm_mutex_free(php_haru_font_cache_mutex);
+#endif
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP_RINIT_FUNCTION
+ */
+static PHP_RINIT_FUNCTION(haru)
+{
+#if defined(COMPILE_DL_HARU) && defined(ZTS)
+	ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+	/* libharu memory is per request, whatever a bailout or the fast shutdown
+	 * released without HPDF_Free() must not be carried over */
+	HARU_G(mem_usage) = 0;
+	HARU_G(mem_peak) = 0;
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP_GINIT_FUNCTION
+ */
+static PHP_GINIT_FUNCTION(haru)
+{
+#if defined(COMPILE_DL_HARU) && defined(ZTS)
+	ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+	memset(haru_globals, 0, sizeof(*haru_globals));
+}
+/* }}} */
+
 /* {{{ PHP_MINFO_FUNCTION
  */
 static PHP_MINFO_FUNCTION(haru)
@@ -5898,7 +11176,15 @@ static PHP_MINFO_FUNCTION(haru)
 	php_info_print_table_header(2, "Haru PDF support", "enabled");
 	php_info_print_table_row(2, "Version", PHP_HARU_VERSION);
 	php_info_print_table_row(2, "libharu version", HPDF_VERSION_TEXT);
+	php_info_print_table_row(2, "zlib version", ZLIB_VERSION);
+#ifdef HAVE_HARU_THREADS
+	php_info_print_table_row(2, "Parallel deflate", "enabled");
+#else
+	php_info_print_table_row(2, "Parallel deflate", "disabled");
+#endif
 	php_info_print_table_end();
+
+	DISPLAY_INI_ENTRIES();
 }
 /* }}} */
 
@@ -5911,14 +11197,18 @@ zend_module_entry haru_module_entry = {
 	"haru",
 	haru_functions,
 	PHP_MINIT(haru),
-	NULL,
-	NULL,
+	PHP_MSHUTDOWN(haru),
+	PHP_RINIT(haru),
 	NULL,
 	PHP_MINFO(haru),
 #if ZEND_MODULE_API_NO >= 20010901
 	PHP_HARU_VERSION,
 #endif
-	STANDARD_MODULE_PROPERTIES
+	PHP_MODULE_GLOBALS(haru),
+	PHP_GINIT(haru),
+	NULL,
+	NULL,
+	STANDARD_MODULE_PROPERTIES_EX
 };
 /* }}} */
 
@@ -30,6 +30,20 @@ extern zend_module_entry haru_module_entry;
 #include "TSRM.h"
 #endif
 
+ZEND_BEGIN_MODULE_GLOBALS(haru)
+	size_t mem_usage;
+	size_t mem_peak;
+	zend_long compression_level;
+	zend_long compression_strategy;
+	zend_long deflate_threads;
+ZEND_END_MODULE_GLOBALS(haru)
+
+#define HARU_G(v) ZEND_MODULE_GLOBALS_ACCESSOR(haru, v)
+
+#if defined(ZTS) && defined(COMPILE_DL_HARU)
+ZEND_TSRMLS_CACHE_EXTERN()
+#endif
+
 #endif	/* PHP_HARU_H */
 
 /*
@@ -0,0 +1,49 @@
+--TEST--
+HaruDoc::setCompressionLevel() changes the deflate level of the compressed streams
+--SKIPIF--
+<?php
+if (!extension_loaded("haru")) die("skip haru extension is not loaded");
+if (!method_exists("HaruDoc", "setCompressionLevel")) die("skip libharu 2.2 or later required");
+?>
+--FILE--
+<?php
+function make($level)
+{
+	$doc = new HaruDoc();
+	$doc->setCompressionMode(HaruDoc::COMP_ALL);
+	if ($level !== null) {
+		$doc->setCompressionLevel($level, 0, HaruDoc::COMP_TEXT);
+	}
+	$page = $doc->addPage();
+	for ($i = 0; $i < 200; $i++) {
+		$page->moveTo(10 + $i, 10);
+		$page->lineTo(10 + $i, 500 + $i % 7);
+	}
+	$page->stroke();
+	return $doc->toString();
+}
+
+$default = make(null);
+$stored = make(0);
+$best = make(9);
+
+var_dump(strlen($stored) > strlen($default));
+var_dump(strlen($best) <= strlen($default));
+
+$doc = new HaruDoc();
+try {
+	$doc->setCompressionLevel(10);
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+try {
+	$doc->setCompressionLevel(6, 0, 1024);
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+Invalid compression level, expected -1 to 9
+Invalid streams value
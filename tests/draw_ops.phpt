@@ -0,0 +1,46 @@
+--TEST--
+HaruPage::drawOps() executes batches of drawing operations
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$page = $doc->addPage();
+
+$ops = array(
+	HaruPage::OP_SET_LINE_WIDTH, 2,
+	HaruPage::OP_MOVE_TO, 10, 10,
+	HaruPage::OP_LINE_TO, 100, 100,
+	HaruPage::OP_STROKE,
+	HaruPage::OP_RECTANGLE, 20, 20, 50, 30,
+	HaruPage::OP_FILL,
+);
+var_dump($page->drawOps($ops));
+var_dump($page->getLineWidth());
+
+/* the same operations packed as doubles */
+var_dump($page->drawOps(call_user_func_array("pack", array_merge(array("d*"), $ops))));
+
+/* a path operation out of a path fails, the ones before it are drawn */
+var_dump($page->drawOps(array(HaruPage::OP_MOVE_TO, 0, 0, HaruPage::OP_STROKE, HaruPage::OP_LINE_TO, 1, 1)));
+var_dump($page->drawOps(array(HaruPage::OP_MOVE_TO, 0, 0, HaruPage::OP_END_PATH)));
+
+foreach (array(array(999), array(HaruPage::OP_MOVE_TO, 1)) as $bad) {
+	try {
+		$page->drawOps($bad);
+	} catch (HaruException $e) {
+		echo $e->getMessage(), "\n";
+	}
+}
+
+var_dump(strlen($doc->toString()) > 0);
+?>
+--EXPECT--
+int(-1)
+float(2)
+int(-1)
+int(2)
+int(-1)
+Invalid operation code at offset 0
+Missing arguments of the operation at offset 0
+bool(true)
@@ -0,0 +1,56 @@
+--TEST--
+HaruPage::drawTable() draws the rows that fit and tells where to continue
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$font = $doc->getFont("Helvetica");
+$rows = array(
+	array("Name", "Amount"),
+	array("first", 10),
+	array("second", 20),
+);
+$columns = array(100, array("width" => 60, "align" => HaruPage::TALIGN_RIGHT));
+
+$page = $doc->addPage();
+$page->setFontAndSize($font, 10);
+$result = $page->drawTable($rows, $columns, array("x" => 50, "y" => 800, "header" => 1, "header_color" => array(0.9, 0.9, 0.9)));
+var_dump($result["next"], $result["rows"], $result["y"] < 800);
+
+/* room for the header and one row, the rest goes on the next page */
+$page = $doc->addPage();
+$page->setFontAndSize($font, 10);
+$result = $page->drawTable($rows, $columns, array("x" => 50, "y" => 800, "bottom" => 760, "header" => 1));
+var_dump($result["next"], $result["rows"]);
+
+$page = $doc->addPage();
+$page->setFontAndSize($font, 10);
+$result = $page->drawTable($rows, $columns, array("x" => 50, "y" => 800, "header" => 1, "start" => $result["next"]));
+var_dump($result["next"], $result["rows"]);
+
+/* the header alone is not drawn */
+$result = $page->drawTable($rows, $columns, array("x" => 50, "y" => 100, "bottom" => 90, "header" => 1));
+var_dump($result["next"], $result["rows"], $result["y"]);
+
+try {
+	$page->drawTable($rows, array(100, 3));
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+
+var_dump(strlen($doc->toString()) > 0);
+?>
+--EXPECT--
+int(3)
+int(2)
+bool(true)
+int(2)
+int(1)
+int(3)
+int(1)
+int(1)
+int(0)
+float(100)
+Invalid width of column 1
+bool(true)
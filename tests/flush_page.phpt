@@ -0,0 +1,55 @@
+--TEST--
+HaruDoc::flushPage() and HaruDoc::setAutoFlush() finish pages before saving
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+try {
+	$doc->flushPage();
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+
+$page = $doc->addPage();
+$page->rectangle(10, 10, 100, 100);
+$page->stroke();
+var_dump($doc->flushPage());
+
+/* a flushed page can not be drawn on anymore */
+try {
+	$page->rectangle(20, 20, 100, 100);
+} catch (HaruException $e) {
+	echo "flushed\n";
+}
+
+/* a pending clipping path and unbalanced graphic states are closed */
+$page = $doc->addPage();
+$page->drawOps(array(HaruPage::OP_GSAVE, HaruPage::OP_GSAVE, HaruPage::OP_RECTANGLE, 0, 0, 50, 50, HaruPage::OP_CLIP));
+var_dump($doc->flushPage());
+
+var_dump($doc->setAutoFlush(true));
+for ($i = 0; $i < 3; $i++) {
+	$page = $doc->addPage();
+	$page->rectangle(10, 10, 100 + $i, 100);
+	$page->stroke();
+}
+
+$other = new HaruDoc();
+try {
+	$other->flushPage($page);
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+
+$pdf = $doc->toString();
+var_dump(preg_match_all('#/Type /Page[^s]#', $pdf));
+?>
+--EXPECT--
+The document has no pages
+bool(true)
+flushed
+bool(true)
+bool(true)
+The page belongs to another document
+int(5)
@@ -0,0 +1,50 @@
+--TEST--
+Font subsetting keeps the glyphs printed before it was enabled and before an earlier save
+--SKIPIF--
+<?php
+if (!extension_loaded("haru")) die("skip haru extension is not loaded");
+if (!getenv("HARU_TEST_TTF") && !is_file("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf")) die("skip no TrueType font, set HARU_TEST_TTF");
+?>
+--FILE--
+<?php
+$ttf = getenv("HARU_TEST_TTF") ?: "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf";
+
+function font_program_length($pdf)
+{
+	preg_match('/\/Length1 (\d+)/', $pdf, $m);
+	return (int)$m[1];
+}
+
+function draw_text(HaruDoc $doc, HaruFont $font, $text)
+{
+	$page = $doc->addPage();
+	$page->beginText();
+	$page->setFontAndSize($font, 12);
+	$page->textOut(50, 700, $text);
+	$page->endText();
+}
+
+$ref = new HaruDoc();
+$font = $ref->getFont($ref->loadTTF($ttf, true), "WinAnsiEncoding");
+$ref->setFontSubsetting(true);
+draw_text($ref, $font, "B");
+$only_b = font_program_length($ref->toString());
+
+$doc = new HaruDoc();
+$font = $doc->getFont($doc->loadTTF($ttf, true), "WinAnsiEncoding");
+draw_text($doc, $font, "AAAA");
+$doc->setFontSubsetting(true);
+draw_text($doc, $font, "B");
+$first = font_program_length($doc->toString());
+
+draw_text($doc, $font, "CDEFGHIJKLMNOPQRSTUVWXYZ");
+$second = font_program_length($doc->toString());
+
+var_dump($only_b > 0);
+var_dump($first > $only_b);
+var_dump($second > $first);
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
@@ -0,0 +1,64 @@
+--TEST--
+HaruDoc::fork() replays the setup once and reuses the replayed images
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$raw = tempnam(sys_get_temp_dir(), "haru");
+file_put_contents($raw, str_repeat("\x80", 4 * 3));
+
+/* only forkable documents record their setup */
+$plain = new HaruDoc();
+$plain->setInfoAttr(HaruDoc::INFO_TITLE, "plain");
+try {
+	$plain->fork();
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+try {
+	$plain->setForkable(true);
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+
+$doc = new HaruDoc();
+var_dump($doc->setForkable(true));
+$doc->setInfoAttr(HaruDoc::INFO_TITLE, "first");
+$doc->setInfoAttr(HaruDoc::INFO_TITLE, "second");
+$doc->setInfoAttr(HaruDoc::INFO_AUTHOR, "author");
+$image = $doc->loadRaw($raw, 4, 3, HaruDoc::CS_DEVICE_GRAY);
+
+$copy = $doc->fork();
+var_dump($copy->getInfoAttr(HaruDoc::INFO_TITLE));
+var_dump($copy->getInfoAttr(HaruDoc::INFO_AUTHOR));
+
+/* the image loaded by the replay is returned instead of a new one */
+$image = $copy->loadRaw($raw, 4, 3, HaruDoc::CS_DEVICE_GRAY);
+var_dump($image->getWidth(), $image->getHeight());
+$stats = $copy->getStats();
+var_dump($stats["images"], $stats["image_index_hits"]);
+
+/* a fork can be forked again */
+var_dump($copy->fork()->getInfoAttr(HaruDoc::INFO_TITLE));
+
+$doc->addPage();
+try {
+	$doc->fork();
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+
+unlink($raw);
+?>
+--EXPECT--
+Cannot fork a document which is not forkable, call setForkable() before setting it up
+Cannot make a document forkable after it was set up
+bool(true)
+string(6) "second"
+string(6) "author"
+int(4)
+int(3)
+int(1)
+int(1)
+string(6) "second"
+Cannot fork a document which has pages
@@ -0,0 +1,36 @@
+--TEST--
+HaruDoc::getFont() returns the same HaruFont for the same name and encoding
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$a = $doc->getFont("Helvetica");
+$b = $doc->getFont("Helvetica");
+$c = $doc->getFont("Helvetica", "WinAnsiEncoding");
+$d = $doc->getFont("Helvetica", "WinAnsiEncoding");
+$e = $doc->getFont("Courier", "WinAnsiEncoding");
+
+var_dump($a === $b, $c === $d, $a === $c, $c === $e);
+var_dump($c->getFontName(), $c->getEncodingName(), $e->getFontName());
+
+/* the cached font outlives the variables */
+unset($a, $b);
+var_dump($doc->getFont("Helvetica")->getFontName());
+
+try {
+	$doc->getFont("NoSuchFont");
+} catch (HaruException $e) {
+	echo "invalid font\n";
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(false)
+bool(false)
+string(9) "Helvetica"
+string(15) "WinAnsiEncoding"
+string(7) "Courier"
+string(9) "Helvetica"
+invalid font
@@ -0,0 +1,43 @@
+--TEST--
+HaruDoc::setImageDeduplication() embeds an image loaded several times once
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$raw = tempnam(sys_get_temp_dir(), "haru");
+file_put_contents($raw, str_repeat("\x80", 4 * 3));
+
+$doc = new HaruDoc();
+var_dump($doc->setImageDeduplication(true));
+$doc->loadRaw($raw, 4, 3, HaruDoc::CS_DEVICE_GRAY);
+$doc->loadRaw($raw, 4, 3, HaruDoc::CS_DEVICE_GRAY);
+/* other dimensions are another image */
+$doc->loadRaw($raw, 2, 6, HaruDoc::CS_DEVICE_GRAY);
+
+$stats = $doc->getStats();
+var_dump($stats["images"], $stats["image_index_hits"]);
+
+/* a changed file is loaded again */
+clearstatcache();
+file_put_contents($raw, str_repeat("\x40", 4 * 3 + 1));
+$doc->loadRaw($raw, 4, 3, HaruDoc::CS_DEVICE_GRAY);
+
+$stats = $doc->getStats();
+var_dump($stats["images"], $stats["image_index_hits"]);
+
+$plain = new HaruDoc();
+$plain->loadRaw($raw, 4, 3, HaruDoc::CS_DEVICE_GRAY);
+$plain->loadRaw($raw, 4, 3, HaruDoc::CS_DEVICE_GRAY);
+$stats = $plain->getStats();
+var_dump($stats["images"], $stats["image_index_hits"]);
+
+unlink($raw);
+?>
+--EXPECT--
+bool(true)
+int(2)
+int(1)
+int(3)
+int(1)
+int(2)
+int(0)
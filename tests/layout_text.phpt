@@ -0,0 +1,60 @@
+--TEST--
+HaruPage::layoutText() breaks paragraphs into the boxes
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$page = $doc->addPage();
+$page->setFontAndSize($doc->getFont("Helvetica"), 10);
+
+$text = str_repeat("The quick brown fox jumps over the lazy dog. ", 20) . "\nLast paragraph.";
+
+try {
+	$page->layoutText($text, array(50, 50, 250, 800));
+} catch (HaruException $e) {
+	echo "text object required\n";
+}
+
+$page->beginText();
+$all = $page->layoutText($text, array(50, 50, 250, 800), array("align" => HaruPage::TALIGN_JUSTIFY));
+var_dump($all["remainder"], $all["lines"] > 1, $all["height"] > 0 && $all["height"] <= 750, $all["box"]);
+
+/* the text flows from a box into the next one */
+$boxes = array(array(50, 700, 250, 740), array(300, 700, 500, 740));
+$part = $page->layoutText($text, $boxes);
+var_dump(strlen($part["remainder"]) > 0, strlen($part["remainder"]) < strlen($text), $part["box"]);
+var_dump(substr($text, -strlen($part["remainder"])) === $part["remainder"]);
+$page->endText();
+
+/* measuring only does not need a text object */
+$measure = $page->layoutText($text, $boxes, array("draw" => false));
+var_dump($measure === $part);
+
+foreach (array(array(1, 2, 3), array()) as $bad) {
+	try {
+		$page->layoutText($text, $bad, array("draw" => false));
+	} catch (HaruException $e) {
+		echo $e->getMessage(), "\n";
+	}
+}
+try {
+	$page->layoutText($text, $boxes, array("draw" => false, "align" => 99));
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+?>
+--EXPECT--
+text object required
+string(0) ""
+bool(true)
+bool(true)
+int(0)
+bool(true)
+bool(true)
+int(1)
+bool(true)
+bool(true)
+Invalid box, array of 4 elements expected
+Invalid box
+Invalid align value
@@ -0,0 +1,62 @@
+--TEST--
+HaruDoc::loadPNGFromString() and HaruDoc::loadRawFromString()
+--SKIPIF--
+<?php
+if (!extension_loaded("haru")) die("skip haru extension is not loaded");
+if (!method_exists("HaruDoc", "loadPNGFromString")) die("skip libharu 2.2 or later required");
+if (!function_exists("gzcompress")) die("skip zlib extension is not loaded");
+?>
+--FILE--
+<?php
+function png_chunk($type, $data)
+{
+	return pack("N", strlen($data)) . $type . $data . pack("N", crc32($type . $data));
+}
+
+/* a gray 8 bit image, filter type 0 on every row */
+function png($width, $height)
+{
+	$rows = str_repeat("\0" . str_repeat("\x80", $width), $height);
+	return "\x89PNG\r\n\x1a\n"
+		. png_chunk("IHDR", pack("NNCCCCC", $width, $height, 8, 0, 0, 0, 0))
+		. png_chunk("IDAT", gzcompress($rows))
+		. png_chunk("IEND", "");
+}
+
+$doc = new HaruDoc();
+$page = $doc->addPage();
+
+$image = $doc->loadPNGFromString(png(5, 4));
+var_dump($image->getWidth(), $image->getHeight());
+$page->drawImage($image, 10, 10, 50, 40);
+
+$raw = $doc->loadRawFromString(str_repeat("\xff\x00\x00", 6), 3, 2, HaruDoc::CS_DEVICE_RGB);
+var_dump($raw->getWidth(), $raw->getHeight(), $raw->getColorSpace());
+$page->drawImage($raw, 100, 10, 30, 20);
+
+try {
+	$doc->loadRawFromString("\xff", 3, 2, HaruDoc::CS_DEVICE_RGB);
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+
+try {
+	$doc->loadPNGFromString("not a png");
+} catch (HaruException $e) {
+	echo "invalid png\n";
+}
+
+$stats = $doc->getStats();
+var_dump($stats["images"]);
+var_dump(strlen($doc->toString()) > 0);
+?>
+--EXPECT--
+int(5)
+int(4)
+int(3)
+int(2)
+string(9) "DeviceRGB"
+Image data is too short for the given dimensions
+invalid png
+int(2)
+bool(true)
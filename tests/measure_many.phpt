@@ -0,0 +1,48 @@
+--TEST--
+HaruFont::measureMany() and the cached glyph widths agree with libharu
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$font = $doc->getFont("Helvetica", "WinAnsiEncoding");
+
+var_dump($font->getUnicodeWidth(0x41), $font->getUnicodeWidth(0xe9));
+$tw = $font->getTextWidth("AB A");
+var_dump($tw["width"], $tw["numchars"], $tw["numspace"]);
+
+$strings = array("AB A", "", "caf\xe9", 42);
+$widths = $font->measureMany($strings, 10);
+var_dump(count($widths));
+foreach ($strings as $i => $s) {
+	$w = $font->getTextWidth((string)$s);
+	var_dump(abs($widths[$i] - $w["width"] * 10 / 1000) < 1e-9);
+}
+
+/* char_space applies to every character and word_space to every space */
+$spaced = $font->measureMany(array("AB A"), 10, 1, 2);
+var_dump(abs($spaced[0] - ($widths[0] + 4 * 1 + 1 * 2)) < 1e-9);
+
+$packed = $font->measureMany($strings, 10, 0, 0, true);
+var_dump(strlen($packed), array_values(unpack("d*", $packed)) === $widths);
+
+/* the same through a page */
+$page = $doc->addPage();
+$page->setFontAndSize($font, 10);
+var_dump(abs($page->getTextWidth("AB A") - $widths[0]) < 1e-4);
+?>
+--EXPECT--
+int(667)
+int(556)
+int(2279)
+int(4)
+int(1)
+int(4)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(32)
+bool(true)
+bool(true)
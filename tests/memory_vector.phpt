@@ -0,0 +1,29 @@
+--TEST--
+Peak memory of the vector workload stays below its limit
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--INI--
+memory_limit=-1
+--FILE--
+<?php
+require __DIR__ . "/../bench/workloads.php";
+$limits = require __DIR__ . "/../bench/limits.php";
+
+$doc = new HaruDoc();
+$doc->setCompressionMode(HaruDoc::COMP_ALL);
+bench_vector($doc, 1);
+
+$file = tempnam(sys_get_temp_dir(), "haru");
+$doc->save($file);
+var_dump(filesize($file) > 0);
+unlink($file);
+
+$peak = memory_get_peak_usage();
+if ($peak > $limits["vector"]) {
+	echo "peak memory $peak exceeds the limit of {$limits["vector"]} bytes\n";
+}
+echo "done\n";
+?>
+--EXPECT--
+bool(true)
+done
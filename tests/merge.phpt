@@ -0,0 +1,55 @@
+--TEST--
+HaruDoc::merge() fills the placeholders with the spacing they were added with
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$page = $doc->addPage();
+$page->setFontAndSize($doc->getFont("Helvetica"), 12);
+$page->setCharSpace(2);
+$page->setWordSpace(3);
+$page->addPlaceholder("name", 50, 700, array("width" => 200, "align" => HaruPage::TALIGN_RIGHT));
+$page->setCharSpace(0);
+$page->setWordSpace(0);
+$page->rectangle(50, 690, 200, 30);
+$page->stroke();
+
+$pdfs = array();
+$count = $doc->merge(
+	array("a" => array("name" => "ab cd"), "b" => array("name" => "xy\0zz")),
+	function ($pdf, $key, $record) use (&$pdfs) {
+		$pdfs[$key] = $pdf;
+	}
+);
+var_dump($count);
+
+var_dump(strpos($pdfs["a"], "2 Tc") !== false, strpos($pdfs["a"], "3 Tw") !== false);
+var_dump(strpos($pdfs["a"], "(ab cd) Tj") !== false);
+/* the text stops at the NUL byte */
+var_dump(strpos($pdfs["b"], "(xy) Tj") !== false, strpos($pdfs["b"], "zz") === false);
+
+$dir = sys_get_temp_dir() . "/haru_merge_" . getmypid();
+mkdir($dir);
+var_dump($doc->merge(array("one" => array("name" => "1"), "two" => array("name" => "2")), $dir));
+var_dump(is_file("$dir/one.pdf"), is_file("$dir/two.pdf"));
+try {
+	$doc->merge(array("../x" => array("name" => "3")), $dir);
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+unlink("$dir/one.pdf");
+unlink("$dir/two.pdf");
+rmdir($dir);
+?>
+--EXPECT--
+int(2)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(2)
+bool(true)
+bool(true)
+Invalid record key '../x', cannot be used as a file name
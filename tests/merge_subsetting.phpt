@@ -0,0 +1,41 @@
+--TEST--
+HaruDoc::merge() embeds the glyphs of every record with font subsetting enabled
+--SKIPIF--
+<?php
+if (!extension_loaded("haru")) die("skip haru extension is not loaded");
+if (!getenv("HARU_TEST_TTF") && !is_file("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf")) die("skip no TrueType font, set HARU_TEST_TTF");
+?>
+--FILE--
+<?php
+$ttf = getenv("HARU_TEST_TTF") ?: "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf";
+
+function font_program_length($pdf)
+{
+	preg_match('/\/Length1 (\d+)/', $pdf, $m);
+	return (int)$m[1];
+}
+
+$doc = new HaruDoc();
+$doc->setFontSubsetting(true);
+$font = $doc->getFont($doc->loadTTF($ttf, true), "WinAnsiEncoding");
+$page = $doc->addPage();
+$page->setFontAndSize($font, 12);
+$page->addPlaceholder("name", 50, 700);
+
+$lengths = array();
+$count = $doc->merge(
+	array("first" => array("name" => "A"), "second" => array("name" => "BCDEFGHIJKLMNOPQRSTUVWXYZ")),
+	function ($pdf, $key, $record) use (&$lengths) {
+		$lengths[$key] = font_program_length($pdf);
+	}
+);
+
+var_dump($count);
+var_dump($lengths["first"] > 0);
+/* the program of the second document has the glyphs of its own record */
+var_dump($lengths["second"] > $lengths["first"]);
+?>
+--EXPECT--
+int(2)
+bool(true)
+bool(true)
@@ -0,0 +1,23 @@
+--TEST--
+HaruDoc::output() writes the same data as HaruDoc::toString()
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$page = $doc->addPage();
+$page->beginText();
+$page->setFontAndSize($doc->getFont("Helvetica"), 12);
+$page->textOut(50, 700, "output");
+$page->endText();
+
+ob_start();
+var_dump($doc->output());
+$out = ob_get_clean();
+
+var_dump(substr($out, 0, 5));
+var_dump($out === $doc->toString() . "bool(true)\n");
+?>
+--EXPECT--
+string(5) "%PDF-"
+bool(true)
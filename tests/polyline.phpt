@@ -0,0 +1,49 @@
+--TEST--
+HaruPage::polyline() and HaruPage::polygon() draw paths through many points
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$page = $doc->addPage();
+
+$points = array(0, 0, 0.1, 0, 10, 0, 20, 0, 20.2, 0.2);
+var_dump($page->polyline($points));
+$page->stroke();
+
+/* the points closer than the tolerance are dropped, the last one is kept */
+var_dump($page->polyline($points, 1));
+$page->stroke();
+
+/* the tolerance is in device space */
+$page->drawOps(array(HaruPage::OP_CONCAT, 10, 0, 0, 10, 0, 0));
+var_dump($page->polyline($points, 1));
+$page->stroke();
+
+var_dump($page->polygon(pack("d*", 0, 0, 10, 0, 10, 10)));
+$page->fill();
+
+foreach (array(array(1, 2, 3), array(1, 2)) as $bad) {
+	try {
+		$page->polyline($bad);
+	} catch (HaruException $e) {
+		echo $e->getMessage(), "\n";
+	}
+}
+try {
+	$page->polyline($points, -1);
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+
+var_dump(strlen($doc->toString()) > 0);
+?>
+--EXPECT--
+int(5)
+int(4)
+int(5)
+int(3)
+Expected at least 2 points given as x, y pairs
+Expected at least 2 points given as x, y pairs
+Invalid tolerance value
+bool(true)
@@ -0,0 +1,54 @@
+--TEST--
+HaruDoc::saveToCallback() hands the document over in chunks
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$font = $doc->getFont("Helvetica");
+for ($i = 0; $i < 20; $i++) {
+	$page = $doc->addPage();
+	$page->beginText();
+	$page->setFontAndSize($font, 12);
+	$page->textOut(50, 700, "page $i");
+	$page->endText();
+}
+
+$chunks = array();
+var_dump($doc->saveToCallback(function ($data) use (&$chunks) {
+	$chunks[] = $data;
+}, 1024));
+
+var_dump(count($chunks) > 1);
+var_dump(max(array_map("strlen", $chunks)) <= 1024);
+var_dump(implode("", $chunks) === $doc->toString());
+
+/* returning false stops the output */
+$calls = 0;
+try {
+	$doc->saveToCallback(function ($data) use (&$calls) {
+		$calls++;
+		return false;
+	}, 1024);
+} catch (HaruException $e) {
+	echo "stopped\n";
+}
+var_dump($calls);
+
+foreach (array(array("no_such_function", 1024), array("strlen", 0)) as $bad) {
+	try {
+		$doc->saveToCallback($bad[0], $bad[1]);
+	} catch (HaruException $e) {
+		echo $e->getMessage(), "\n";
+	}
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+stopped
+int(1)
+Invalid callback
+Buffer size must be greater than zero
@@ -0,0 +1,34 @@
+--TEST--
+HaruDoc::saveToPhpStream() writes into stream resources and wrapper URLs
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$doc->addPage();
+$pdf = $doc->toString();
+
+$fp = fopen("php://memory", "w+");
+fwrite($fp, "head");
+var_dump($doc->saveToPhpStream($fp, 16));
+rewind($fp);
+var_dump(stream_get_contents($fp) === "head" . $pdf);
+fclose($fp);
+
+$file = tempnam(sys_get_temp_dir(), "haru");
+var_dump($doc->saveToPhpStream("file://" . $file, 0));
+var_dump(file_get_contents($file) === $pdf);
+unlink($file);
+
+try {
+	$doc->saveToPhpStream("php://memory", -1);
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+Buffer size must be greater than or equal to zero
@@ -0,0 +1,48 @@
+--TEST--
+HaruDoc::createTemplate() records a Form XObject placed on pages many times
+--SKIPIF--
+<?php
+if (!extension_loaded("haru")) die("skip haru extension is not loaded");
+if (!method_exists("HaruDoc", "createTemplate")) die("skip libharu 2.2 or later required");
+?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$tpl = $doc->createTemplate(100, 50);
+var_dump($tpl instanceof HaruTemplate, $tpl instanceof HaruPage);
+
+$tpl->rectangle(0, 0, 100, 50);
+$tpl->stroke();
+$tpl->beginText();
+$tpl->setFontAndSize($doc->getFont("Helvetica"), 10);
+$tpl->textOut(5, 20, "stamp");
+$tpl->endText();
+
+for ($i = 0; $i < 3; $i++) {
+	$page = $doc->addPage();
+	var_dump($page->drawTemplate($tpl, 50, 700));
+	$page->drawTemplate($tpl, 50, 500, 2, 2);
+}
+
+try {
+	$tpl->addPlaceholder("name", 0, 0);
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+
+$pdf = $doc->toString();
+/* one form for the six placements, and no page for the template itself */
+var_dump(substr_count($pdf, "/Subtype /Form"));
+var_dump(preg_match_all('#/Type /Page[^s]#', $pdf));
+var_dump(substr_count($pdf, " Do"));
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+Cannot add a placeholder to a template
+int(1)
+int(3)
+int(6)
@@ -0,0 +1,43 @@
+--TEST--
+HaruDoc::toString() and HaruDoc::getStats()
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$stats = $doc->getStats();
+var_dump($stats["pages"], $stats["output_size"]);
+
+$font = $doc->getFont("Helvetica");
+for ($i = 0; $i < 3; $i++) {
+	$page = $doc->addPage();
+	$page->beginText();
+	$page->setFontAndSize($font, 12);
+	$page->textOut(50, 700, str_repeat("page $i ", $i + 1));
+	$page->endText();
+}
+
+$pdf = $doc->toString();
+var_dump(substr($pdf, 0, 5), substr(rtrim($pdf), -5));
+
+$stats = $doc->getStats();
+var_dump($stats["pages"], $stats["fonts"]);
+var_dump($stats["output_size"] === strlen($pdf));
+var_dump(count($stats["page_content_sizes"]));
+var_dump($stats["content_size"] === array_sum($stats["page_content_sizes"]));
+var_dump($stats["page_content_sizes"][2] > $stats["page_content_sizes"][0]);
+var_dump($stats["request_memory_peak"] >= $stats["request_memory_usage"], $stats["pool_used"] <= $stats["pool_size"]);
+?>
+--EXPECT--
+int(0)
+int(0)
+string(5) "%PDF-"
+string(5) "%%EOF"
+int(3)
+int(1)
+bool(true)
+int(3)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
@@ -0,0 +1,47 @@
+--TEST--
+UTF-8 text methods encode the text for the current font
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+$doc = new HaruDoc();
+$font = $doc->getFont("Helvetica", "WinAnsiEncoding");
+$page = $doc->addPage();
+$page->setFontAndSize($font, 10);
+
+$text = "caf\xc3\xa9 \xe2\x82\xac";
+var_dump($page->MeasureTextUTF8($text, 1000));
+var_dump($page->MeasureTextUTF8($text, 15));
+var_dump($page->MeasureTextUTF8($text, 19.5));
+var_dump($font->MeasureTextUTF8($text, 15, 10, 0, 0));
+
+$page->beginText();
+var_dump($page->textOutUTF8(50, 700, $text));
+$page->moveTextPos(0, -20);
+var_dump($page->showTextUTF8("na\xc3\xafve"));
+
+foreach (array("\xe4\xb8\xad", "a\xff") as $bad) {
+	try {
+		$page->showTextUTF8($bad);
+	} catch (HaruException $e) {
+		echo $e->getMessage(), "\n";
+	}
+}
+$page->endText();
+
+$pdf = $doc->toString();
+/* the euro sign is 0x80 in WinAnsiEncoding */
+var_dump(strpos($pdf, "(caf\\351 \\200) Tj") !== false);
+var_dump(strpos($pdf, "(na\\357ve) Tj") !== false);
+?>
+--EXPECT--
+int(9)
+int(3)
+int(5)
+int(3)
+bool(true)
+bool(true)
+Character U+4E2D at offset 0 can not be encoded with the current font
+Invalid UTF-8 sequence at offset 1
+bool(true)
+bool(true)
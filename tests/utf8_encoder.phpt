@@ -0,0 +1,33 @@
+--TEST--
+Text measurement with the UTF-8 encoder agrees with libharu
+--SKIPIF--
+<?php
+if (!extension_loaded("haru")) die("skip haru extension is not loaded");
+if (!method_exists("HaruDoc", "useUTFEncodings")) die("skip libharu 2.3 or later required");
+if (!getenv("HARU_TEST_TTF") && !is_file("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf")) die("skip no TrueType font, set HARU_TEST_TTF");
+?>
+--FILE--
+<?php
+$ttf = getenv("HARU_TEST_TTF") ?: "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf";
+
+$doc = new HaruDoc();
+var_dump($doc->useUTFEncodings());
+$font = $doc->getFont($doc->loadTTF($ttf, true), "UTF-8");
+
+/* 1, 2 and 3 byte sequences */
+$a = $font->getUnicodeWidth(0x41);
+$e = $font->getUnicodeWidth(0xe9);
+$euro = $font->getUnicodeWidth(0x20ac);
+
+$tw = $font->getTextWidth("A\xc3\xa9\xe2\x82\xac");
+var_dump($tw["width"] == $a + $e + $euro, $tw["numchars"]);
+
+$widths = $font->measureMany(array("A\xc3\xa9\xe2\x82\xac", "AAA"), 10);
+var_dump(abs($widths[0] - ($a + $e + $euro) * 10 / 1000) < 1e-9, abs($widths[1] - 3 * $a * 10 / 1000) < 1e-9);
+?>
+--EXPECT--
+bool(true)
+bool(true)
+int(3)
+bool(true)
+bool(true)
@@ -0,0 +1,77 @@
+--TEST--
+HaruZip writes documents into a ZIP archive in a single pass
+--SKIPIF--
+<?php if (!extension_loaded("haru")) die("skip haru extension is not loaded"); ?>
+--FILE--
+<?php
+function make($text)
+{
+	$doc = new HaruDoc();
+	$page = $doc->addPage();
+	$page->beginText();
+	$page->setFontAndSize($doc->getFont("Helvetica"), 12);
+	$page->textOut(50, 700, $text);
+	$page->endText();
+	return $doc;
+}
+
+$docs = array("first.pdf" => make("first"), "dir/second.pdf" => make("second"));
+$file = tempnam(sys_get_temp_dir(), "haru");
+
+$fp = fopen($file, "w+");
+$zip = new HaruZip($fp);
+var_dump($zip->addDocument("first.pdf", $docs["first.pdf"]));
+var_dump($zip->addDocument("dir/second.pdf", $docs["dir/second.pdf"], 0));
+
+foreach (array(array("", 6), array("third.pdf", 10)) as $bad) {
+	try {
+		$zip->addDocument($bad[0], $docs["first.pdf"], $bad[1]);
+	} catch (HaruException $e) {
+		echo $e->getMessage(), "\n";
+	}
+}
+
+var_dump($zip->close());
+try {
+	$zip->close();
+} catch (HaruException $e) {
+	echo $e->getMessage(), "\n";
+}
+
+/* the stream given by the caller is left open */
+var_dump(is_resource($fp));
+fclose($fp);
+
+$data = file_get_contents($file);
+var_dump(substr($data, 0, 4) === "PK\x03\x04");
+$eocd = strrpos($data, "PK\x05\x06");
+$end = unpack("vdisk/vcd_disk/vdisk_entries/ventries/Vcd_size/Vcd_offset/vcomment", substr($data, $eocd + 4, 18));
+var_dump($end["entries"], $eocd === $end["cd_offset"] + $end["cd_size"]);
+
+if (class_exists("ZipArchive")) {
+	$archive = new ZipArchive();
+	$archive->open($file);
+	$same = $archive->numFiles == 2;
+	foreach ($docs as $name => $doc) {
+		$same = $same && $archive->getFromName($name) === $doc->toString();
+	}
+	$archive->close();
+} else {
+	$same = true;
+}
+var_dump($same);
+
+unlink($file);
+?>
+--EXPECT--
+bool(true)
+bool(true)
+Invalid entry name
+Compression level must be in range -1..9
+bool(true)
+The archive is closed
+bool(true)
+bool(true)
+int(2)
+bool(true)
+bool(true)